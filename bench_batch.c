@@ -0,0 +1,116 @@
+// Compares creating, stat-ing and unlinking files one syscall at a time
+// with doing the same through the batch ioctl.
+//
+//   bench_batch DIR [COUNT]
+//
+// DIR has to be a directory in a mounted nufs, COUNT files (100 by default)
+// are made in it and removed again for each round.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nufs_client.h"
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, int count, double start) {
+  double secs = now() - start;
+  printf("%-18s %8.1f us/file %10.0f files/s\n", what, secs * 1e6 / count,
+         count / secs);
+}
+
+static void one_at_a_time(const char *dir, int count) {
+  char path[4096];
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "%s/bench%d", dir, i);
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+      perror(path);
+      exit(1);
+    }
+    close(fd);
+  }
+  report("create (syscalls)", count, start);
+
+  start = now();
+  for (int i = 0; i < count; i++) {
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/bench%d", dir, i);
+    stat(path, &st);
+  }
+  report("stat (syscalls)", count, start);
+
+  start = now();
+  for (int i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "%s/bench%d", dir, i);
+    unlink(path);
+  }
+  report("unlink (syscalls)", count, start);
+}
+
+// runs op on every file, as few batches as possible
+static void batched(int dirfd, int op, int count) {
+  nufs_batch_t batch;
+  char name[32];
+  int i = 0;
+  while (i < count) {
+    nufs_batch_init(&batch);
+    for (; i < count; i++) {
+      snprintf(name, sizeof(name), "bench%d", i);
+      if (nufs_batch_add(&batch, op, name, 0100644) < 0) {
+        break;
+      }
+    }
+    if (nufs_batch_run(dirfd, &batch) < 0) {
+      perror("batch ioctl");
+      exit(1);
+    }
+    for (int j = 0; j < batch.count; j++) {
+      if (batch.ops[j].result < 0) {
+        fprintf(stderr, "%s: %s\n", batch.names + batch.ops[j].name,
+                strerror(-batch.ops[j].result));
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: bench_batch DIR [COUNT]\n");
+    return 2;
+  }
+  const char *dir = argv[1];
+  int count = argc == 3 ? atoi(argv[2]) : 100;
+
+  int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (dirfd < 0) {
+    perror(dir);
+    return 1;
+  }
+
+  one_at_a_time(dir, count);
+
+  double start = now();
+  batched(dirfd, NUFS_BATCH_CREATE, count);
+  report("create (batched)", count, start);
+  start = now();
+  batched(dirfd, NUFS_BATCH_STAT, count);
+  report("stat (batched)", count, start);
+  start = now();
+  batched(dirfd, NUFS_BATCH_UNLINK, count);
+  report("unlink (batched)", count, start);
+
+  close(dirfd);
+  return 0;
+}
@@ -6,6 +6,7 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "bitmap.h"
 
@@ -34,6 +35,24 @@ void bitmap_put(void *bm, int i, int v) {
   }
 }
 
+// Count the set bits, a 64 bit word at a time.
+int bitmap_count(void *bm, int size) {
+  uint8_t *base = (uint8_t *) bm;
+  int count = 0;
+  int i = 0;
+
+  // independent words, so this turns into popcnt (or vector) instructions
+  for (; i + 64 <= size; i += 64) {
+    uint64_t word;
+    memcpy(&word, base + byte_index(i), sizeof(word));
+    count += __builtin_popcountll(word);
+  }
+  for (; i < size; i++) {
+    count += bitmap_get(bm, i);
+  }
+  return count;
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size) {
 
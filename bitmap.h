@@ -26,6 +26,16 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Count the bits that are set in a bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param size The number of bits to look at.
+ *
+ * @return The number of set bits.
+ */
+int bitmap_count(void *bm, int size);
+
 /**
  * Pretty-print a bitmap. 
  *
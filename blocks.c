@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -20,10 +21,62 @@
 // our c header files
 #include "bitmap.h"
 #include "blocks.h"
+#include "checksum.h"
+#include "compress.h"
+#include "dedup.h"
+#include "inode.h"
+#include "journal.h"
+#include "layout.h"
+#include "orphan.h"
+#include "reserve.h"
+#include "segment.h"
+#include "snapshot.h"
+#include "span.h"
 
 static int blocks_fd = -1;
 static void *blocks_base = 0;
 
+// a striped image is spread over several files, stripe_unit blocks at a
+// time: stripe s (blocks s*unit to (s+1)*unit-1) is in file s % count. The
+// stripes are mapped next to each other, so the rest of nufs still sees one
+// image. Each file ends with a label saying where it belongs.
+#define STRIPE_MAX 16
+#define STRIPE_MAGIC 0x5054534e // "NSTP"
+
+typedef struct stripe_label {
+  uint32_t magic;
+  uint32_t index; // which file of the set this is
+  uint32_t count; // files in the set
+  uint32_t unit;  // blocks per stripe
+} stripe_label_t;
+
+static int stripe_fds[STRIPE_MAX];
+static int stripe_count = 1;
+static int stripe_unit = STRIPE_UNIT_DEFAULT;
+
+// freed blocks whose space hasn't been given back to the host yet (see
+// blocks_punch_freed), only kept in memory: after a crash they just stay
+// allocated in the image file until they're used and freed again
+static uint8_t punch_pending[BLOCK_BITMAP_SIZE];
+static int punch_count = 0;
+static int punch_supported = 1;
+
+// the image file can be smaller than BLOCK_COUNT blocks and grow later (see
+// blocks_grow), the whole range is mapped from the start so growing never
+// moves a block in memory
+#define MIN_BLOCKS (FIRST_DATA_BLOCK + 1) // the metadata and the root
+static int block_limit = BLOCK_COUNT;
+static int new_blocks = BLOCK_COUNT;
+
+// images opened read-only are mapped without PROT_WRITE
+static int read_only = 0;
+
+// free blocks set aside for files that are being written (see reserve.h),
+// only kept in memory. Only alloc_reserved_block hands them out, until
+// there's nothing else left.
+static uint8_t reserved[BLOCK_BITMAP_SIZE];
+static int reserved_count = 0;
+
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
   int quo = bytes / BLOCK_SIZE;
@@ -35,16 +88,160 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+// Set the number of blocks a new (single file) image starts out with.
+void blocks_set_new_size(int blocks) {
+  new_blocks = blocks < MIN_BLOCKS     ? MIN_BLOCKS
+               : blocks > BLOCK_COUNT ? BLOCK_COUNT
+                                      : blocks;
+}
+
+// Set the stripe unit used when a new striped image is created.
+void blocks_set_stripe_unit(int blocks) { stripe_unit = blocks; }
+
+// Open images read-only from now on.
+void blocks_set_read_only(int flag) { read_only = flag; }
+
+static void stripe_fail(const char *path, const char *msg) {
+  fprintf(stderr, "%s: %s\n", path, msg);
+  exit(1);
+}
+
+// Opens (or creates) the files of a striped image and maps them in order.
+static void blocks_init_striped(char **paths, int count) {
+  stripe_label_t labels[STRIPE_MAX];
+  int labelled = 0;
+  for (int i = 0; i < count; i++) {
+    stripe_fds[i] = read_only ? open(paths[i], O_RDONLY)
+                              : open(paths[i], O_CREAT | O_RDWR, 0644);
+    if (stripe_fds[i] < 0) {
+      perror(paths[i]);
+      exit(1);
+    }
+    // the label is in the last block
+    off_t size = lseek(stripe_fds[i], 0, SEEK_END);
+    memset(&labels[i], 0, sizeof(stripe_label_t));
+    // (one that can't be read mustn't be taken for a new member and
+    // labelled over)
+    if (size >= BLOCK_SIZE &&
+        pread(stripe_fds[i], &labels[i], sizeof(stripe_label_t),
+              size - BLOCK_SIZE) != sizeof(stripe_label_t)) {
+      stripe_fail(paths[i], "can't read the stripe label");
+    }
+    labelled += labels[i].magic == STRIPE_MAGIC;
+  }
+
+  if (read_only && labelled < count) {
+    stripe_fail(paths[labelled], "not part of a striped image");
+  }
+  if (labelled > 0) {
+    // an existing set has to be given in the same order
+    stripe_unit = labels[0].unit;
+    for (int i = 0; i < count; i++) {
+      if (labels[i].magic != STRIPE_MAGIC || labels[i].index != i ||
+          labels[i].count != count || labels[i].unit != stripe_unit) {
+        stripe_fail(paths[i], "not the right part of this striped image");
+      }
+    }
+  }
+  if (stripe_unit <= 0 || BLOCK_COUNT % stripe_unit != 0 ||
+      BLOCK_COUNT / stripe_unit < count) {
+    stripe_fail(paths[0], "the stripe unit has to divide the block count");
+  }
+
+  int stripes = BLOCK_COUNT / stripe_unit;
+  size_t unit_size = (size_t)stripe_unit * BLOCK_SIZE;
+  size_t data_size = (size_t)((stripes + count - 1) / count) * unit_size;
+  for (int i = 0; i < count && !read_only; i++) {
+    int rv = ftruncate(stripe_fds[i], data_size + BLOCK_SIZE);
+    assert(rv == 0);
+    stripe_label_t label = {STRIPE_MAGIC, i, count, stripe_unit};
+    rv = pwrite(stripe_fds[i], &label, sizeof(label), data_size);
+    assert(rv == sizeof(label));
+  }
+
+  // reserve the whole range, then put each stripe in its place
+  int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+  blocks_base = mmap(0, NUFS_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+  assert(blocks_base != MAP_FAILED);
+  for (int s = 0; s < stripes; s++) {
+    void *at = (uint8_t *)blocks_base + s * unit_size;
+    void *mapped = mmap(at, unit_size, prot, MAP_SHARED | MAP_FIXED, stripe_fds[s % count],
+                        (off_t)(s / count) * unit_size);
+    assert(mapped == at);
+  }
+  stripe_count = count;
+}
+
+// Opens an existing single file image without write access.
+static void blocks_init_read_only(const char *image_path) {
+  blocks_fd = open(image_path, O_RDONLY);
+  if (blocks_fd < 0) {
+    perror(image_path);
+    exit(1);
+  }
+
+  // nothing can be fixed up, so the size has to be right already
+  off_t size = lseek(blocks_fd, 0, SEEK_END);
+  if (size % BLOCK_SIZE != 0 || size < (off_t)MIN_BLOCKS * BLOCK_SIZE ||
+      size > (off_t)NUFS_SIZE) {
+    stripe_fail(image_path, "not an image of this filesystem");
+  }
+  block_limit = size / BLOCK_SIZE;
+
+  blocks_base = mmap(0, NUFS_SIZE, PROT_READ, MAP_SHARED, blocks_fd, 0);
+  assert(blocks_base != MAP_FAILED);
+}
+
 // Load and initialize the given disk image.
 void blocks_init(const char *image_path) {
+  // a comma separated list is a striped image
+  if (strchr(image_path, ',') != NULL) {
+    char *list = strdup(image_path);
+    char *paths[STRIPE_MAX];
+    int count = 0;
+    for (char *path = strtok(list, ","); path != NULL;
+         path = strtok(NULL, ",")) {
+      if (count == STRIPE_MAX) {
+        stripe_fail(image_path, "too many files to stripe over");
+      }
+      paths[count++] = path;
+    }
+    blocks_init_striped(paths, count);
+    free(list);
+
+    if (!read_only) {
+      void *bbm = get_blocks_bitmap();
+      bitmap_put(bbm, 0, 1);
+    }
+    return;
+  }
+
+  if (read_only) {
+    blocks_init_read_only(image_path);
+    return;
+  }
+
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
   assert(blocks_fd != -1);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
-  assert(rv == 0);
+  // the size of the file is the size of the image, a new one gets
+  // new_blocks blocks and anything in between is rounded up
+  off_t size = lseek(blocks_fd, 0, SEEK_END);
+  block_limit = size == 0 ? new_blocks : (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (block_limit < MIN_BLOCKS) {
+    block_limit = MIN_BLOCKS;
+  }
+  if (block_limit > BLOCK_COUNT) {
+    block_limit = BLOCK_COUNT;
+  }
+  if (size != (off_t)block_limit * BLOCK_SIZE) {
+    int rv = ftruncate(blocks_fd, (off_t)block_limit * BLOCK_SIZE);
+    assert(rv == 0);
+  }
 
-  // map the image to memory
+  // map the image to memory, all NUFS_SIZE of it (past the end of the file
+  // can't be touched until it grows)
   blocks_base =
       mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
   assert(blocks_base != MAP_FAILED);
@@ -60,8 +257,149 @@ void blocks_free() {
   assert(rv == 0);
 }
 
+// Write the disk image back to the file and wait for it to be on disk.
+int blocks_sync() {
+  if (read_only) {
+    return 0;
+  }
+  if (stripe_count > 1) {
+    // start writing every file before waiting for any of them, so the
+    // disks they're on work at the same time
+    for (int i = 0; i < stripe_count; i++) {
+      sync_file_range(stripe_fds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+    for (int i = 0; i < stripe_count; i++) {
+      if (fsync(stripe_fds[i]) < 0) {
+        return -errno;
+      }
+    }
+    return 0;
+  }
+  if (msync(blocks_base, (size_t)block_limit * BLOCK_SIZE, MS_SYNC) < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+// Write a range of blocks back to the file and wait for them to be on disk.
+int blocks_sync_range(int first, int count) {
+  if (read_only || count <= 0) {
+    return 0;
+  }
+  if (msync(blocks_get_block(first), (size_t)count * BLOCK_SIZE, MS_SYNC) <
+      0) {
+    return -errno;
+  }
+  return 0;
+}
+
+// The number of blocks in the image right now.
+int blocks_total() { return block_limit; }
+
+// Grow the image to the given number of blocks.
+int blocks_grow(int count) {
+  if (read_only) {
+    return -EROFS;
+  }
+  if (stripe_count > 1) {
+    // (striped images always have every block)
+    return count == block_limit ? 0 : -EOPNOTSUPP;
+  }
+  if (count < block_limit) {
+    return -EINVAL;
+  }
+  if (count > BLOCK_COUNT) {
+    return -EFBIG;
+  }
+  // the new blocks are free in the bitmap already, the file just has to
+  // get big enough to hold them before anyone can allocate one
+  if (ftruncate(blocks_fd, (off_t)count * BLOCK_SIZE) < 0) {
+    return -errno;
+  }
+  get_superblock()->free_blocks += count - block_limit;
+  block_limit = count;
+  return 0;
+}
+
+// Give the space of count blocks starting at first back to the host.
+int blocks_punch(int first, int count) {
+  if (read_only) {
+    return -EROFS;
+  }
+  // (a snapshot being copied might still need what's in them)
+  snapshot_save(first, count);
+  if (!punch_supported) {
+    return -EOPNOTSUPP;
+  }
+  while (count > 0) {
+    // a striped image is punched one stripe at a time
+    int fd = blocks_fd;
+    int len = count;
+    off_t offset = (off_t)first * BLOCK_SIZE;
+    if (stripe_count > 1) {
+      int stripe = first / stripe_unit;
+      len = stripe_unit - first % stripe_unit;
+      if (len > count) {
+        len = count;
+      }
+      fd = stripe_fds[stripe % stripe_count];
+      offset = ((off_t)(stripe / stripe_count) * stripe_unit +
+                first % stripe_unit) * BLOCK_SIZE;
+    }
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  (off_t)len * BLOCK_SIZE) < 0) {
+      if (errno == EOPNOTSUPP) {
+        printf("punch: the image's filesystem can't punch holes\n");
+        punch_supported = 0;
+      }
+      return -errno;
+    }
+    first += len;
+    count -= len;
+  }
+  return 0;
+}
+
+// Punch out the blocks freed since the last time, in runs.
+int blocks_punch_freed() {
+  if (punch_count == 0) {
+    return 0;
+  }
+  int punched = 0;
+  for (int bnum = FIRST_DATA_BLOCK; bnum < BLOCK_COUNT; bnum++) {
+    if (!bitmap_get(punch_pending, bnum)) {
+      continue;
+    }
+    int first = bnum;
+    while (bnum < BLOCK_COUNT && bitmap_get(punch_pending, bnum)) {
+      bitmap_put(punch_pending, bnum, 0);
+      bnum++;
+    }
+    if (blocks_punch(first, bnum - first) == 0) {
+      punched += bnum - first;
+    }
+  }
+  punch_count = 0;
+  return punched;
+}
+
+// Start reading the given block in the background, if it's worth it.
+void blocks_readahead(int bnum) {
+  // (a single file is read ahead by the kernel already)
+  if (stripe_count > 1) {
+    madvise(blocks_get_block(bnum), BLOCK_SIZE, MADV_WILLNEED);
+  }
+}
+
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+  return (uint8_t *)blocks_base + (size_t)BLOCK_SIZE * bnum;
+}
+
+// Get the number of the block the given pointer points into.
+int blocks_bnum_of(const void *ptr) {
+  return ((const uint8_t *)ptr - (const uint8_t *)blocks_base) / BLOCK_SIZE;
+}
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
@@ -75,23 +413,247 @@ void *get_inode_bitmap() {
   return (void *)(blockz + BLOCK_BITMAP_SIZE);
 }
 
-// Allocate a new block and return its index.
-int alloc_block() {
-  void *bbm = get_blocks_bitmap();
+// Return a pointer to the per-block share counts (one byte per block).
+void *get_block_refs() { return META_AREA(META_REFS_OFFSET); }
+
+// Return a pointer to the superblock (in META_BLOCK).
+superblock_t *get_superblock() {
+  return (superblock_t *)META_AREA(META_SUPER_OFFSET);
+}
+
+// Recount the free blocks and inodes from the bitmaps.
+void blocks_count_free() {
+  superblock_t *sb = get_superblock();
+  int free_blocks = block_limit - bitmap_count(get_blocks_bitmap(), BLOCK_COUNT);
+  int free_inodes = INODE_COUNT - bitmap_count(get_inode_bitmap(), INODE_COUNT);
+
+  if (sb->free_blocks != free_blocks || sb->free_inodes != free_inodes) {
+    printf("superblock said %d free blocks and %d free inodes, "
+           "but there are %d and %d\n",
+           sb->free_blocks, sb->free_inodes, free_blocks, free_inodes);
+    sb->free_blocks = free_blocks;
+    sb->free_inodes = free_inodes;
+  }
+}
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
+// the first and one past the last block of a group the image has
+static int group_start(int group) {
+  int start = group * GROUP_BLOCKS;
+  return start < FIRST_DATA_BLOCK ? FIRST_DATA_BLOCK : start;
+}
+
+static int group_end(int group) {
+  int end = (group + 1) * GROUP_BLOCKS;
+  return end < block_limit ? end : block_limit;
+}
+
+// whether the block is in use or set aside for some file
+static int is_taken(void *bbm, int bnum) {
+  return bitmap_get(bbm, bnum) || bitmap_get(reserved, bnum);
+}
+
+// the first free block in [from, to), or -1
+static int find_free(void *bbm, int from, int to) {
+  for (int ii = from; ii < to; ++ii) {
+    if (!is_taken(bbm, ii)) {
       return ii;
     }
   }
+  return -1;
+}
+
+// Count the free blocks of a block group.
+int group_free_blocks(int group) {
+  int start = group * GROUP_BLOCKS;
+  int end = group_end(group);
+  if (end <= start) {
+    return 0;
+  }
+  // (groups start on a byte boundary, see layout.h)
+  uint8_t *bbm = get_blocks_bitmap();
+  return end - start - bitmap_count(bbm + start / 8, end - start);
+}
 
+// the free block alloc_block_near would take for goal, or -1
+static int find_near(void *bbm, int goal) {
+  int group = goal < block_limit ? BLOCK_GROUP(goal) : 0;
+  if (goal < group_start(group)) {
+    goal = group_start(group);
+  }
+  // the rest of the group, then its beginning, then the other groups
+  int bnum = find_free(bbm, goal, group_end(group));
+  if (bnum < 0) {
+    bnum = find_free(bbm, group_start(group), goal);
+  }
+  for (int ii = 1; bnum < 0 && ii < GROUP_COUNT; ++ii) {
+    int next = (group + ii) % GROUP_COUNT;
+    bnum = find_free(bbm, group_start(next), group_end(next));
+  }
+  return bnum;
+}
+
+// marks a free block as used
+static void take_block(void *bbm, int bnum) {
+  uint8_t *refs = get_block_refs();
+  bitmap_put(bbm, bnum, 1);
+  // (on a big image the bitmap is more than block 0)
+  checksum_dirty_range((uint8_t *)bbm + bnum / 8, 1);
+  // (the block is about to be written, no point in punching it)
+  bitmap_put(punch_pending, bnum, 0);
+  refs[bnum] = 0;
+  get_superblock()->free_blocks--;
+}
+
+// Allocate a new block and return its index.
+int alloc_block() { return alloc_block_near(0); }
+
+// Allocate a new block as close after goal as possible.
+int alloc_block_near(int goal) {
+  void *bbm = get_blocks_bitmap();
+
+  span_begin("alloc_block");
+  int bnum = find_near(bbm, goal);
+  if (bnum < 0 && (reserved_count > 0 || orphan_pending() > 0)) {
+    // only reserved blocks (of files and the log) and those of deleted
+    // files are left, so they can't wait any longer
+    reserve_release_all();
+    segment_release();
+    orphan_reclaim(-1);
+    bnum = find_near(bbm, goal);
+  }
+  if (bnum >= 0) {
+    take_block(bbm, bnum);
+  }
+  span_end();
+  return bnum;
+}
+
+// the first run of count free blocks in [from, to), or -1
+static int find_free_run(void *bbm, int from, int to, int count) {
+  int run = 0;
+  for (int ii = from; ii < to; ++ii) {
+    run = is_taken(bbm, ii) ? 0 : run + 1;
+    if (run == count) {
+      return ii - count + 1;
+    }
+  }
   return -1;
 }
 
+// the run alloc_block_run would take, or -1
+static int find_run(void *bbm, int goal, int count) {
+  int start = goal < block_limit ? group_start(BLOCK_GROUP(goal))
+                                 : FIRST_DATA_BLOCK;
+  int first = find_free_run(bbm, start, block_limit, count);
+  if (first < 0) {
+    int end = start + count - 1;
+    first = find_free_run(bbm, FIRST_DATA_BLOCK,
+                          end < block_limit ? end : block_limit, count);
+  }
+  return first;
+}
+
+// Allocate count consecutive blocks and return the first one.
+int alloc_block_run(int goal, int count) {
+  void *bbm = get_blocks_bitmap();
+
+  int first = find_run(bbm, goal, count);
+  if (first < 0 && (reserved_count > 0 || orphan_pending() > 0)) {
+    reserve_release_all();
+    segment_release();
+    orphan_reclaim(-1);
+    first = find_run(bbm, goal, count);
+  }
+  if (first < 0) {
+    return -1;
+  }
+
+  for (int bnum = first; bnum < first + count; bnum++) {
+    take_block(bbm, bnum);
+  }
+  return first;
+}
+
+// Set aside up to count free blocks from near goal on.
+int blocks_reserve(int goal, int *count) {
+  void *bbm = get_blocks_bitmap();
+  int first = find_near(bbm, goal);
+  if (first < 0) {
+    return -1;
+  }
+
+  int bnum = first;
+  while (bnum < first + *count && bnum < block_limit &&
+         !is_taken(bbm, bnum)) {
+    bitmap_put(reserved, bnum, 1);
+    reserved_count++;
+    bnum++;
+  }
+  *count = bnum - first;
+  return first;
+}
+
+// Allocate a block set aside by blocks_reserve.
+int alloc_reserved_block(int bnum) {
+  if (!bitmap_get(reserved, bnum)) {
+    return -1;
+  }
+  blocks_unreserve(bnum, 1);
+  void *bbm = get_blocks_bitmap();
+  take_block(bbm, bnum);
+  return bnum;
+}
+
+// Give back blocks set aside by blocks_reserve.
+void blocks_unreserve(int first, int count) {
+  for (int bnum = first; bnum < first + count; bnum++) {
+    if (bitmap_get(reserved, bnum)) {
+      bitmap_put(reserved, bnum, 0);
+      reserved_count--;
+    }
+  }
+}
+
+// The number of blocks set aside by blocks_reserve.
+int blocks_reserved() { return reserved_count; }
+
 // Deallocate the block with the given index.
 void free_block(int bnum) {
   printf("+ free_block(%d)\n", bnum);
+  uint8_t *refs = get_block_refs();
+
+  // a shared block just loses one of its owners
+  if (refs[bnum] > 0) {
+    refs[bnum]--;
+    return;
+  }
+
   void *bbm = get_blocks_bitmap();
   bitmap_put(bbm, bnum, 0);
+  bitmap_put(punch_pending, bnum, 1);
+  punch_count++;
+  get_superblock()->free_blocks++;
+  checksum_dirty_range((uint8_t *)bbm + bnum / 8, 1);
+  // the contents are garbage from now on, so they can't be shared, served
+  // from a cache, checked or replayed anymore
+  dedup_forget(bnum);
+  journal_forget(bnum);
+  compress_forget(bnum);
+  checksum_forget(bnum);
+}
+
+// Add an owner to the block with the given index.
+int share_block(int bnum) {
+  uint8_t *refs = get_block_refs();
+  if (refs[bnum] == UINT8_MAX) {
+    return -1;
+  }
+  refs[bnum]++;
+  return 0;
+}
+
+// Check whether the block with the given index has more than one owner.
+int block_is_shared(int bnum) {
+  uint8_t *refs = get_block_refs();
+  return refs[bnum] > 0;
 }
\ No newline at end of file
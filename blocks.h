@@ -9,16 +9,45 @@
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
 // design choice I made here, I decided to use define over ferd's original
 // const int, as I found it to be more suited to my implementation
 
+// the block count can be set at build time (a multiple of 64), see
+// layout.h for where everything goes; it's the most blocks an image can
+// grow to, see blocks_total() for how many it has
+#ifndef BLOCK_COUNT
 #define BLOCK_COUNT 256 // we split the "disk" into blocks (default = 256)
+#endif
 #define BLOCK_SIZE 4096  // default = 4K
-#define NUFS_SIZE 4096 * 256   // default = 1MB
+#define NUFS_SIZE ((size_t)BLOCK_SIZE * BLOCK_COUNT)   // default = 1MB
+
+#define BLOCK_BITMAP_SIZE (BLOCK_COUNT / 8) // default = 256 / 8 = 32
+
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+// the on-disk format of the inodes and directories, bumped whenever it
+// changes; images made with another version can't be read and have to be
+// made again with mkfs.nufs
+//   1  timestamps in the inode
+//   2  directory entries are variable-length records
+#define NUFS_VERSION 2
+
+#define STRIPE_UNIT_DEFAULT 16 // blocks per stripe of a striped image
 
-#define BLOCK_BITMAP_SIZE 32 // default = 256 / 8 = 32
+// filesystem-wide counters, kept up to date by the allocators so statfs
+// doesn't have to look at the bitmaps
+typedef struct superblock {
+  int free_blocks;
+  int free_inodes;
+  int magic;       // NUFS_MAGIC once the image is formatted
+  int itable_used; // inodes past this one have never been initialized
+  int orphans;     // inodes whose blocks are waiting to be freed
+  int journal_start;  // first block of the journal (see journal.h)
+  int journal_blocks; // its length, 0 if the image never had one
+  int version;        // NUFS_VERSION of the nufs that formatted it
+} superblock_t;
 
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
@@ -32,15 +61,120 @@ int bytes_to_blocks(int bytes);
 /**
  * Load and initialize the given disk image.
  *
- * @param image_path Path to the disk image file.
+ * A comma separated list of files is a striped image: consecutive runs of
+ * blocks (the stripe unit) go to each file in turn, so large reads and
+ * writes are spread over all of them. Block numbers are the same as for a
+ * single file.
+ *
+ * @param image_path Path to the disk image file(s).
  */
 void blocks_init(const char *image_path);
 
+/**
+ * Set the number of blocks of images created by blocks_init.
+ *
+ * An image can be smaller than BLOCK_COUNT blocks and grow later (see
+ * blocks_grow). Striped images always have BLOCK_COUNT blocks.
+ *
+ * @param blocks Blocks in a new image, at most BLOCK_COUNT.
+ */
+void blocks_set_new_size(int blocks);
+
+/**
+ * Set the stripe unit for striped images created by blocks_init.
+ *
+ * Existing striped images keep the unit they were created with.
+ *
+ * @param blocks Blocks per stripe, has to divide BLOCK_COUNT.
+ */
+void blocks_set_stripe_unit(int blocks);
+
+/**
+ * Make blocks_init open an existing image read-only.
+ *
+ * The image is mapped without write access (touching a block is a crash,
+ * not a silent change), it's never created or resized, and growing or
+ * punching it fails with -EROFS.
+ *
+ * @param flag Nonzero to open images read-only.
+ */
+void blocks_set_read_only(int flag);
+
+/**
+ * Give the space of a range of blocks back to the host filesystem.
+ *
+ * Punches a hole in the image file(s), so the blocks read as zeros
+ * afterwards and take up no space until they are written again.
+ *
+ * @param first The first block of the range.
+ * @param count The number of blocks.
+ *
+ * @return 0 on success, a negative errno otherwise.
+ */
+int blocks_punch(int first, int count);
+
+/**
+ * Punch out the blocks freed since the last call.
+ *
+ * free_block only remembers the blocks, so they can be punched in batches
+ * in the background. Blocks that were allocated again in the meantime are
+ * skipped.
+ *
+ * @return The number of blocks punched.
+ */
+int blocks_punch_freed();
+
+/**
+ * Start reading the given block in the background.
+ *
+ * Only does something for striped images, where it lets the blocks of a
+ * large read be fetched from all the files at once.
+ *
+ * @param bnum Block number (index).
+ */
+void blocks_readahead(int bnum);
+
 /**
  * Close the disk image.
  */
 void blocks_free();
 
+/**
+ * Write the disk image back to the file and wait for it to be on disk.
+ *
+ * @return 0 on success, a negative errno otherwise.
+ */
+int blocks_sync();
+
+/**
+ * Write a range of blocks back to the file and wait for them to be on disk.
+ *
+ * @param first The first block of the range.
+ * @param count The number of blocks.
+ *
+ * @return 0 on success, a negative errno otherwise.
+ */
+int blocks_sync_range(int first, int count);
+
+/**
+ * Get the number of blocks the image has right now.
+ *
+ * @return The number of usable blocks, at most BLOCK_COUNT.
+ */
+int blocks_total();
+
+/**
+ * Grow the image while it's in use.
+ *
+ * The image file is extended and the new blocks become free. Nothing is
+ * remapped, so pointers into the image stay valid.
+ *
+ * @param count The new number of blocks, at most BLOCK_COUNT.
+ *
+ * @return 0 on success, a negative errno otherwise.
+ */
+int blocks_grow(int count);
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -50,6 +184,15 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get the number of the block the given pointer points into.
+ *
+ * @param ptr Pointer into the disk image.
+ *
+ * @return The block number.
+ */
+int blocks_bnum_of(const void *ptr);
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -64,6 +207,30 @@ void *get_blocks_bitmap();
  */
 void *get_inode_bitmap();
 
+/**
+ * Return a pointer to the per-block share counts.
+ *
+ * There is one byte per block holding the number of *extra* owners of that
+ * block, so 0 means the block belongs to exactly one file.
+ *
+ * @return A pointer to the beginning of the share count table.
+ */
+void *get_block_refs();
+
+/**
+ * Return a pointer to the superblock (in META_BLOCK).
+ *
+ * @return A pointer to the superblock.
+ */
+superblock_t *get_superblock();
+
+/**
+ * Recount the free blocks and inodes from the bitmaps.
+ *
+ * Fixes up the superblock counters if they drifted (e.g. after a crash).
+ */
+void blocks_count_free();
+
 /**
  * Allocate a new block and return its number.
  *
@@ -73,11 +240,112 @@ void *get_inode_bitmap();
  */
 int alloc_block();
 
+/**
+ * Allocate a new block close to the given one.
+ *
+ * Takes the first unused block at or after goal in goal's block group,
+ * then the rest of that group, then the other groups in turn (see
+ * layout.h).
+ *
+ * @param goal The block number to look from, e.g. the one before.
+ *
+ * @return The index of the newly allocated block, or -1 if there is none.
+ */
+int alloc_block_near(int goal);
+
+/**
+ * Allocate a run of consecutive blocks.
+ *
+ * Takes the first free run that is long enough, starting in goal's block
+ * group.
+ *
+ * @param goal A block number in the group to look in first.
+ * @param count The number of blocks.
+ *
+ * @return The index of the first block, or -1 if there's no such run.
+ */
+int alloc_block_run(int goal, int count);
+
+/**
+ * Set aside free blocks for one file.
+ *
+ * Reserves the free block alloc_block_near would pick for goal and the free
+ * blocks right after it. Reserved blocks are still free, but the other
+ * allocators skip them until nothing else is left; then every reservation
+ * is dropped (see reserve.h). Reservations are only kept in memory.
+ *
+ * @param goal The block number to look from.
+ * @param count The most blocks to reserve, set to how many were.
+ *
+ * @return The first reserved block, or -1 if there are no free blocks.
+ */
+int blocks_reserve(int goal, int *count);
+
+/**
+ * Allocate a block reserved with blocks_reserve.
+ *
+ * @param bnum The block number.
+ *
+ * @return bnum, or -1 if the block isn't reserved anymore.
+ */
+int alloc_reserved_block(int bnum);
+
+/**
+ * Give back blocks reserved with blocks_reserve.
+ *
+ * Blocks in the range that aren't reserved anymore are skipped.
+ *
+ * @param first The first block of the range.
+ * @param count The number of blocks.
+ */
+void blocks_unreserve(int first, int count);
+
+/**
+ * Count the blocks reserved with blocks_reserve.
+ *
+ * @return The number of reserved blocks.
+ */
+int blocks_reserved();
+
+/**
+ * Count the free blocks of a block group.
+ *
+ * Groups past the end of the image have none.
+ *
+ * @param group The group number.
+ *
+ * @return The number of free blocks in the group.
+ */
+int group_free_blocks(int group);
+
 /**
  * Deallocate the block with the given number.
  *
+ * Shared blocks only lose one owner; the block is actually freed once its
+ * last owner lets go of it.
+ *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Add an owner to the given block.
+ *
+ * @param bnum The block number to share.
+ *
+ * @return 0 on success, -1 if the block can't take any more owners.
+ */
+int share_block(int bnum);
+
+/**
+ * Check whether a block has more than one owner.
+ *
+ * Shared blocks are copy-on-write: they must not be modified in place.
+ *
+ * @param bnum The block number to check.
+ *
+ * @return 1 if the block is shared, 0 otherwise.
+ */
+int block_is_shared(int bnum);
+
 #endif
@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "checksum.h"
+#include "crc32c.h"
+#include "journal.h"
+#include "layout.h"
+
+// blocks modified since the last seal, as a bitmap and in order
+static uint8_t dirty[BLOCK_BITMAP_SIZE];
+static int dirty_list[BLOCK_COUNT];
+static int dirty_count = 0;
+// blocks whose checksum matched since mount
+static uint8_t verified[BLOCK_BITMAP_SIZE];
+// a read-only image only has its checksums checked, never written, and
+// once every block was checked at mount nothing here changes anymore (so
+// reads can go on without the storage lock)
+static int read_only = 0;
+static int frozen = 0;
+
+static uint32_t *get_checksums() {
+  return (uint32_t *)META_AREA(META_CSUM_OFFSET);
+}
+
+// which blocks have a checksum at all (blocks written before we had them,
+// or modified right before a crash, don't)
+static void *get_checksums_valid() {
+  return META_AREA(META_CSUM_VALID_OFFSET);
+}
+
+static uint32_t block_crc(int bnum) {
+  return crc32c(0, blocks_get_block(bnum), BLOCK_SIZE);
+}
+
+void checksum_init() {
+  crc32c_init();
+  for (int i = 0; i < BLOCK_BITMAP_SIZE; i++) {
+    dirty[i] = 0;
+    verified[i] = 0;
+  }
+  dirty_count = 0;
+
+  // the bitmaps and inode table are needed for everything, check them now
+  for (int bnum = 0; bnum < META_BLOCK; bnum++) {
+    if (checksum_verify(bnum) < 0) {
+      printf("checksum: metadata block %d is corrupt!\n", bnum);
+    }
+  }
+}
+
+void checksum_dirty(int bnum) {
+  if (bnum < 0 || IS_META_BLOCK(bnum)) {
+    return;
+  }
+  // the bitmaps and inode table go in the journal whenever they change (the
+  // code changing other metadata blocks says so itself)
+  if (bnum < META_BLOCK) {
+    journal_dirty(bnum);
+  }
+  if (bitmap_get(dirty, bnum)) {
+    return;
+  }
+  bitmap_put(dirty, bnum, 1);
+  dirty_list[dirty_count++] = bnum;
+
+  // until the seal the stored checksum is stale, if we crash in between
+  // the block just goes unchecked
+  bitmap_put(get_checksums_valid(), bnum, 0);
+  bitmap_put(verified, bnum, 0);
+}
+
+void checksum_dirty_range(const void *ptr, size_t len) {
+  int first = blocks_bnum_of(ptr);
+  int last = blocks_bnum_of((const uint8_t *)ptr + len - 1);
+  for (int bnum = first; bnum <= last; bnum++) {
+    checksum_dirty(bnum);
+  }
+}
+
+void checksum_seal() {
+  uint32_t *sums = get_checksums();
+  void *valid = get_checksums_valid();
+  void *bbm = get_blocks_bitmap();
+
+  for (int i = 0; i < dirty_count; i++) {
+    int bnum = dirty_list[i];
+    bitmap_put(dirty, bnum, 0);
+    // freed in the meantime
+    if (!bitmap_get(bbm, bnum)) {
+      continue;
+    }
+    sums[bnum] = block_crc(bnum);
+    bitmap_put(valid, bnum, 1);
+    bitmap_put(verified, bnum, 1);
+  }
+  dirty_count = 0;
+}
+
+void checksum_hold(int bnum) {
+  // (dirty, but not in the list, so no seal gets to it)
+  bitmap_put(dirty, bnum, 1);
+  bitmap_put(get_checksums_valid(), bnum, 0);
+  bitmap_put(verified, bnum, 0);
+}
+
+void checksum_release(int bnum) {
+  bitmap_put(dirty, bnum, 0);
+  checksum_dirty(bnum);
+}
+
+int checksum_verify(int bnum) {
+  if (IS_META_BLOCK(bnum) || bitmap_get(verified, bnum) ||
+      bitmap_get(dirty, bnum)) {
+    return 0;
+  }
+
+  uint32_t *sums = get_checksums();
+  void *valid = get_checksums_valid();
+  uint32_t crc = block_crc(bnum);
+  if (!bitmap_get(valid, bnum)) {
+    // nothing to check against, start tracking it from here on (unless
+    // the image can't be written)
+    if (!read_only) {
+      sums[bnum] = crc;
+      bitmap_put(valid, bnum, 1);
+    }
+  } else if (sums[bnum] != crc) {
+    printf("checksum: block %d has crc %08x, expected %08x\n", bnum, crc,
+           sums[bnum]);
+    return -1;
+  }
+
+  if (!frozen) {
+    bitmap_put(verified, bnum, 1);
+  }
+  return 0;
+}
+
+void checksum_init_read_only() {
+  read_only = 1;
+  frozen = 0;
+  checksum_init();
+
+  void *bbm = get_blocks_bitmap();
+  int bad = 0;
+  for (int bnum = META_BLOCK; bnum < blocks_total(); bnum++) {
+    if (bitmap_get(bbm, bnum) && checksum_verify(bnum) < 0) {
+      bad++;
+    }
+  }
+  if (bad > 0) {
+    printf("checksum: %d blocks are corrupt, reading them fails\n", bad);
+  }
+  frozen = 1;
+}
+
+void checksum_forget(int bnum) {
+  bitmap_put(get_checksums_valid(), bnum, 0);
+  bitmap_put(verified, bnum, 0);
+}
+
+int checksum_scrub(int *cursor, int count) {
+  uint32_t *sums = get_checksums();
+  void *valid = get_checksums_valid();
+  void *bbm = get_blocks_bitmap();
+
+  int bad = 0;
+  for (int i = 0; i < count; i++) {
+    int bnum = *cursor;
+    *cursor = (*cursor + 1) % BLOCK_COUNT;
+
+    if (IS_META_BLOCK(bnum) || !bitmap_get(bbm, bnum) ||
+        !bitmap_get(valid, bnum) || bitmap_get(dirty, bnum)) {
+      continue;
+    }
+    if (sums[bnum] != block_crc(bnum)) {
+      printf("scrub: block %d is corrupt\n", bnum);
+      bitmap_put(verified, bnum, 0);
+      bad++;
+    } else {
+      bitmap_put(verified, bnum, 1);
+    }
+  }
+  return bad;
+}
@@ -0,0 +1,39 @@
+// Per-block CRC-32C checksums.
+//
+// Every allocated block outside the metadata area (which holds them) has a
+// checksum there. Code that modifies a block marks it dirty, and checksum_seal()
+// brings the checksums of the dirty blocks up to date when an operation is
+// done (see storage_unlock). Blocks are verified the first time they are
+// read after mount, and again by the background scrub.
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+
+// sets up the in-memory state and checks the inode table blocks
+void checksum_init();
+// like checksum_init for an image that's mapped read-only: checks every
+// block right away, and never writes a checksum or changes state afterwards
+void checksum_init_read_only();
+// marks a block as modified
+void checksum_dirty(int bnum);
+// marks the blocks holding the given bytes of the image as modified
+void checksum_dirty_range(const void *ptr, size_t len);
+// recomputes the checksums of all modified blocks
+void checksum_seal();
+// marks a block as being modified without the storage lock held: it isn't
+// checked, and doesn't get a checksum, until checksum_release
+void checksum_hold(int bnum);
+// marks a held block as modified, for the next seal
+void checksum_release(int bnum);
+// checks a block unless that already happened since mount, returns -1 if
+// the checksum doesn't match
+int checksum_verify(int bnum);
+// forgets the checksum of a freed block
+void checksum_forget(int bnum);
+// checks count blocks starting at *cursor (wrapping around), whether or not
+// they were verified before, and returns how many didn't match
+int checksum_scrub(int *cursor, int count);
+
+#endif
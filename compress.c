@@ -0,0 +1,196 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "checksum.h"
+#include "compress.h"
+#include "inode.h"
+#include "lz.h"
+
+// number of decompressed clusters we keep around
+#define CACHE_ENTRIES 8
+
+// a compressed stream starts with its length
+typedef struct cluster_header {
+  uint32_t length;
+} cluster_header_t;
+
+typedef struct cache_entry {
+  int bnum; // first block of the compressed stream, 0 if unused
+  unsigned long last_used;
+  char data[CLUSTER_SIZE];
+} cache_entry_t;
+
+static cache_entry_t cache[CACHE_ENTRIES];
+static unsigned long cache_clock = 0;
+
+static cache_entry_t *cache_slot(int bnum);
+
+// page slot of the given block of the given cluster
+static int cluster_bnum(inode_t *node, int cluster, int i) {
+  return inode_get_bnum(node, (cluster * CLUSTER_BLOCKS + i) * 4096);
+}
+
+static void set_cluster_bnum(inode_t *node, int cluster, int i, int bnum) {
+  inode_set_bnum(node, (cluster * CLUSTER_BLOCKS + i) * 4096, bnum);
+}
+
+int cluster_is_compressed(inode_t *node, int cluster) {
+  // slots past the end of the file may not even exist
+  if (cluster * CLUSTER_SIZE >= node->size) {
+    return 0;
+  }
+  return cluster_bnum(node, cluster, 0) < 0;
+}
+
+int compress_copy_cluster(inode_t *node, int cluster, char *data) {
+  int nblocks = -cluster_bnum(node, cluster, 0);
+
+  // the stream is spread over blocks that need not be next to each other
+  char stream[(CLUSTER_BLOCKS - 1) * 4096];
+  for (int i = 0; i < nblocks; i++) {
+    int bnum = cluster_bnum(node, cluster, i + 1);
+    if (checksum_verify(bnum) < 0) {
+      return -1;
+    }
+    memcpy(stream + i * 4096, blocks_get_block(bnum), 4096);
+  }
+
+  cluster_header_t *hdr = (cluster_header_t *)stream;
+  int len = -1;
+  if (hdr->length <= sizeof(stream) - sizeof(cluster_header_t)) {
+    len = lz_decompress(stream + sizeof(cluster_header_t), hdr->length, data,
+                        CLUSTER_SIZE);
+  }
+  if (len != CLUSTER_SIZE) {
+    printf("compress: cluster at block %d is corrupt\n",
+           cluster_bnum(node, cluster, 1));
+    return -1;
+  }
+  return 0;
+}
+
+const char *compress_read_cluster(inode_t *node, int cluster) {
+  int first = cluster_bnum(node, cluster, 1);
+
+  cache_entry_t *entry = cache_slot(first);
+  if (entry->bnum == first) {
+    entry->last_used = ++cache_clock;
+    return entry->data;
+  }
+
+  if (compress_copy_cluster(node, cluster, entry->data) < 0) {
+    entry->bnum = 0;
+    return NULL;
+  }
+
+  entry->bnum = first;
+  entry->last_used = ++cache_clock;
+  return entry->data;
+}
+
+int compress_expand(inode_t *node, int cluster) {
+  const char *data = compress_read_cluster(node, cluster);
+  if (data == NULL) {
+    return -1;
+  }
+
+  int raw[CLUSTER_BLOCKS];
+  for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+    raw[i] = i == 0 ? inode_alloc_block(node, cluster * CLUSTER_BLOCKS)
+                    : alloc_block_near(raw[i - 1] + 1);
+    if (raw[i] < 0) {
+      while (--i >= 0) {
+        free_block(raw[i]);
+      }
+      return -1;
+    }
+    memcpy(blocks_get_block(raw[i]), data + i * 4096, 4096);
+    checksum_dirty(raw[i]);
+  }
+
+  int nblocks = -cluster_bnum(node, cluster, 0);
+  for (int i = 0; i < nblocks; i++) {
+    free_block(cluster_bnum(node, cluster, i + 1));
+  }
+  for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+    set_cluster_bnum(node, cluster, i, raw[i]);
+  }
+  return 0;
+}
+
+int compress_cluster(inode_t *node, int cluster) {
+  if ((cluster + 1) * CLUSTER_SIZE > node->size ||
+      cluster_is_compressed(node, cluster)) {
+    return 0;
+  }
+
+  char data[CLUSTER_SIZE];
+  for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+    memcpy(data + i * 4096, blocks_get_block(cluster_bnum(node, cluster, i)),
+           4096);
+  }
+
+  // only worth it if we end up with fewer blocks than we started with
+  char stream[(CLUSTER_BLOCKS - 1) * 4096];
+  int len = lz_compress(data, CLUSTER_SIZE, stream + sizeof(cluster_header_t),
+                        sizeof(stream) - sizeof(cluster_header_t));
+  if (len < 0) {
+    return 0;
+  }
+  ((cluster_header_t *)stream)->length = len;
+
+  int nblocks = bytes_to_blocks(len + sizeof(cluster_header_t));
+  int packed[CLUSTER_BLOCKS - 1];
+  for (int i = 0; i < nblocks; i++) {
+    packed[i] = i == 0 ? inode_alloc_block(node, cluster * CLUSTER_BLOCKS)
+                       : alloc_block_near(packed[i - 1] + 1);
+    if (packed[i] < 0) {
+      while (--i >= 0) {
+        free_block(packed[i]);
+      }
+      return 0;
+    }
+    memcpy(blocks_get_block(packed[i]), stream + i * 4096, 4096);
+    checksum_dirty(packed[i]);
+  }
+
+  for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+    free_block(cluster_bnum(node, cluster, i));
+  }
+  set_cluster_bnum(node, cluster, 0, -nblocks);
+  for (int i = 1; i < CLUSTER_BLOCKS; i++) {
+    set_cluster_bnum(node, cluster, i, i <= nblocks ? packed[i - 1] : 0);
+  }
+
+  // we already have the plain data, the next read doesn't need to decompress
+  cache_entry_t *entry = cache_slot(packed[0]);
+  memcpy(entry->data, data, CLUSTER_SIZE);
+  entry->bnum = packed[0];
+  entry->last_used = ++cache_clock;
+
+  return nblocks;
+}
+
+void compress_forget(int bnum) {
+  for (int i = 0; i < CACHE_ENTRIES; i++) {
+    if (cache[i].bnum == bnum) {
+      cache[i].bnum = 0;
+    }
+  }
+}
+
+// finds the entry holding the given cluster, or the one to evict for it
+static cache_entry_t *cache_slot(int bnum) {
+  cache_entry_t *victim = &cache[0];
+  for (int i = 0; i < CACHE_ENTRIES; i++) {
+    if (cache[i].bnum == bnum) {
+      return &cache[i];
+    }
+    if (cache[i].last_used < victim->last_used) {
+      victim = &cache[i];
+    }
+  }
+  return victim;
+}
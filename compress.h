@@ -0,0 +1,31 @@
+// Transparent compression of file data.
+//
+// Files with INODE_COMPRESS set are compressed a cluster (CLUSTER_BLOCKS
+// consecutive pages) at a time once the cluster is full. A compressed
+// cluster keeps -k in its first page slot, the k blocks holding the
+// compressed stream in the next slots, and 0 in the rest. Everything else
+// about the file (direct and indirect pointers) stays the same.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "inode.h"
+
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * 4096)
+
+int cluster_is_compressed(inode_t *node, int cluster);
+// gets the decompressed contents of a compressed cluster (from the cache
+// when possible), NULL if the data is corrupt
+const char *compress_read_cluster(inode_t *node, int cluster);
+// decompresses a cluster into data (CLUSTER_SIZE bytes) without touching
+// the cache, returns -1 if the data is corrupt
+int compress_copy_cluster(inode_t *node, int cluster, char *data);
+// turns a compressed cluster back into plain blocks so it can be modified
+int compress_expand(inode_t *node, int cluster);
+// compresses a full cluster of plain blocks if that saves at least a block
+int compress_cluster(inode_t *node, int cluster);
+// drops a freed block from the cache
+void compress_forget(int bnum);
+
+#endif
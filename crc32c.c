@@ -0,0 +1,158 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+#include "crc32c.h"
+
+// reversed Castagnoli polynomial
+#define POLY 0x82F63B78U
+
+// the hardware version runs three independent streams this long to keep the
+// crc unit busy (the instruction has a latency of 3 cycles), so a 4K block
+// is three streams plus a 16 byte tail
+#define STREAM_LEN 1360
+
+static uint32_t table[8][256];
+// x^(8 * STREAM_LEN) mod POLY, for stitching the streams back together
+static uint32_t stream_shift;
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, size_t);
+
+// the "raw" functions below work without the initial and final inversion,
+// which makes them linear and lets us combine streams
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    v ^= crc;
+    crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^
+          table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+          table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^
+          table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  return crc;
+}
+
+// multiplies two polynomials modulo POLY (bit reflected, like the crc)
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = 1U << 31;
+  uint32_t p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) {
+        break;
+      }
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+  }
+  return p;
+}
+
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+
+#ifdef CRC32C_X86
+#define CRC_TARGET __attribute__((target("sse4.2")))
+#define CRC_U64(crc, v) _mm_crc32_u64(crc, v)
+#define CRC_U8(crc, v) _mm_crc32_u8(crc, v)
+#else
+#define CRC_TARGET
+#define CRC_U64(crc, v) __crc32cd(crc, v)
+#define CRC_U8(crc, v) __crc32cb(crc, v)
+#endif
+
+CRC_TARGET static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p,
+                                     size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = CRC_U8(crc, *p++);
+    len--;
+  }
+
+  while (len >= 3 * STREAM_LEN) {
+    uint64_t a = crc, b = 0, c = 0;
+    const uint8_t *end = p + STREAM_LEN;
+    while (p < end) {
+      uint64_t va, vb, vc;
+      memcpy(&va, p, 8);
+      memcpy(&vb, p + STREAM_LEN, 8);
+      memcpy(&vc, p + 2 * STREAM_LEN, 8);
+      a = CRC_U64(a, va);
+      b = CRC_U64(b, vb);
+      c = CRC_U64(c, vc);
+      p += 8;
+    }
+    crc = multmodp(stream_shift, a) ^ b;
+    crc = multmodp(stream_shift, crc) ^ c;
+    p += 2 * STREAM_LEN;
+    len -= 3 * STREAM_LEN;
+  }
+
+  uint64_t c64 = crc;
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c64 = CRC_U64(c64, v);
+    p += 8;
+    len -= 8;
+  }
+  crc = c64;
+  while (len > 0) {
+    crc = CRC_U8(crc, *p++);
+    len--;
+  }
+  return crc;
+}
+#endif
+
+void crc32c_init() {
+  for (int n = 0; n < 256; n++) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+    }
+    table[0][n] = crc;
+  }
+  for (int n = 0; n < 256; n++) {
+    for (int k = 1; k < 8; k++) {
+      table[k][n] = table[0][table[k - 1][n] & 0xff] ^ (table[k - 1][n] >> 8);
+    }
+  }
+
+  // x^0 is the top bit when reflected, x^8 is eight bits further down
+  stream_shift = 1U << 31;
+  for (int i = 0; i < STREAM_LEN; i++) {
+    stream_shift = multmodp(stream_shift, 1U << 23);
+  }
+
+  crc32c_impl = crc32c_sw;
+#if defined(CRC32C_X86)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_impl = crc32c_hw;
+  }
+#elif defined(CRC32C_ARM)
+  crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  return ~crc32c_impl(~crc, data, len);
+}
@@ -0,0 +1,17 @@
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and btrfs.
+//
+// Uses the CPU's crc32 instruction when there is one (SSE 4.2 on x86, the
+// CRC extension on ARMv8), and a slicing-by-8 table otherwise.
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// picks the implementation, must be called before crc32c
+void crc32c_init();
+// extends crc (0 to start) with len bytes of data
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
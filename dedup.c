@@ -0,0 +1,169 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "dedup.h"
+#include "inode.h"
+
+// open addressing table with linear probing, kept at most half full
+#define INDEX_SIZE (BLOCK_COUNT * 2)
+#define SLOT_EMPTY -1
+
+// the hash runs this many independent 32 bit lanes over the block, so the
+// inner loop has no dependencies between lanes and the compiler can turn it
+// into vector instructions
+#define HASH_LANES 8
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+
+typedef struct dedup_entry {
+  uint64_t hash;
+  int bnum;
+} dedup_entry_t;
+
+static dedup_entry_t index_table[INDEX_SIZE];
+// where each block currently sits in the table (-1 if it isn't indexed)
+static int index_slot[BLOCK_COUNT];
+static int index_ready = 0;
+
+static void index_reset();
+static void index_insert(uint64_t hash, int bnum);
+
+// rebuilds the index from the data blocks of every regular file
+void dedup_init() {
+  index_reset();
+
+  void *ibm = get_inode_bitmap();
+  int indexed = 0;
+  for (int inum = 0; inum < INODE_COUNT; inum++) {
+    if (!bitmap_get(ibm, inum)) {
+      continue;
+    }
+    inode_t *node = get_inode(inum);
+    if (!S_ISREG(node->mode)) {
+      continue;
+    }
+
+    // only whole blocks are ever shared, so skip the partial tail
+    for (int off = 0; off + 4096 <= node->size; off += 4096) {
+      int bnum = inode_get_bnum(node, off);
+      if (bnum > 0 && index_slot[bnum] < 0) {
+        index_insert(dedup_hash(blocks_get_block(bnum)), bnum);
+        indexed++;
+      }
+    }
+  }
+  printf("dedup: indexed %d blocks\n", indexed);
+}
+
+// hashes a whole block
+uint64_t dedup_hash(const void *block) {
+  const uint32_t *words = block;
+  uint32_t acc[HASH_LANES];
+
+  for (int l = 0; l < HASH_LANES; l++) {
+    acc[l] = PRIME32_1 * (l + 1);
+  }
+
+  for (int i = 0; i < BLOCK_SIZE / 4; i += HASH_LANES) {
+    for (int l = 0; l < HASH_LANES; l++) {
+      uint32_t v = acc[l] + words[i + l] * PRIME32_2;
+      v = (v << 13) | (v >> 19);
+      acc[l] = v * PRIME32_1;
+    }
+  }
+
+  // fold the lanes together and mix the result
+  uint64_t h = 0;
+  for (int l = 0; l < HASH_LANES; l++) {
+    h = (h ^ acc[l]) * 0x100000001B3ULL;
+    h ^= h >> 29;
+  }
+  h ^= h >> 33;
+  h *= PRIME32_3;
+  h ^= h >> 32;
+  return h;
+}
+
+// looks for an existing block with the same contents as bnum
+int dedup_block(int bnum) {
+  if (!index_ready) {
+    index_reset();
+  }
+
+  void *data = blocks_get_block(bnum);
+  uint64_t hash = dedup_hash(data);
+
+  // whatever the block held before is gone, so is its old entry
+  dedup_forget(bnum);
+
+  int slot = hash % INDEX_SIZE;
+  for (int probes = 0; probes < INDEX_SIZE; probes++) {
+    dedup_entry_t *entry = &index_table[slot];
+    if (entry->bnum == SLOT_EMPTY) {
+      break;
+    }
+
+    // blocks in the index can be overwritten in place after they were
+    // indexed, so the hash alone isn't enough to share them
+    if (entry->hash == hash &&
+        memcmp(blocks_get_block(entry->bnum), data, BLOCK_SIZE) == 0 &&
+        share_block(entry->bnum) == 0) {
+      return entry->bnum;
+    }
+    slot = (slot + 1) % INDEX_SIZE;
+  }
+
+  index_insert(hash, bnum);
+  return bnum;
+}
+
+// drops a freed block from the index. The entries after it in its run are
+// shifted back into the hole instead of leaving a tombstone, so a lookup
+// still stops at the first empty slot however many blocks come and go.
+void dedup_forget(int bnum) {
+  if (!index_ready || index_slot[bnum] < 0) {
+    return;
+  }
+  int hole = index_slot[bnum];
+  index_slot[bnum] = -1;
+  for (int slot = (hole + 1) % INDEX_SIZE;
+       index_table[slot].bnum != SLOT_EMPTY; slot = (slot + 1) % INDEX_SIZE) {
+    // an entry can only move back as far as the slot it hashes to, so it
+    // fills the hole unless that slot lies between the two
+    int home = index_table[slot].hash % INDEX_SIZE;
+    int stays = hole <= slot ? hole < home && home <= slot
+                             : hole < home || home <= slot;
+    if (!stays) {
+      index_table[hole] = index_table[slot];
+      index_slot[index_table[hole].bnum] = hole;
+      hole = slot;
+    }
+  }
+  index_table[hole].bnum = SLOT_EMPTY;
+}
+
+static void index_reset() {
+  for (int i = 0; i < INDEX_SIZE; i++) {
+    index_table[i].bnum = SLOT_EMPTY;
+  }
+  for (int i = 0; i < BLOCK_COUNT; i++) {
+    index_slot[i] = -1;
+  }
+  index_ready = 1;
+}
+
+static void index_insert(uint64_t hash, int bnum) {
+  int slot = hash % INDEX_SIZE;
+  // there are never more live entries than blocks, so this finds a slot
+  while (index_table[slot].bnum != SLOT_EMPTY) {
+    slot = (slot + 1) % INDEX_SIZE;
+  }
+  index_table[slot].hash = hash;
+  index_table[slot].bnum = bnum;
+  index_slot[bnum] = slot;
+}
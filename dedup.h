@@ -0,0 +1,22 @@
+// Content-addressed block deduplication.
+//
+// Keeps an in-memory index from block hashes to file data blocks, so that a
+// freshly written block identical to one we already have can share it (see
+// share_block) instead of taking up space of its own.
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+// rebuilds the index from the data blocks of every regular file
+void dedup_init();
+// hashes a whole block
+uint64_t dedup_hash(const void *block);
+// looks for an existing block with the same contents as bnum; returns that
+// block with an extra owner, or bnum itself (now indexed) if there is none
+int dedup_block(int bnum);
+// drops a freed block from the index
+void dedup_forget(int bnum);
+
+#endif
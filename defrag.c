@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "checksum.h"
+#include "defrag.h"
+#include "inode.h"
+#include "journal.h"
+#include "layout.h"
+
+// the number of page slots holding the file (one more than the size needs,
+// see grow_inode)
+static int file_slots(inode_t *node) { return node->size / BLOCK_SIZE + 1; }
+
+int defrag_extents(inode_t *node) {
+  int extents = 0;
+  int prev = -2;
+  for (int i = 0; i < file_slots(node); i++) {
+    int bnum = inode_get_bnum(node, i * BLOCK_SIZE);
+    if (bnum <= 0) {
+      // part of a compressed cluster
+      prev = -2;
+      continue;
+    }
+    if (bnum != prev + 1) {
+      extents++;
+    }
+    prev = bnum;
+  }
+  return extents;
+}
+
+// whether every block of the file can be moved: compressed clusters and
+// shared blocks stay where they are, and corrupt data isn't copied around
+static int can_move(inode_t *node) {
+  for (int i = 0; i < file_slots(node); i++) {
+    int bnum = inode_get_bnum(node, i * BLOCK_SIZE);
+    if (bnum <= 0 || block_is_shared(bnum) || checksum_verify(bnum) < 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// copies the file's blocks into one free run and frees the old ones,
+// returns how many blocks moved or -1 if there's no run long enough
+static int move_blocks(inode_t *node) {
+  int count = file_slots(node);
+  int group = INODE_GROUP(inode_num(node));
+  int first = alloc_block_run(group * GROUP_BLOCKS, count);
+  if (first < 0) {
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    int old = inode_get_bnum(node, i * BLOCK_SIZE);
+    memcpy(blocks_get_block(first + i), blocks_get_block(old), BLOCK_SIZE);
+    checksum_dirty(first + i);
+    if (S_ISDIR(node->mode)) {
+      journal_dirty(first + i);
+    }
+    inode_set_bnum(node, i * BLOCK_SIZE, first + i);
+    free_block(old);
+  }
+  return count;
+}
+
+int defrag_pass(int *cursor, int count, int move, defrag_stats_t *stats) {
+  uint8_t *ibm = get_inode_bitmap();
+  // inodes past the initialized part of the table were never used
+  int used = get_superblock()->itable_used;
+
+  for (int i = 0; i < count; i++) {
+    int inum = *cursor;
+    if (inum >= used) {
+      *cursor = 0;
+      return 1;
+    }
+    *cursor = (inum + 1) % INODE_COUNT;
+
+    inode_t *node = get_inode(inum);
+    // (orphans are about to be freed anyway)
+    if (bitmap_get(ibm, inum) && !(node->flags & INODE_ORPHAN) &&
+        (S_ISREG(node->mode) || S_ISDIR(node->mode))) {
+      int extents = defrag_extents(node);
+      stats->files++;
+      stats->extents_before += extents;
+      if (extents > 1) {
+        stats->fragmented++;
+        int moved = move && can_move(node) ? move_blocks(node) : -1;
+        if (moved > 0) {
+          printf("defrag: moved inode %d out of %d extents\n", inum, extents);
+          extents = defrag_extents(node);
+          stats->moved++;
+          stats->blocks_moved += moved;
+        }
+      }
+      stats->extents_after += extents;
+    }
+
+    if (*cursor == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,33 @@
+// Online defragmentation.
+//
+// Blocks are handed out right after the file's previous block when it's
+// free (see alloc_block_near), but files that grow at the same time (or a
+// bit at a time) still end up with their blocks mixed in with each
+// other's. A defrag pass measures how many extents (runs of consecutive
+// blocks) each file has, and moves the blocks of a file that has more than
+// one into a single free run, when there is one. Passes work a few inodes
+// at a time so they can run in the background between requests (see the
+// defrag mount option).
+
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include "inode.h"
+
+typedef struct defrag_stats {
+  int files;          // files and directories looked at
+  int fragmented;     // how many of them had more than one extent
+  int moved;          // how many of those were put into one extent
+  long extents_before;
+  long extents_after;
+  long blocks_moved;
+} defrag_stats_t;
+
+// the number of runs of consecutive blocks holding the file
+int defrag_extents(inode_t *node);
+// looks at count inodes starting at *cursor, moving the blocks of the
+// fragmented ones unless only reporting, and adds what it found to stats;
+// returns 1 once the cursor wraps around to the start
+int defrag_pass(int *cursor, int count, int move, defrag_stats_t *stats);
+
+#endif
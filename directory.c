@@ -3,15 +3,95 @@
 #include "inode.h"
 #include "directory.h"
 #include "bitmap.h"
+#include "checksum.h"
+#include "journal.h"
+#include "span.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 void directory_init() {
     // we already have our page for the inodes allocated
     // the root inode will be node 0
-    inode_t* rootnode = get_inode(alloc_inode());
+    inode_t* rootnode = get_inode(alloc_inode(0));
     rootnode->mode = 040755;
+    inode_dirty(rootnode);
+    directory_new(rootnode);
+}
+
+// a directory has a block of entries in every page slot it has, so
+// size / BLOCK_SIZE + 1 of them (an empty one still has its first block).
+// The slots work the same as a file's, so grow_inode and shrink_inode work
+// on it.
+static int dir_block_count(inode_t* di) {
+    return di->size / BLOCK_SIZE + 1;
+}
+
+static int dir_bnum(inode_t* di, int i) {
+    return inode_get_bnum(di, i * BLOCK_SIZE);
+}
+
+// checks that a record fits in its block, so a corrupt one can't send us
+// off into another block (or loop forever)
+int dirent_valid(const dirent_t* entry, int offset) {
+    return entry->rec_len >= DIRENT_SIZE(0) && entry->rec_len % 4 == 0 &&
+           offset + entry->rec_len <= BLOCK_SIZE &&
+           (entry->inum < 0 || DIRENT_SIZE(entry->name_len) <= entry->rec_len);
+}
+
+// the space the record actually needs, the rest of rec_len is free
+static int dirent_used(const dirent_t* entry) {
+    return entry->inum < 0 ? 0 : DIRENT_SIZE(entry->name_len);
+}
+
+// turns a directory block into a single free record
+static void format_dir_block(int bnum) {
+    dirent_t* entry = blocks_get_block(bnum);
+    entry->inum = -1;
+    entry->rec_len = BLOCK_SIZE;
+    entry->name_len = 0;
+    checksum_dirty(bnum);
+    journal_dirty(bnum);
+}
+
+void directory_new(inode_t* directory_inode) {
+    format_dir_block(dir_bnum(directory_inode, 0));
+}
+
+// goes through the records of a directory block, stopping at a corrupt one
+#define for_each_dirent(block, entry, offset)                                  \
+    for (int offset = 0;                                                       \
+         offset < BLOCK_SIZE &&                                                \
+         dirent_valid(entry = (dirent_t*)((char*)(block) + offset), offset);  \
+         offset += entry->rec_len)
+
+// finds the entry with the given name, along with the block it's in and
+// the record before it in that block (NULL if it's the first one)
+static dirent_t* find_entry(inode_t* directory_inode, const char* name,
+                            int* bnum_out, dirent_t** prev_out) {
+    int name_len = strlen(name);
+
+    for (int i = 0; i < dir_block_count(directory_inode); i++) {
+        int bnum = dir_bnum(directory_inode, i);
+        if (checksum_verify(bnum) < 0) {
+            printf("directory block %d failed its checksum\n", bnum);
+        }
+
+        dirent_t* prev = NULL;
+        dirent_t* entry;
+        for_each_dirent(blocks_get_block(bnum), entry, offset) {
+            if (entry->inum >= 0 && entry->name_len == name_len &&
+                memcmp(entry->name, name, name_len) == 0) {
+                *bnum_out = bnum;
+                *prev_out = prev;
+                return entry;
+            }
+            prev = entry;
+        }
+    }
+    return NULL;
 }
 
 int directory_lookup(inode_t* directory_inode, const char* name) {
@@ -20,119 +100,388 @@ int directory_lookup(inode_t* directory_inode, const char* name) {
         return 0;
     }
 
-    // get first directory block, that contains the directory entries
-    dirent_t* entries = blocks_get_block(directory_inode->ptrs[0]);
-    // included since system might NULL on error
-    if (entries == NULL) { return -1; }
+    span_begin("directory_lookup");
+    int bnum;
+    dirent_t* prev;
+    dirent_t* entry = find_entry(directory_inode, name, &bnum, &prev);
+    span_end();
+    if (entry != NULL) {
+        return entry->inum;  // Found the matching entry
+    }
+
+    // if all checks fail, there was no directory found
+    return -1;
+}
+
+static uint32_t name_hash(const char* name, int len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void directory_lookup_many(inode_t* directory_inode, const char** names,
+                           int count, int* inums, int* where) {
+    // the names go in a hash table (indexes + 1, 0 is empty) so every entry
+    // only has to be looked up once, a name that is in the batch twice is
+    // answered from its first copy
+    int size = 16;
+    while (size < count * 2) {
+        size *= 2;
+    }
+    int table[size];
+    int first[count];
+    memset(table, 0, sizeof(table));
+    for (int i = 0; i < count; i++) {
+        inums[i] = -1;
+        if (where != NULL) {
+            where[i] = -1;
+        }
+        first[i] = i;
+        if (names[i] == NULL) {
+            continue;
+        }
+        int len = strlen(names[i]);
+        int slot = name_hash(names[i], len) & (size - 1);
+        while (table[slot] && strcmp(names[table[slot] - 1], names[i]) != 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        if (table[slot]) {
+            first[i] = table[slot] - 1;
+        } else {
+            table[slot] = i + 1;
+        }
+    }
 
-    // based on fixed number of entries (64)
-    const int ENTRY_COUNT = 64;
-    for (int i = 0; i < ENTRY_COUNT; ++i) {
-        dirent_t current_entry = entries[i];
+    for (int i = 0; i < dir_block_count(directory_inode); i++) {
+        int bnum = dir_bnum(directory_inode, i);
+        if (checksum_verify(bnum) < 0) {
+            printf("directory block %d failed its checksum\n", bnum);
+        }
 
-        // ensure directory name is in use (we added the .used to ferd's code)
-        if (current_entry.used && strcmp(name, current_entry.name) == 0) {
-            return current_entry.inum;  // Found the matching entry
+        dirent_t* entry;
+        for_each_dirent(blocks_get_block(bnum), entry, offset) {
+            if (entry->inum < 0) {
+                continue;
+            }
+            int slot = name_hash(entry->name, entry->name_len) & (size - 1);
+            for (; table[slot]; slot = (slot + 1) & (size - 1)) {
+                const char* name = names[table[slot] - 1];
+                if (strncmp(name, entry->name, entry->name_len) == 0 &&
+                    name[entry->name_len] == 0) {
+                    inums[table[slot] - 1] = entry->inum;
+                    if (where != NULL) {
+                        where[table[slot] - 1] = i * BLOCK_SIZE + offset;
+                    }
+                    break;
+                }
+            }
         }
     }
 
-    // if all checks fail, there was no directory found
-    return -1;
+    for (int i = 0; i < count; i++) {
+        inums[i] = inums[first[i]];
+        if (where != NULL) {
+            where[i] = where[first[i]];
+        }
+    }
 }
 
 int tree_lookup(const char* path) {
     // Start from the root node
     int current_node = 0;
-    
+
     // path spliting
     // "test/new" -> "test", "new"
     slist_t* path_components = slist_explode(path, '/');
     slist_t* current_component = path_components;
-    
+
     // traverse through directory
+    span_begin("tree_lookup");
     while (current_component != NULL) {
         current_node = directory_lookup(get_inode(current_node), current_component->data);
         if (current_node == -1) {
             // not found? free the list and return -1
+            span_end();
             slist_free(path_components);
             return -1;
         }
-        
+
         current_component = current_component->next;
     }
 
     // post traversial cleanup
+    span_end();
     slist_free(path_components);
     printf("tree lookup: %s is at node %d\n", path, current_node);
     return current_node;
 }
 
-// directory insertion
-int directory_put(inode_t* directory_inode, const char* name, int inum) {
-    // variable for how many entries currently exist in this directory
-    int entry_count = directory_inode->size / sizeof(dirent_t);
-
-    // get directory entries from inode
-    dirent_t* entries = blocks_get_block(directory_inode->ptrs[0]);
-    if (entries == NULL) {
-        // basic error handling
-        return -1;
-    }
-
-    dirent_t new_entry;
-    strncpy(new_entry.name, name, DIR_NAME_LENGTH);
-    // can't forget null termination
-    new_entry.name[DIR_NAME_LENGTH - 1] = '\0';
-    new_entry.inum = inum;
-    new_entry.used = 1;
-
-    // search for an unused slot in our entrylist
-    // starting at 1 ignores special entries ("." & "..")
-    int allocated = 0;
-    for (int x = 1; x < entry_count; x++) {
-        if (!entries[x].used) {
-            entries[x] = new_entry;
-            allocated = 1;
-            // exit when entry is placed
+// puts an entry in the first record from block "from" on with enough free
+// space after it, or in a new block at the end, and sets *where to its
+// position (block index * BLOCK_SIZE + offset)
+static int put_entry(inode_t* directory_inode, const char* name, int inum,
+                     int from, int* where) {
+    int name_len = strlen(name);
+    if (name_len > DIR_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+    int needed = DIRENT_SIZE(name_len);
+
+    // the first record with enough free space after it, either a free one
+    // that can be reused as it is, or one that can be split in two
+    dirent_t* slot = NULL;
+    int bnum = -1;
+    int index = from;
+    for (; index < dir_block_count(directory_inode); index++) {
+        bnum = dir_bnum(directory_inode, index);
+        dirent_t* entry;
+        for_each_dirent(blocks_get_block(bnum), entry, offset) {
+            if (entry->rec_len - dirent_used(entry) >= needed) {
+                slot = entry;
+                break;
+            }
+        }
+        if (slot != NULL) {
             break;
         }
     }
 
-    // otherwise, new entry at the end
-    if (!allocated) {
-        entries[entry_count] = new_entry;
-        directory_inode->size += sizeof(dirent_t);
+    // otherwise, the entry goes in a new block at the end
+    if (slot == NULL) {
+        index = dir_block_count(directory_inode);
+        if (grow_inode(directory_inode, index * BLOCK_SIZE) < 0) {
+            return -ENOSPC;
+        }
+        bnum = dir_bnum(directory_inode, index);
+        format_dir_block(bnum);
+        slot = blocks_get_block(bnum);
     }
 
-    printf("DEBUG for directory_put func: inserted \"%s\" (inum=%d) into block %d\n", name, inum, directory_inode->ptrs[0]);
-
+    int used = dirent_used(slot);
+    dirent_t* new_entry = slot;
+    if (used > 0) {
+        new_entry = (dirent_t*)((char*)slot + used);
+        new_entry->rec_len = slot->rec_len - used;
+        slot->rec_len = used;
+    }
+    new_entry->inum = inum;
+    new_entry->name_len = name_len;
+    memcpy(new_entry->name, name, name_len);
+    checksum_dirty(bnum);
+    journal_dirty(bnum);
+    *where = index * BLOCK_SIZE + ((char*)new_entry - (char*)blocks_get_block(bnum));
     return 0;
 }
 
+// directory insertion
+int directory_put(inode_t* directory_inode, const char* name, int inum) {
+    int where;
+    return put_entry(directory_inode, name, inum, 0, &where);
+}
+
+// takes an entry out of its block, merging it with the free space around
+// it, returns 1 if that leaves the block empty (and so the directory
+// should be compacted)
+static int remove_entry(inode_t* directory_inode, dirent_t* entry, int bnum,
+                         dirent_t* prev) {
+    char* block = blocks_get_block(bnum);
+    int offset = (char*)entry - block;
+
+    entry->inum = -1;
+    // a free record right after it joins this one
+    dirent_t* next = (dirent_t*)((char*)entry + entry->rec_len);
+    if (offset + entry->rec_len < BLOCK_SIZE && next->inum < 0 &&
+        dirent_valid(next, offset + entry->rec_len)) {
+        entry->rec_len += next->rec_len;
+    }
+    // and this one joins the record before it
+    if (prev != NULL) {
+        prev->rec_len += entry->rec_len;
+    }
+    checksum_dirty(bnum);
+    journal_dirty(bnum);
+
+    // an empty block in a bigger directory is wasted space
+    dirent_t* first = (dirent_t*)block;
+    return first->inum < 0 && first->rec_len == BLOCK_SIZE &&
+           dir_block_count(directory_inode) > 1;
+}
+
 // deletion of a directory function
 int directory_delete(inode_t* directory_inode, const char* name) {
-    // grab entries block
-    dirent_t* entries = blocks_get_block(directory_inode->ptrs[0]);
-    if (entries == NULL) {
-        // can't find it? return an error
-        return -EIO; 
+    int inum = directory_remove(directory_inode, name);
+    if (inum < 0) {
+        return inum;
+    }
+    // call helper method to reduce reference count
+    decrease_refs(inum);
+    return 0;
+}
+
+// removes the entry with the given name without touching the inode it
+// points at, returns that inode's number
+int directory_remove(inode_t* directory_inode, const char* name) {
+    int bnum;
+    dirent_t* prev;
+    dirent_t* entry = find_entry(directory_inode, name, &bnum, &prev);
+    if (entry == NULL) {
+        // if all else fails return no such file/directory error
+        return -ENOENT;
     }
+    int inum = entry->inum;
+    if (remove_entry(directory_inode, entry, bnum, prev)) {
+        directory_compact(directory_inode);
+    }
+    return inum;
+}
 
-    // how many entries are in the directory
-    int entry_count = directory_inode->size / sizeof(dirent_t);
+void directory_batch_begin(dir_batch_t* batch, inode_t* directory_inode) {
+    batch->dir = directory_inode;
+    batch->put_from = 0;
+    batch->emptied = 0;
+}
 
-    // find entry that matches name
-    for (int i = 0; i < entry_count; i++) {
-        if (entries[i].used && strcmp(entries[i].name, name) == 0) {
-            // mark unused, call helper method to reduce reference count
-            entries[i].used = 0;
-            decrease_refs(entries[i].inum);
-            return 0;
+int directory_batch_put(dir_batch_t* batch, const char* name, int inum,
+                        int* where) {
+    int rv = put_entry(batch->dir, name, inum, batch->put_from, where);
+    if (rv == 0) {
+        // the blocks before this one had no room for it, the next entry
+        // starts looking here (a shorter name might have fit in one of
+        // them, but then the batch would go over them every time)
+        batch->put_from = *where / BLOCK_SIZE;
+    }
+    return rv;
+}
+
+int directory_batch_remove(dir_batch_t* batch, const char* name, int where) {
+    inode_t* directory_inode = batch->dir;
+    int index = where / BLOCK_SIZE;
+    int name_len = strlen(name);
+    int bnum = -1;
+    dirent_t* prev = NULL;
+    dirent_t* found = NULL;
+    if (where >= 0 && index < dir_block_count(directory_inode)) {
+        // (the record before it is needed, so this goes over its block)
+        bnum = dir_bnum(directory_inode, index);
+        dirent_t* entry;
+        for_each_dirent(blocks_get_block(bnum), entry, offset) {
+            if (offset == where % BLOCK_SIZE) {
+                if (entry->inum >= 0 && entry->name_len == name_len &&
+                    memcmp(entry->name, name, name_len) == 0) {
+                    found = entry;
+                }
+                break;
+            }
+            prev = entry;
+        }
+    }
+    if (found == NULL) {
+        // not where it was said to be, look for it the slow way
+        found = find_entry(directory_inode, name, &bnum, &prev);
+        if (found == NULL) {
+            return -ENOENT;
+        }
+        for (index = 0; dir_bnum(directory_inode, index) != bnum; index++) {
         }
     }
 
-    // if all else fails return no such file/directory error
-    return -ENOENT;
+    int inum = found->inum;
+    if (remove_entry(directory_inode, found, bnum, prev)) {
+        batch->emptied = 1;
+    }
+    // the space it leaves can take the next new entry
+    if (index < batch->put_from) {
+        batch->put_from = index;
+    }
+    return inum;
+}
+
+void directory_batch_end(dir_batch_t* batch) {
+    if (batch->emptied && dir_block_count(batch->dir) > 1) {
+        directory_compact(batch->dir);
+    }
+}
+
+// points the entry with the given name at another inode, returns the
+// inode it pointed at before
+int directory_replace(inode_t* directory_inode, const char* name, int inum) {
+    int bnum;
+    dirent_t* prev;
+    dirent_t* entry = find_entry(directory_inode, name, &bnum, &prev);
+    if (entry == NULL) {
+        return -ENOENT;
+    }
+    int old = entry->inum;
+    entry->inum = inum;
+    checksum_dirty(bnum);
+    journal_dirty(bnum);
+    return old;
+}
+
+// checks whether a directory has no entries
+int directory_is_empty(inode_t* directory_inode) {
+    for (int i = 0; i < dir_block_count(directory_inode); i++) {
+        dirent_t* entry;
+        for_each_dirent(blocks_get_block(dir_bnum(directory_inode, i)), entry, offset) {
+            if (entry->inum >= 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// packs the entries of a directory into as few blocks as possible, keeping
+// their order, and gives back the blocks left over
+void directory_compact(inode_t* directory_inode) {
+    int count = dir_block_count(directory_inode);
+    // where the next entry goes, records only ever move towards the start
+    int out_block = 0;
+    int out_offset = 0;
+    dirent_t* last = NULL;
+
+    for (int i = 0; i < count; i++) {
+        char* block = blocks_get_block(dir_bnum(directory_inode, i));
+        int offset = 0;
+        while (offset < BLOCK_SIZE) {
+            dirent_t* entry = (dirent_t*)(block + offset);
+            if (!dirent_valid(entry, offset)) {
+                break;
+            }
+            // (moving the entry can overwrite its header)
+            int rec_len = entry->rec_len;
+            int used = dirent_used(entry);
+            if (used > 0) {
+                if (out_offset + used > BLOCK_SIZE) {
+                    // the last record in a block takes up the rest of it
+                    last->rec_len += BLOCK_SIZE - out_offset;
+                    out_block++;
+                    out_offset = 0;
+                }
+                int out_bnum = dir_bnum(directory_inode, out_block);
+                last = (dirent_t*)((char*)blocks_get_block(out_bnum) + out_offset);
+                memmove(last, entry, used);
+                last->rec_len = used;
+                checksum_dirty(out_bnum);
+                journal_dirty(out_bnum);
+                out_offset += used;
+            }
+            offset += rec_len;
+        }
+    }
+
+    if (last == NULL) {
+        // nothing left, an empty directory keeps its first block
+        shrink_inode(directory_inode, 0);
+        directory_new(directory_inode);
+        return;
+    }
+    last->rec_len += BLOCK_SIZE - out_offset;
+    shrink_inode(directory_inode, out_block * BLOCK_SIZE);
+    printf("compacted directory from %d to %d blocks\n", count, out_block + 1);
 }
 
 // provides the directory entries in the form of an slist
@@ -151,22 +500,20 @@ slist_t* directory_list(const char* path) {
         return NULL;
     }
 
-    int entry_count = directory_inode->size / sizeof(dirent_t);
-
-    // find the directory entries per client request
-    dirent_t* entries = blocks_get_block(directory_inode->ptrs[0]);
-    if (entries == NULL) {
-        // error (NULL) if unable to retrieve
-        return NULL;
-    }
-
     // Initialize a list to store directory names
     slist_t* dirnames = NULL;
 
-    for (int i = 0; i < entry_count; i++) {
-        if (entries[i].used) {
-            // add directory names to our slist
-            dirnames = slist_cons(entries[i].name, dirnames);
+    for (int i = 0; i < dir_block_count(directory_inode); i++) {
+        dirent_t* entry;
+        for_each_dirent(blocks_get_block(dir_bnum(directory_inode, i)), entry, offset) {
+            if (entry->inum >= 0) {
+                // add directory names to our slist (they're stored without
+                // null terminators)
+                char name[DIR_NAME_LENGTH + 1];
+                memcpy(name, entry->name, entry->name_len);
+                name[entry->name_len] = 0;
+                dirnames = slist_cons(name, dirnames);
+            }
         }
     }
 
@@ -174,6 +521,56 @@ slist_t* directory_list(const char* path) {
     return dirnames;
 }
 
+// looks for the inodes under the directory whose path (len bytes of it) is
+// in path, returns how many are still missing
+static int find_paths(inode_t* directory_inode, char* path, int len,
+                      const int* inums, char** paths, int count, int path_max,
+                      int left) {
+    for (int i = 0; i < dir_block_count(directory_inode) && left > 0; i++) {
+        dirent_t* entry;
+        for_each_dirent(blocks_get_block(dir_bnum(directory_inode, i)), entry, offset) {
+            if (entry->inum < 0 || len + 1 + entry->name_len >= path_max) {
+                continue;
+            }
+            path[len] = '/';
+            memcpy(path + len + 1, entry->name, entry->name_len);
+            int sub_len = len + 1 + entry->name_len;
+            path[sub_len] = 0;
+
+            for (int j = 0; j < count; j++) {
+                if (inums[j] == entry->inum && paths[j][0] == 0) {
+                    strcpy(paths[j], path);
+                    left--;
+                }
+            }
+            inode_t* node = get_inode(entry->inum);
+            if (S_ISDIR(node->mode) && left > 0) {
+                left = find_paths(node, path, sub_len, inums, paths, count,
+                                  path_max, left);
+            }
+            if (left == 0) {
+                break;
+            }
+        }
+    }
+    return left;
+}
+
+void directory_find_paths(const int* inums, char** paths, int count,
+                          int path_max) {
+    int left = count;
+    for (int i = 0; i < count; i++) {
+        paths[i][0] = 0;
+        if (inums[i] == 0) {
+            strcpy(paths[i], "/");
+            left--;
+        }
+    }
+    char path[path_max];
+    path[0] = 0;
+    find_paths(get_inode(0), path, 0, inums, paths, count, path_max, left);
+}
+
 // toString-like function to print out a directory for debugging
 void print_directory(inode_t* directory_inode) {
     if (directory_inode == NULL) {
@@ -182,21 +579,16 @@ void print_directory(inode_t* directory_inode) {
     }
 
     // follows roughly the same iteration code as in directory_list
-
-    int entry_count = directory_inode->size / sizeof(dirent_t);
-
-    dirent_t* entries = blocks_get_block(directory_inode->ptrs[0]);
-    if (entries == NULL) {
-        // future: print off error message
-        // printf("Empty");
-        return;
-    }
-
-    // finally, we print off each directory name
-    for (int i = 0; i < entry_count; i++) {
-        // FUTURE: consider printing only directories in use
-        // by looking at entries[i].used
-        printf("%s\n", entries[i].name);
+    for (int i = 0; i < dir_block_count(directory_inode); i++) {
+        dirent_t* entry;
+        for_each_dirent(blocks_get_block(dir_bnum(directory_inode, i)), entry, offset) {
+            // free records show up as (free)
+            if (entry->inum >= 0) {
+                printf("%.*s\n", entry->name_len, entry->name);
+            } else {
+                printf("(free, %d bytes)\n", entry->rec_len);
+            }
+        }
     }
 
     // output looks something like:
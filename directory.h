@@ -6,26 +6,84 @@
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
-#define DIR_NAME_LENGTH 48
+#include <stdint.h>
 
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
 
+#define DIR_NAME_LENGTH 255 // longest name, not counting a null terminator
+
+// A directory's blocks are packed with variable-length records, each one
+// followed directly by its name (not null terminated). The records of a
+// block always add up to the whole block, so rec_len also covers the free
+// space after a record until the next one. New entries go into that free
+// space, deleted ones are merged into the record before them, and the
+// directory is compacted when a block ends up empty. Every page slot of a
+// directory holds a block of entries, so one with N blocks has a size of
+// (N - 1) * BLOCK_SIZE, and an empty one has a single block of free space.
+// (Before these, entries had a fixed size; such images are refused, see
+// NUFS_VERSION.)
 typedef struct dirent_t {
-  char name[DIR_NAME_LENGTH];
-  int inum;
-  char used; // added to ferd's implementation to determine if dir is in use
-  char _reserved[12];
+  int inum;          // -1 if the record is free
+  uint16_t rec_len;  // bytes from this record to the next
+  uint8_t name_len;  // bytes in the name
+  uint8_t _reserved;
+  char name[];
 } dirent_t;
 
+// the space an entry with a name of the given length takes up
+#define DIRENT_SIZE(name_len) ((sizeof(dirent_t) + (name_len) + 3) & ~3)
+
 void directory_init();
+// formats the first block of a new directory inode
+void directory_new(inode_t *di);
 int directory_lookup(inode_t *di, const char *name);
+// looks up count names in one pass over the directory, setting inums[i] to
+// the inode of names[i] or -1 (NULL names are skipped), and where[i] (if
+// where isn't NULL) to the position of its entry for directory_batch_remove
+void directory_lookup_many(inode_t *di, const char **names, int count,
+                           int *inums, int *where);
 // useful function for discovering a path's location
 int tree_lookup(const char* path);
 int directory_put(inode_t *di, const char *name, int inum);
 int directory_delete(inode_t *di, const char *name);
+// like directory_delete, but leaves the inode alone and returns its number
+int directory_remove(inode_t *di, const char *name);
+// points an existing entry at another inode, returns the old one
+int directory_replace(inode_t *di, const char *name, int inum);
+int directory_is_empty(inode_t *di);
 slist_t *directory_list(const char *path);
 void print_directory(inode_t *dd);
+// checks that a record at the given offset of a block fits in it
+int dirent_valid(const dirent_t *entry, int offset);
+// sets paths[i] (path_max bytes) to a path of inums[i], the first one found
+// for a file with several names, or "" if it's not in the tree (a walk of
+// the whole tree, for when there's no other way)
+void directory_find_paths(const int* inums, char** paths, int count,
+                          int path_max);
+// packs the entries of a directory into as few blocks as possible
+void directory_compact(inode_t *di);
+
+// A run of puts and removes on one directory. Entries never move while it
+// lasts (an emptied block is only compacted at the end), so a remove can go
+// straight to the position its lookup found, and each put carries on
+// looking for free space from the block the last one used (or an earlier
+// one a remove freed space in) instead of from the first block.
+typedef struct dir_batch_t {
+  inode_t *dir;
+  int put_from;  // the first block a put looks in
+  int emptied;   // a remove left a block empty
+} dir_batch_t;
+
+void directory_batch_begin(dir_batch_t *batch, inode_t *di);
+// like directory_put, sets *where to the position of the new entry
+int directory_batch_put(dir_batch_t *batch, const char *name, int inum,
+                        int *where);
+// like directory_remove, for the entry at the position directory_lookup_many
+// or directory_batch_put gave for the name
+int directory_batch_remove(dir_batch_t *batch, const char *name, int where);
+// compacts the directory if the batch left a block empty
+void directory_batch_end(dir_batch_t *batch);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,439 @@
+// Checks (and optionally repairs) an unmounted nufs image.
+//
+//   fsck.nufs [-r] [-j THREADS] IMAGE[,IMAGE...]
+//
+// A pool of threads walks the directory tree from the root, counting the
+// entries pointing at every inode and the owners of every block, and
+// verifying the checksum of each block the first time it's reached. The
+// counts are then compared with the bitmaps, link counts, share counts and
+// superblock. Only inodes that were ever handed out are looked at, so the
+// time spent depends on how full the image is, not how big.
+//
+// Transactions left in the journal (see journal.h) by a crash are replayed
+// before anything else is checked, if -r is given.
+//
+// -r fixes whatever can be fixed. Exits with 0 if the image is clean, 1 if
+// errors were fixed, 4 if some were left and 8 if it couldn't be checked
+// (the same codes as fsck(8)).
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "checksum.h"
+#include "crc32c.h"
+#include "directory.h"
+#include "inode.h"
+#include "journal.h"
+#include "layout.h"
+
+#define MAX_THREADS 64
+#define MAX_SLOTS (nptrs + BLOCK_SIZE / (int)sizeof(int))
+
+static int repair = 0;
+static atomic_int fixed = 0;
+static atomic_int left = 0;
+
+// what the walk found
+static atomic_int links[INODE_COUNT];  // directory entries per inode
+static atomic_int owners[BLOCK_COUNT]; // inode slots per block
+// blocks a walker changed, their checksums are updated at the end
+static atomic_char touched[BLOCK_COUNT];
+
+// directories waiting to be read, each one is only queued once
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static int queue[INODE_COUNT];
+static int queued = 0;
+static int busy = 0; // walkers reading a directory
+
+// reports a problem, returns whether to fix it
+static int problem(int fixable, const char *fmt, ...) {
+  char msg[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+
+  if (fixable && repair) {
+    printf("%s (fixed)\n", msg);
+    fixed++;
+    return 1;
+  }
+  printf("%s\n", msg);
+  left++;
+  return 0;
+}
+
+static void verify_block(int bnum) {
+  uint32_t *sums = (uint32_t *)META_AREA(META_CSUM_OFFSET);
+  if (bitmap_get(META_AREA(META_CSUM_VALID_OFFSET), bnum) &&
+      crc32c(0, blocks_get_block(bnum), BLOCK_SIZE) != sums[bnum]) {
+    problem(0, "block %d fails its checksum", bnum);
+  }
+}
+
+// counts an owner of the block, returns 0 if it's a valid data block
+static int claim_block(int inum, int bnum) {
+  if (bnum < FIRST_DATA_BLOCK || bnum >= blocks_total()) {
+    problem(0, "inode %d points at block %d", inum, bnum);
+    return -1;
+  }
+  if (atomic_fetch_add(&owners[bnum], 1) == 0) {
+    verify_block(bnum);
+  }
+  return 0;
+}
+
+static void push_dir(int inum) {
+  pthread_mutex_lock(&queue_lock);
+  queue[queued++] = inum;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+// claims the blocks of an inode the first time it's reached
+static void check_inode(int inum) {
+  inode_t *node = get_inode(inum);
+  // one slot more than the size needs is kept (see grow_inode)
+  int slots = node->size / BLOCK_SIZE + 1;
+  if (node->size < 0 || slots > MAX_SLOTS) {
+    problem(0, "inode %d has a bad size (%d)", inum, node->size);
+    return;
+  }
+
+  for (int i = 0; i < slots && i < nptrs; i++) {
+    // (slots of compressed clusters can be <= 0)
+    if (node->ptrs[i] > 0) {
+      claim_block(inum, node->ptrs[i]);
+    }
+  }
+  if (slots > nptrs) {
+    if (claim_block(inum, node->iptr) < 0) {
+      return;
+    }
+    int *iptrs = blocks_get_block(node->iptr);
+    for (int i = nptrs; i < slots; i++) {
+      if (iptrs[i - nptrs] > 0) {
+        claim_block(inum, iptrs[i - nptrs]);
+      }
+    }
+  }
+
+  if (S_ISDIR(node->mode)) {
+    push_dir(inum);
+  }
+}
+
+static void read_dir(int inum) {
+  inode_t *dir = get_inode(inum);
+  uint8_t *ibm = get_inode_bitmap();
+  // (every slot of a directory holds a block of entries)
+  for (int i = 0; i < dir->size / BLOCK_SIZE + 1; i++) {
+    int bnum = inode_get_bnum(dir, i * BLOCK_SIZE);
+    if (bnum < FIRST_DATA_BLOCK || bnum >= blocks_total()) {
+      continue; // already reported
+    }
+
+    char *block = blocks_get_block(bnum);
+    int offset = 0;
+    while (offset < BLOCK_SIZE) {
+      dirent_t *entry = (dirent_t *)(block + offset);
+      if (!dirent_valid(entry, offset)) {
+        // the rest of the block can't be trusted
+        if (problem(1, "directory %d has a bad entry at %d:%d", inum, bnum,
+                    offset)) {
+          entry->inum = -1;
+          entry->rec_len = BLOCK_SIZE - offset;
+          touched[bnum] = 1;
+        }
+        break;
+      }
+
+      int child = entry->inum;
+      if (child >= 0 && (child == 0 || child >= INODE_COUNT ||
+                         !bitmap_get(ibm, child))) {
+        if (problem(1, "entry '%.*s' in directory %d points at %s inode %d",
+                    entry->name_len, entry->name, inum,
+                    child == 0 || child >= INODE_COUNT ? "invalid" : "free",
+                    child)) {
+          entry->inum = -1;
+          touched[bnum] = 1;
+        }
+      } else if (child > 0 && atomic_fetch_add(&links[child], 1) == 0) {
+        check_inode(child);
+      }
+      offset += entry->rec_len;
+    }
+  }
+}
+
+static void *walker(void *arg) {
+  pthread_mutex_lock(&queue_lock);
+  for (;;) {
+    while (queued == 0 && busy > 0) {
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    }
+    if (queued == 0) {
+      // nothing left, and nobody who could find more
+      break;
+    }
+    int inum = queue[--queued];
+    busy++;
+    pthread_mutex_unlock(&queue_lock);
+
+    read_dir(inum);
+
+    pthread_mutex_lock(&queue_lock);
+    busy--;
+    if (queued == 0 && busy == 0) {
+      pthread_cond_broadcast(&queue_cond);
+    }
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return NULL;
+}
+
+// orphans aren't in any directory, but their blocks are still theirs until
+// the next mount frees them
+static void check_orphans(superblock_t *sb) {
+  uint8_t *ibm = get_inode_bitmap();
+  int orphans = 0;
+  for (int inum = 1; inum < sb->itable_used; inum++) {
+    if (bitmap_get(ibm, inum) && (get_inode(inum)->flags & INODE_ORPHAN)) {
+      check_inode(inum);
+      orphans++;
+    }
+  }
+  if (sb->orphans != orphans &&
+      problem(1, "superblock says %d orphans, there are %d", sb->orphans,
+              orphans)) {
+    sb->orphans = orphans;
+  }
+}
+
+static void check_inodes(superblock_t *sb) {
+  uint8_t *ibm = get_inode_bitmap();
+  for (int inum = 0; inum < INODE_COUNT; inum++) {
+    int used = bitmap_get(ibm, inum);
+    int count = links[inum];
+    if (used && count == 0 && (get_inode(inum)->flags & INODE_ORPHAN)) {
+      // still being freed, its blocks were claimed before the walk
+      continue;
+    }
+    if (used && count == 0) {
+      if (problem(1, "inode %d is in use but not in any directory", inum)) {
+        // its blocks have no owner, so they get freed below
+        bitmap_put(ibm, inum, 0);
+        checksum_dirty(0);
+      }
+      continue;
+    }
+    if (!used) {
+      continue;
+    }
+
+    if (inum >= sb->itable_used &&
+        problem(1, "inode %d is past the initialized inode table", inum)) {
+      sb->itable_used = inum + 1;
+    }
+    inode_t *node = get_inode(inum);
+    if (node->refs != count &&
+        problem(1, "inode %d has %d links but is in %d directories", inum,
+                node->refs, count)) {
+      node->refs = count;
+      inode_dirty(node);
+    }
+  }
+}
+
+static void check_blocks() {
+  uint8_t *bbm = get_blocks_bitmap();
+  uint8_t *refs = get_block_refs();
+  for (int bnum = 0; bnum < BLOCK_COUNT; bnum++) {
+    int count = owners[bnum];
+    int used = bnum < FIRST_DATA_BLOCK || count > 0;
+    if (bitmap_get(bbm, bnum) != used &&
+        problem(1, used ? "block %d is in use but marked free"
+                        : "block %d is marked in use but nothing uses it",
+                bnum)) {
+      bitmap_put(bbm, bnum, used);
+      checksum_dirty(0);
+    }
+
+    int extra = count > 1 ? count - 1 : 0;
+    if (bnum >= FIRST_DATA_BLOCK && refs[bnum] != extra &&
+        problem(extra > UINT8_MAX ? 0 : 1,
+                "block %d has %d owners but a share count of %d", bnum, count,
+                refs[bnum] + 1)) {
+      refs[bnum] = extra;
+    }
+  }
+}
+
+static void check_superblock(superblock_t *sb) {
+  int free_blocks =
+      blocks_total() - bitmap_count(get_blocks_bitmap(), BLOCK_COUNT);
+  int free_inodes = INODE_COUNT - bitmap_count(get_inode_bitmap(), INODE_COUNT);
+  if (sb->free_blocks != free_blocks &&
+      problem(1, "superblock says %d free blocks, there are %d",
+              sb->free_blocks, free_blocks)) {
+    sb->free_blocks = free_blocks;
+  }
+  if (sb->free_inodes != free_inodes &&
+      problem(1, "superblock says %d free inodes, there are %d",
+              sb->free_inodes, free_inodes)) {
+    sb->free_inodes = free_inodes;
+  }
+}
+
+// checks that a single file image is there and has a size it could have
+static int image_ok(const char *path) {
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    perror(path);
+    return 0;
+  }
+  if (st.st_size % BLOCK_SIZE != 0 ||
+      st.st_size < (FIRST_DATA_BLOCK + 1) * BLOCK_SIZE ||
+      st.st_size > NUFS_SIZE) {
+    fprintf(stderr, "%s: expected an image of up to %zu bytes, got %ld bytes\n",
+            path, NUFS_SIZE, (long)st.st_size);
+    return 0;
+  }
+  return 1;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: fsck.nufs [-r] [-j THREADS] IMAGE[,IMAGE...]\n");
+  exit(8);
+}
+
+int main(int argc, char *argv[]) {
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt(argc, argv, "rj:")) != -1) {
+    if (opt == 'r') {
+      repair = 1;
+    } else if (opt == 'j') {
+      threads = atoi(optarg);
+    } else {
+      usage();
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads > MAX_THREADS) {
+    threads = MAX_THREADS;
+  }
+
+  // blocks_init would create (or resize) it otherwise
+  const char *path = argv[optind];
+  if (strchr(path, ',') != NULL) {
+    // the parts of a striped image check their own labels
+    char *list = strdup(path);
+    for (char *part = strtok(list, ","); part != NULL;
+         part = strtok(NULL, ",")) {
+      if (access(part, R_OK | W_OK) < 0) {
+        perror(part);
+        return 8;
+      }
+    }
+    free(list);
+  } else if (!image_ok(path)) {
+    return 8;
+  }
+
+  blocks_init(path);
+  crc32c_init();
+
+  superblock_t *sb = get_superblock();
+  if (!bitmap_get(get_blocks_bitmap(), 1)) {
+    fprintf(stderr, "%s: not formatted\n", path);
+    return 8;
+  }
+  // the inodes and directories of another format can't even be read
+  if (sb->magic != NUFS_MAGIC || sb->version != NUFS_VERSION) {
+    fprintf(stderr,
+            "%s: made by an older nufs (format version %d, this one reads "
+            "version %d)\n",
+            path, sb->magic == NUFS_MAGIC ? sb->version : 0, NUFS_VERSION);
+    return 8;
+  }
+
+  // what happened since the journal's last checkpoint isn't in place yet
+  int txns = journal_pending();
+  if (txns > 0 &&
+      problem(1, "the journal has %d transactions to replay", txns)) {
+    journal_replay();
+  }
+
+  // the bitmaps and inode table
+  for (int bnum = 0; bnum < META_BLOCK; bnum++) {
+    verify_block(bnum);
+  }
+
+  // the journal has no inode, it's only in the superblock
+  if (sb->journal_blocks > 0) {
+    if (sb->journal_start < FIRST_DATA_BLOCK ||
+        sb->journal_start + sb->journal_blocks > blocks_total()) {
+      problem(0, "the journal is at blocks %d-%d", sb->journal_start,
+              sb->journal_start + sb->journal_blocks - 1);
+    } else {
+      for (int i = 0; i < sb->journal_blocks; i++) {
+        owners[sb->journal_start + i]++;
+      }
+    }
+  }
+
+  if (!bitmap_get(get_inode_bitmap(), 0)) {
+    problem(0, "the root directory is gone");
+  } else {
+    links[0] = 1; // the mount point
+    check_inode(0);
+  }
+  check_orphans(sb);
+
+  pthread_t pool[MAX_THREADS];
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&pool[i], NULL, walker, NULL);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(pool[i], NULL);
+  }
+
+  check_inodes(sb);
+  check_blocks();
+  check_superblock(sb);
+
+  if (fixed > 0) {
+    for (int bnum = 0; bnum < BLOCK_COUNT; bnum++) {
+      if (touched[bnum]) {
+        checksum_dirty(bnum);
+      }
+    }
+    checksum_seal();
+  }
+
+  printf("%s: %d/%d inodes, %d/%d blocks, %d errors fixed, %d left\n", path,
+         INODE_COUNT - sb->free_inodes, INODE_COUNT,
+         blocks_total() - sb->free_blocks, blocks_total(), (int)fixed,
+         (int)left);
+  blocks_free();
+  if (left > 0) {
+    return 4;
+  }
+  return fixed > 0 ? 1 : 0;
+}
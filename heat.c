@@ -0,0 +1,81 @@
+#include <string.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "heat.h"
+#include "inode.h"
+
+typedef struct heat {
+  heat_stats_t stats;
+  uint32_t stamp; // when the counters were last decayed
+} heat_t;
+
+static heat_t heat[INODE_COUNT];
+
+// halves the counters once for every half-life since the last time
+static heat_t *decayed(int inum, uint32_t now) {
+  heat_t *h = &heat[inum];
+  uint32_t halvings = (now - h->stamp) / HEAT_HALF_LIFE;
+  if (halvings == 0) {
+    return h;
+  }
+  if (halvings >= 64) {
+    memset(&h->stats, 0, sizeof(heat_stats_t));
+  } else {
+    h->stats.reads >>= halvings;
+    h->stats.writes >>= halvings;
+    h->stats.bytes_read >>= halvings;
+    h->stats.bytes_written >>= halvings;
+  }
+  // (what's left over of the last half-life still counts)
+  h->stamp += halvings * HEAT_HALF_LIFE;
+  return h;
+}
+
+void heat_read(int inum, int bytes) {
+  heat_t *h = decayed(inum, time(NULL));
+  h->stats.reads++;
+  h->stats.bytes_read += bytes > 0 ? bytes : 0;
+}
+
+void heat_write(int inum, int bytes) {
+  heat_t *h = decayed(inum, time(NULL));
+  h->stats.writes++;
+  h->stats.bytes_written += bytes > 0 ? bytes : 0;
+}
+
+void heat_forget(int inum) {
+  memset(&heat[inum].stats, 0, sizeof(heat_stats_t));
+}
+
+uint64_t heat_score(const heat_stats_t *stats) {
+  return stats->reads + stats->writes +
+         (stats->bytes_read + stats->bytes_written) / BLOCK_SIZE;
+}
+
+int heat_top(int count, int *inums, heat_stats_t *stats) {
+  if (count <= 0) {
+    return 0;
+  }
+  uint32_t now = time(NULL);
+  uint64_t scores[count];
+  int found = 0;
+  for (int inum = 0; inum < INODE_COUNT; inum++) {
+    heat_t *h = decayed(inum, now);
+    uint64_t score = heat_score(&h->stats);
+    if (score == 0 || (found == count && score <= scores[count - 1])) {
+      continue;
+    }
+    // insertion into the (short) sorted list, the coldest falls off
+    int i = found < count ? found++ : count - 1;
+    for (; i > 0 && scores[i - 1] < score; i--) {
+      scores[i] = scores[i - 1];
+      inums[i] = inums[i - 1];
+      stats[i] = stats[i - 1];
+    }
+    scores[i] = score;
+    inums[i] = inum;
+    stats[i] = h->stats;
+  }
+  return found;
+}
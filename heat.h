@@ -0,0 +1,36 @@
+// Per-inode access heat (the heat mount option).
+//
+// Every read and write through storage_read/storage_write adds to its
+// file's counters: how many reads and writes, and how many bytes each
+// moved. The counters only live in memory and decay, halving every
+// HEAT_HALF_LIFE seconds, so they show what's hot lately rather than
+// since the mount. Decay is applied lazily, when a file is touched or
+// looked at, so keeping the counters costs a few additions per request.
+// NUFS_IOC_HEAT (nufsctl heat) lists the hottest files.
+
+#ifndef HEAT_H
+#define HEAT_H
+
+#include <stdint.h>
+
+#define HEAT_HALF_LIFE 60 // seconds
+
+typedef struct heat_stats {
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+} heat_stats_t;
+
+// counts a read or a write of the given number of bytes
+void heat_read(int inum, int bytes);
+void heat_write(int inum, int bytes);
+// drops the counters of a freed inode
+void heat_forget(int inum);
+// how hot a file is: its requests plus the blocks they moved
+uint64_t heat_score(const heat_stats_t *stats);
+// fills in up to count of the hottest inodes (hottest first) and their
+// counters, returns how many; inodes with no heat left aren't listed
+int heat_top(int count, int *inums, heat_stats_t *stats);
+
+#endif
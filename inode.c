@@ -3,10 +3,21 @@
 #include <time.h>
 // for unit8_t
 #include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "checksum.h"
+#include "heat.h"
 #include "inode.h"
+#include "journal.h"
+#include "layout.h"
+#include "orphan.h"
+#include "reserve.h"
+#include "segment.h"
+#include "span.h"
+#include "times.h"
 
 // print off some metadata about the inode
 void print_inode(inode_t *node) {
@@ -23,16 +34,68 @@ void print_inode(inode_t *node) {
   printf("Size (bytes): %d\n", node->size);
   printf("Indirect Pointer Count: %d\n", node->iptr);
   printf("Direct Pointers: %d, %d\n", node->ptrs[0], node->ptrs[1]);
+  printf("Flags: %x\n", node->flags);
 }
 
 // grabs the pointer to an inode structure
 // in the form of inode*
 inode_t *get_inode(int inum) {
-  inode_t *inodes = get_inode_bitmap() + 32;
+  inode_t *inodes = get_inode_bitmap() + INODE_BITMAP_SIZE;
   return &inodes[inum];
 }
 
-int alloc_inode() {
+// the inode's number, from its place in the table
+int inode_num(inode_t *node) { return node - get_inode(0); }
+
+static int group_free_inodes(int group) {
+  uint8_t *inode_bitmap = get_inode_bitmap();
+  // (groups start on a byte boundary, see layout.h)
+  return GROUP_INODES - bitmap_count(inode_bitmap + group * GROUP_INODES / 8,
+                                     GROUP_INODES);
+}
+
+// picks the block group for a new inode in the given directory: files stay
+// with their directory, but directories made in the root are spread out to
+// the group with the most free blocks, so that unrelated trees don't have to
+// share one
+int inode_pick_group(int parent, int mode) {
+  int group = INODE_GROUP(parent);
+  if (!S_ISDIR(mode) || parent != 0) {
+    return group;
+  }
+  int best = group_free_inodes(group) > 0 ? group_free_blocks(group) : -1;
+  for (int g = 0; g < GROUP_COUNT; g++) {
+    if (group_free_inodes(g) > 0 && group_free_blocks(g) > best) {
+      best = group_free_blocks(g);
+      group = g;
+    }
+  }
+  return group;
+}
+
+// allocates a block for the file near goal, from the file's reserved window
+// when it can (see reserve.h), or from the log for a file in log mode
+static int alloc_near(inode_t *node, int goal) {
+  if (node->flags & INODE_LOG) {
+    return segment_alloc(goal);
+  }
+  return reserve_alloc(inode_num(node), goal);
+}
+
+// allocates a block for the given page slot of the file, right after the
+// block of the slot before it if possible, or else in the inode's group
+int inode_alloc_block(inode_t *node, int slot) {
+  int prev = 0;
+  if (slot > 0 && (slot - 1 < nptrs || node->iptr != 0)) {
+    prev = inode_get_bnum(node, (slot - 1) * 4096);
+  }
+  if (prev > 0) {
+    return alloc_near(node, prev + 1);
+  }
+  return alloc_near(node, INODE_GROUP(inode_num(node)) * GROUP_BLOCKS);
+}
+
+int alloc_inode(int group) {
   uint8_t *inode_bitmap = get_inode_bitmap();
 
   // erorr if inode bitmap wasn't found
@@ -40,10 +103,13 @@ int alloc_inode() {
     return -1;
   }
 
+  // the first free inode from the start of the group on
   int nodenum = -1;
-  for (int i = 0; i < 256; i++) {
+  for (int j = 0; j < INODE_COUNT; j++) {
+    int i = (group * GROUP_INODES + j) % INODE_COUNT;
     if (!bitmap_get(inode_bitmap, i)) {
       bitmap_put(inode_bitmap, i, 1);
+      get_superblock()->free_inodes--;
       nodenum = i;
       break;
     }
@@ -59,19 +125,32 @@ int alloc_inode() {
     // If we fail to get the inode for some reason, revert bitmap changes and
     // return an error
     bitmap_put(inode_bitmap, nodenum, 0);
+    get_superblock()->free_inodes++;
     return -1;
   }
 
+  // the table is initialized lazily, mkfs leaves whatever was there
+  superblock_t *sb = get_superblock();
+  if (nodenum >= sb->itable_used) {
+    memset(the_new_node, 0, sizeof(inode_t));
+    sb->itable_used = nodenum + 1;
+  }
+
   // Initialize the new inode fields
+  inode_dirty(the_new_node);
+  checksum_dirty_range(inode_bitmap, INODE_BITMAP_SIZE);
   the_new_node->refs = 1;
   the_new_node->size = 0;
   the_new_node->mode = 0;
+  the_new_node->flags = 0;
+  the_new_node->atime = the_new_node->mtime = the_new_node->ctime = time(NULL);
 
   // Allocate a block for the inode
-  int block_num = alloc_block();
+  int block_num = inode_alloc_block(the_new_node, 0);
   if (block_num < 0) {
     // for whatever reason we couldn't allocate a block
     bitmap_put(inode_bitmap, nodenum, 0);
+    get_superblock()->free_inodes++;
 
     // but really, we should never reach this!!
     return -1;
@@ -104,18 +183,48 @@ void free_inode(int inum) {
   // free the blocks used by the inode
   shrink_inode(node, 0);
 
-  if (node->ptrs[0] != 0) {
+  // (a compressed first cluster keeps its block count here instead)
+  if (node->ptrs[0] > 0) {
     free_block(node->ptrs[0]);
   }
 
   // once done mark as free!!!
+  times_forget(inum);
+  heat_forget(inum);
+  reserve_release(inum);
   bitmap_put(inode_bitmap, inum, 0);
+  get_superblock()->free_inodes++;
+  checksum_dirty_range(inode_bitmap, INODE_BITMAP_SIZE);
 }
 
+static int add_blocks(inode_t *node, int new_size);
+
 int grow_inode(inode_t *node, int new_size) {
+  span_begin("grow_inode");
+  int rv = add_blocks(node, new_size);
+  span_end();
+  return rv;
+}
+
+// gives back the blocks a grow that ran out of space at the given slot got
+// so far, leaving the inode at its old size
+static int undo_grow(inode_t *node, int slot, int size) {
+  node->size = (slot - 1) * 4096;
+  shrink_inode(node, size);
+  // (an indirect block allocated for this slot has nothing in it yet)
+  if (slot == nptrs && node->iptr != 0) {
+    free_block(node->iptr);
+    node->iptr = 0;
+  }
+  return -1;
+}
+
+static int add_blocks(inode_t *node, int new_size) {
   if (node == NULL) {
     return -1;
   }
+  inode_dirty(node);
+  int old_size = node->size;
 
   // Calculate how many blocks we currently have and how many we need
   int current_block_count = node->size / 4096;
@@ -126,10 +235,10 @@ int grow_inode(inode_t *node, int new_size) {
   for (int i = current_block_count + 1; i <= needed_block_count; i++) {
     if (i < nptrs) {
 
-      int block_num = alloc_block();
+      int block_num = inode_alloc_block(node, i);
       if (block_num < 0) {
         // couldn't allocate so exit
-        return -1;
+        return undo_grow(node, i, old_size);
       }
       node->ptrs[i] = block_num;
     } else {
@@ -138,9 +247,9 @@ int grow_inode(inode_t *node, int new_size) {
 
         // allocate indirect pointer
         // (only if needed)
-        int iptr_block = alloc_block();
+        int iptr_block = inode_alloc_block(node, i);
         if (iptr_block < 0) {
-          return -1;
+          return undo_grow(node, i, old_size);
         }
         node->iptr = iptr_block;
       }
@@ -152,12 +261,16 @@ int grow_inode(inode_t *node, int new_size) {
       }
 
       // allocate new block, for the pointer
-      int block_num = alloc_block();
+      // (after the indirect block, if it was just allocated)
+      int block_num = i == nptrs ? alloc_near(node, node->iptr + 1)
+                                 : inode_alloc_block(node, i);
       if (block_num < 0) {
         // failed to allocate so exit...
-        return -1;
+        return undo_grow(node, i, old_size);
       }
       indirect_ptrs[i - nptrs] = block_num;
+      checksum_dirty(node->iptr);
+      journal_dirty(node->iptr);
     }
   }
 
@@ -167,15 +280,24 @@ int grow_inode(inode_t *node, int new_size) {
 }
 
 // shrinks an inode size and deallocates pages if we've freed them up
+// (slots that don't hold a block, like those of compressed clusters, are
+// skipped)
 int shrink_inode(inode_t *node, int size) {
+  inode_dirty(node);
   for (int i = (node->size / 4096); i > size / 4096; i--) {
-    if (i < nptrs) {             // we're in direct ptrs
-      free_block(node->ptrs[i]); // free the page
+    if (i < nptrs) { // we're in direct ptrs
+      if (node->ptrs[i] > 0) {
+        free_block(node->ptrs[i]); // free the page
+      }
       node->ptrs[i] = 0;
     } else {                                     // need to use indirect
       int *iptrs = blocks_get_block(node->iptr); // retrieve memory loc.
-      free_block(iptrs[i - nptrs]);              // free the single page
+      if (iptrs[i - nptrs] > 0) {
+        free_block(iptrs[i - nptrs]); // free the single page
+      }
       iptrs[i - nptrs] = 0;
+      checksum_dirty(node->iptr);
+      journal_dirty(node->iptr);
 
       if (i == nptrs) {         // if that was the last thing on the page
         free_block(node->iptr); // we don't need it anymore
@@ -198,10 +320,29 @@ int inode_get_bnum(inode_t *node, int file_bnum) {
   }
 }
 
+// points the page holding the given byte of the file at another block
+void inode_set_bnum(inode_t *node, int file_bnum, int bnum) {
+  int blocknum = file_bnum / 4096;
+  if (blocknum < nptrs) {
+    node->ptrs[blocknum] = bnum;
+    inode_dirty(node);
+  } else {
+    int *iptrs = blocks_get_block(node->iptr);
+    iptrs[blocknum - nptrs] = bnum;
+    checksum_dirty(node->iptr);
+    journal_dirty(node->iptr);
+  }
+}
+
 void decrease_refs(int inum) {
   inode_t *node = get_inode(inum);
+  inode_dirty(node);
   node->refs = node->refs - 1;
-  if (node->refs < 1) {
+  // (big files are freed in the background)
+  if (node->refs < 1 && !orphan_file(inum)) {
     free_inode(inum);
   }
 }
+
+// marks the inode as modified so its checksum gets updated
+void inode_dirty(inode_t *node) { checksum_dirty_range(node, sizeof(inode_t)); }
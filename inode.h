@@ -7,10 +7,25 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <stdint.h>
+
 // including blocks.h isn't technically needed, but we can remove later
 #include "blocks.h"
 
 #define nptrs 2
+// can be set at build time (a multiple of 64)
+#ifndef INODE_COUNT
+#define INODE_COUNT 256
+#endif
+
+// per-file flags, the same bits chattr uses (FS_*_FL) so they can be set
+// through FS_IOC_SETFLAGS
+#define INODE_COMPRESS 0x00000004 // compress the file's data (FS_COMPR_FL)
+#define INODE_LOG 0x00004000 // write changed blocks to the log, see segment.h
+                             // (FS_JOURNAL_DATA_FL)
+// (not a chattr flag) an unlinked file whose blocks are still being freed,
+// see orphan.h
+#define INODE_ORPHAN 0x80000000
 
 typedef struct inode {
   int refs;        // reference count
@@ -18,15 +33,25 @@ typedef struct inode {
   int size;        // bytes
   int ptrs[nptrs]; // direct pointers
   int iptr;        // single indirect pointer
+  int flags;       // INODE_* flags
+  uint32_t atime;  // last access, in seconds (see times.h)
+  uint32_t mtime;  // last data change
+  uint32_t ctime;  // last inode change
 } inode_t; // instead of having a single block pointer, we have an array of them
 
 void print_inode(inode_t *node);
 inode_t *get_inode(int inum);
-int alloc_inode();
+int inode_num(inode_t *node);
+int inode_pick_group(int parent, int mode);
+int alloc_inode(int group);
+int inode_alloc_block(inode_t *node, int slot);
 void free_inode(int inum);
 int grow_inode(inode_t *node, int size);
 int shrink_inode(inode_t *node, int size);
 int inode_get_bnum(inode_t *node, int file_bnum);
+void inode_set_bnum(inode_t *node, int file_bnum, int bnum);
 void decrease_refs(int inum);
+// marks the inode as modified so its checksum gets updated
+void inode_dirty(inode_t *node);
 
 #endif
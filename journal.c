@@ -0,0 +1,460 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "checksum.h"
+#include "crc32c.h"
+#include "journal.h"
+#include "layout.h"
+
+// the first block of the journal, says where replaying starts
+typedef struct journal_head {
+  uint32_t magic;
+  uint32_t seq; // of the first transaction after the last checkpoint
+} journal_head_t;
+
+// the first block of a transaction, the copies of the blocks it lists
+// follow it in the same order
+typedef struct journal_desc {
+  uint32_t magic;
+  uint32_t seq;
+  int32_t count;       // entries in bnums
+  uint32_t crc;        // of this block (with crc 0) and the copies
+  superblock_t super;  // as it was at the end of the transaction
+  int32_t bnums[];     // where each copy goes, ~bnum for a revoke
+} journal_desc_t;
+
+#define DESC_MAX                                                               \
+  ((BLOCK_SIZE - (int)sizeof(journal_desc_t)) / (int)sizeof(int32_t))
+
+// where the journal is, once we're using it
+static int enabled = 0;
+static int start = 0;
+static int size = 0;
+static uint32_t next_seq = 1;
+static int head = 1; // where the next transaction goes
+
+// metadata blocks changed since the last commit, and freed blocks the
+// journal has copies of
+static uint8_t pending[BLOCK_BITMAP_SIZE];
+static int pending_list[BLOCK_COUNT];
+static int pending_count = 0;
+static int revoke_list[JOURNAL_MAX_BLOCKS];
+static int revoke_count = 0;
+static int entries[BLOCK_COUNT + JOURNAL_MAX_BLOCKS];
+
+// blocks with copies in the journal since the last checkpoint (each copy
+// takes a journal block, so there can't be more than that)
+static uint8_t logged[BLOCK_BITMAP_SIZE];
+static int logged_list[JOURNAL_MAX_BLOCKS];
+static int logged_count = 0;
+
+// replaying: the last transaction that revoked each block
+static uint32_t revoked[BLOCK_COUNT];
+
+// group commit: the journal up to appended holds the transactions up to
+// appended_seq, the part up to flushed is on disk
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int appended = 1;
+static int flushed = 1;
+static uint32_t appended_seq = 0;
+static uint32_t durable_seq = 0;
+static int flush_busy = 0;
+static pthread_t committer;
+static int committing = 0;
+static int stopping = 0;
+static long commits = 0;
+static long flushes = 0;
+static long checkpoints = 0;
+
+static int journal_blocks(int total) {
+  int count = total / 16;
+  if (count < JOURNAL_MIN_BLOCKS) {
+    count = JOURNAL_MIN_BLOCKS;
+  }
+  if (count > JOURNAL_MAX_BLOCKS) {
+    count = JOURNAL_MAX_BLOCKS;
+  }
+  return count;
+}
+
+// the journal the superblock points at, or NULL if there's none (or it
+// makes no sense)
+static journal_head_t *get_head(int *first, int *count) {
+  superblock_t *sb = get_superblock();
+  *first = sb->journal_start;
+  *count = sb->journal_blocks;
+  if (*count < 2 || *first < (int)FIRST_DATA_BLOCK ||
+      *first + *count > blocks_total()) {
+    return NULL;
+  }
+  journal_head_t *jh = blocks_get_block(*first);
+  return jh->magic == JOURNAL_MAGIC ? jh : NULL;
+}
+
+static uint32_t desc_crc(journal_desc_t *desc, int copies) {
+  uint32_t saved = desc->crc;
+  desc->crc = 0;
+  uint32_t crc = crc32c(0, desc, BLOCK_SIZE);
+  desc->crc = saved;
+  for (int i = 1; i <= copies; i++) {
+    crc = crc32c(crc, (uint8_t *)desc + i * BLOCK_SIZE, BLOCK_SIZE);
+  }
+  return crc;
+}
+
+// checks the transaction at pos of the journal, which should be number
+// seq, returns where the next one starts or 0 if it isn't one (because it
+// was never committed, or is from before the last checkpoint)
+static int next_desc(int first, int count, int pos, uint32_t seq) {
+  if (pos >= count) {
+    return 0;
+  }
+  journal_desc_t *desc = blocks_get_block(first + pos);
+  if (desc->magic != JOURNAL_MAGIC || desc->seq != seq || desc->count <= 0 ||
+      desc->count > DESC_MAX) {
+    return 0;
+  }
+  int copies = 0;
+  for (int i = 0; i < desc->count; i++) {
+    int bnum = desc->bnums[i] < 0 ? ~desc->bnums[i] : desc->bnums[i];
+    if (bnum >= blocks_total() || IS_META_BLOCK(bnum) ||
+        (bnum >= first && bnum < first + count)) {
+      return 0;
+    }
+    copies += desc->bnums[i] >= 0;
+  }
+  if (pos + 1 + copies > count || desc_crc(desc, copies) != desc->crc) {
+    return 0;
+  }
+  return pos + 1 + copies;
+}
+
+// goes through the committed transactions, copying them into place if
+// apply is set, and returns how many there are
+static int scan(int apply) {
+  int first, count;
+  journal_head_t *jh = get_head(&first, &count);
+  if (jh == NULL) {
+    return 0;
+  }
+  crc32c_init();
+
+  // the revokes first, they can come after the copies they're about
+  int txns = 0;
+  uint32_t seq = jh->seq;
+  for (int pos = 1, end; (end = next_desc(first, count, pos, seq)) > 0;
+       pos = end, seq++, txns++) {
+    journal_desc_t *desc = blocks_get_block(first + pos);
+    for (int i = 0; apply && i < desc->count; i++) {
+      if (desc->bnums[i] < 0) {
+        revoked[~desc->bnums[i]] = seq;
+      }
+    }
+  }
+  if (!apply || txns == 0) {
+    return txns;
+  }
+
+  superblock_t *sb = get_superblock();
+  int copied = 0;
+  seq = jh->seq;
+  for (int pos = 1, t = 0; t < txns; t++, seq++) {
+    journal_desc_t *desc = blocks_get_block(first + pos);
+    int copy = first + pos + 1;
+    for (int i = 0; i < desc->count; i++) {
+      int bnum = desc->bnums[i];
+      if (bnum < 0) {
+        continue;
+      }
+      // (a revoke in the same transaction came before this copy)
+      if (revoked[bnum] <= seq) {
+        memcpy(blocks_get_block(bnum), blocks_get_block(copy), BLOCK_SIZE);
+        checksum_dirty(bnum);
+        copied++;
+      }
+      copy++;
+    }
+    if (t == txns - 1) {
+      superblock_t super = desc->super;
+      super.magic = sb->magic;
+      super.journal_start = sb->journal_start;
+      super.journal_blocks = sb->journal_blocks;
+      *sb = super;
+    }
+    pos = copy - first;
+  }
+
+  // forget the revokes for next time
+  seq = jh->seq;
+  for (int pos = 1, t = 0; t < txns; t++, seq++) {
+    journal_desc_t *desc = blocks_get_block(first + pos);
+    for (int i = 0; i < desc->count; i++) {
+      if (desc->bnums[i] < 0) {
+        revoked[~desc->bnums[i]] = 0;
+      }
+    }
+    pos = next_desc(first, count, pos, seq);
+  }
+  printf("journal: replayed %d transactions, %d blocks\n", txns, copied);
+  return txns;
+}
+
+int journal_pending() { return scan(0); }
+
+int journal_replay() {
+  int txns = scan(1);
+  int first, count;
+  journal_head_t *jh = get_head(&first, &count);
+  if (txns > 0 && jh != NULL) {
+    // the blocks in place have to be on disk before the journal forgets
+    // them
+    blocks_sync();
+    jh->seq += txns;
+    blocks_sync_range(first, 1);
+  }
+  return txns;
+}
+
+int journal_init() {
+  superblock_t *sb = get_superblock();
+  int first, count;
+  journal_head_t *jh = get_head(&first, &count);
+  if (jh == NULL) {
+    count = journal_blocks(blocks_total());
+    first = alloc_block_run(FIRST_DATA_BLOCK, count);
+    if (first < 0) {
+      return -ENOSPC;
+    }
+    jh = blocks_get_block(first);
+    memset(jh, 0, BLOCK_SIZE);
+    jh->magic = JOURNAL_MAGIC;
+    jh->seq = 1;
+    sb->journal_start = first;
+    sb->journal_blocks = count;
+    printf("journal: set aside blocks %d-%d\n", first, first + count - 1);
+  }
+  // whatever happened before the journal was there starts out on disk
+  int rv = blocks_sync();
+  if (rv < 0) {
+    return rv;
+  }
+
+  start = first;
+  size = count;
+  next_seq = jh->seq;
+  head = appended = flushed = 1;
+  appended_seq = durable_seq = next_seq - 1;
+  memset(pending, 0, sizeof(pending));
+  pending_count = revoke_count = 0;
+  memset(logged, 0, sizeof(logged));
+  logged_count = 0;
+  enabled = 1;
+  return 0;
+}
+
+// makes the journal up to appended durable, called with flush_lock held
+// (which it lets go of meanwhile)
+static void flush() {
+  uint32_t seq = appended_seq;
+  int from = flushed;
+  int to = appended;
+  flush_busy = 1;
+  pthread_mutex_unlock(&flush_lock);
+  blocks_sync_range(start + from, to - from);
+  pthread_mutex_lock(&flush_lock);
+  flush_busy = 0;
+  flushed = to;
+  durable_seq = seq;
+  flushes++;
+  pthread_cond_broadcast(&done_cond);
+}
+
+// flushes whatever was appended while the last flush was going on, so
+// however many operations commit meanwhile, they share one flush
+static void *commit_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&flush_lock);
+  while (1) {
+    while (durable_seq == appended_seq && !stopping) {
+      pthread_cond_wait(&flush_cond, &flush_lock);
+    }
+    if (durable_seq == appended_seq) {
+      break;
+    }
+    flush();
+  }
+  pthread_mutex_unlock(&flush_lock);
+  return NULL;
+}
+
+void journal_wait(uint32_t seq) {
+  pthread_mutex_lock(&flush_lock);
+  while ((int32_t)(durable_seq - seq) < 0) {
+    if (committing) {
+      pthread_cond_signal(&flush_cond);
+      pthread_cond_wait(&done_cond, &flush_lock);
+    } else if (flush_busy) {
+      pthread_cond_wait(&done_cond, &flush_lock);
+    } else {
+      // no commit thread (yet), flush it ourselves
+      flush();
+    }
+  }
+  pthread_mutex_unlock(&flush_lock);
+}
+
+static int compare_ints(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+// writes the journaled blocks out in place, then empties the journal
+static void checkpoint() {
+  // (the commit thread can't still be flushing a part that gets reused)
+  journal_wait(appended_seq);
+
+  // in order, so runs of them go out together
+  qsort(logged_list, logged_count, sizeof(int), compare_ints);
+  for (int i = 0; i < logged_count;) {
+    int run = 1;
+    while (i + run < logged_count &&
+           logged_list[i + run] == logged_list[i] + run) {
+      run++;
+    }
+    blocks_sync_range(logged_list[i], run);
+    i += run;
+  }
+  for (int i = 0; i < logged_count; i++) {
+    bitmap_put(logged, logged_list[i], 0);
+  }
+  logged_count = 0;
+  // and the superblock, which the transactions had copies of
+  blocks_sync_range(META_BLOCK, META_BLOCKS);
+
+  journal_head_t *jh = blocks_get_block(start);
+  jh->seq = next_seq;
+  blocks_sync_range(start, 1);
+
+  pthread_mutex_lock(&flush_lock);
+  head = appended = flushed = 1;
+  pthread_mutex_unlock(&flush_lock);
+  checkpoints++;
+}
+
+void journal_dirty(int bnum) {
+  if (!enabled || bnum < 0 || IS_META_BLOCK(bnum) ||
+      bitmap_get(pending, bnum)) {
+    return;
+  }
+  bitmap_put(pending, bnum, 1);
+  pending_list[pending_count++] = bnum;
+}
+
+void journal_forget(int bnum) {
+  if (!enabled || !bitmap_get(logged, bnum)) {
+    return;
+  }
+  // (it's logged again if it's back in use by the end of the transaction)
+  bitmap_put(logged, bnum, 0);
+  revoke_list[revoke_count++] = bnum;
+}
+
+uint32_t journal_commit() {
+  if (!enabled) {
+    return 0;
+  }
+
+  // what's still in use of what was changed, then the revokes
+  void *bbm = get_blocks_bitmap();
+  int count = 0;
+  int copies = 0;
+  for (int i = 0; i < pending_count; i++) {
+    int bnum = pending_list[i];
+    bitmap_put(pending, bnum, 0);
+    if (bitmap_get(bbm, bnum)) {
+      entries[count++] = bnum;
+      copies++;
+    }
+  }
+  pending_count = 0;
+  for (int i = 0; i < revoke_count; i++) {
+    entries[count++] = ~revoke_list[i];
+  }
+  revoke_count = 0;
+  if (count == 0) {
+    return 0;
+  }
+
+  if (count > DESC_MAX || 2 + copies > size) {
+    // doesn't fit in the journal at all, write it all out in place
+    checkpoint();
+    blocks_sync();
+    return 0;
+  }
+  if (head + 1 + copies > size) {
+    checkpoint();
+  }
+
+  journal_desc_t *desc = blocks_get_block(start + head);
+  memset(desc, 0, BLOCK_SIZE);
+  desc->magic = JOURNAL_MAGIC;
+  desc->seq = next_seq;
+  desc->count = count;
+  desc->super = *get_superblock();
+  int copy = start + head + 1;
+  for (int i = 0; i < count; i++) {
+    int bnum = entries[i];
+    desc->bnums[i] = bnum;
+    if (bnum < 0) {
+      continue;
+    }
+    memcpy(blocks_get_block(copy++), blocks_get_block(bnum), BLOCK_SIZE);
+    if (!bitmap_get(logged, bnum)) {
+      bitmap_put(logged, bnum, 1);
+      logged_list[logged_count++] = bnum;
+    }
+  }
+  desc->crc = desc_crc(desc, copies);
+
+  uint32_t seq = next_seq++;
+  head = copy - start;
+  pthread_mutex_lock(&flush_lock);
+  appended = head;
+  appended_seq = seq;
+  commits++;
+  pthread_cond_signal(&flush_cond);
+  pthread_mutex_unlock(&flush_lock);
+  return seq;
+}
+
+void journal_start() {
+  if (!enabled) {
+    return;
+  }
+  stopping = 0;
+  committing = pthread_create(&committer, NULL, commit_thread, NULL) == 0;
+}
+
+void journal_stop() {
+  if (!enabled) {
+    return;
+  }
+  if (committing) {
+    pthread_mutex_lock(&flush_lock);
+    stopping = 1;
+    pthread_cond_signal(&flush_cond);
+    pthread_mutex_unlock(&flush_lock);
+    pthread_join(committer, NULL);
+    committing = 0;
+  }
+  checkpoint();
+  printf("journal: %ld transactions in %ld flushes, %ld checkpoints\n",
+         commits, flushes, checkpoints);
+}
@@ -0,0 +1,71 @@
+// Write-ahead journal of metadata changes (the journal mount option).
+//
+// Without it the bitmaps, inodes, directory blocks and indirect blocks are
+// changed in place in the mapped image, and reach the disk whenever the
+// kernel gets around to them, in no particular order, so a crash can leave
+// them disagreeing with each other. With it, when an operation is done (see
+// storage_unlock) the metadata blocks it changed are copied to the journal
+// as one transaction: a descriptor listing where each block belongs, with
+// a copy of the superblock and a checksum over the whole transaction, then
+// the blocks. The journal is a run of blocks set aside in the image, which
+// the superblock points at.
+//
+// A commit thread makes every transaction appended since its last flush
+// durable with a single msync of the journal, and the operations waiting
+// on them all return then (group commit), so each operation's metadata is
+// on disk when it returns without a sync of the image. The blocks in place
+// are only written out when the journal fills up (a checkpoint, after
+// which it starts over) and at unmount.
+//
+// Mounting copies the transactions since the last checkpoint back into
+// place, so it takes time proportional to the journal, not the image. A
+// freed block can be reused for file data, which isn't journaled, so
+// freeing a block that's in the journal adds a revoke to the transaction
+// that keeps older copies of it from being replayed.
+//
+// Share counts and checksums aren't journaled: replayed blocks get new
+// checksums, and the counts are the ones fsck.nufs checks.
+//
+// The journal only ever redoes, it can't undo: the image is mapped shared,
+// so metadata changed in place can reach the disk whenever the kernel
+// writes the page back, before its transaction is committed. A crash then
+// leaves that uncommitted metadata in place, and replay only brings back
+// the blocks of committed transactions over it, so an operation that was
+// cut short can still show up half done.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+// the journal gets 1/16 of the image, within these
+#define JOURNAL_MIN_BLOCKS 8
+#define JOURNAL_MAX_BLOCKS 1024
+
+// copies the transactions the journal of the image has since its last
+// checkpoint into place, returns how many there were
+int journal_replay();
+// counts the transactions journal_replay would replay, without changing
+// anything
+int journal_pending();
+// starts journaling, setting the journal aside first if the image doesn't
+// have one yet. Returns 0 or -errno.
+int journal_init();
+// starts and stops the commit thread; stopping checkpoints, so the
+// journal is empty on an image that was unmounted cleanly
+void journal_start();
+void journal_stop();
+// marks a metadata block as modified by the operation in progress (the
+// bitmaps and inode table get this from checksum_dirty)
+void journal_dirty(int bnum);
+// called when a block is freed, its older copies mustn't be replayed
+void journal_forget(int bnum);
+// appends the blocks the operation modified to the journal, called with
+// the storage lock held. Returns the transaction to wait for, 0 if
+// there's nothing to wait for.
+uint32_t journal_commit();
+// waits for the transaction (and so all those before it) to be on disk
+void journal_wait(uint32_t seq);
+
+#endif
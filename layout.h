@@ -0,0 +1,56 @@
+// On-disk layout of the image.
+//
+//   block 0            block bitmap, inode bitmap, then the inode table
+//                      (which runs on into the next blocks as needed)
+//   META_BLOCK         share counts, checksums and the superblock
+//   FIRST_DATA_BLOCK   the root directory, then everything else
+//
+// The sizes follow from BLOCK_COUNT and INODE_COUNT, which can be changed
+// at build time (see the Makefile). With the defaults the inode table ends
+// in block 2, META_BLOCK is block 3 and the root directory is block 4.
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "blocks.h"
+#include "inode.h"
+
+#define LAYOUT_BLOCKS(bytes) (((bytes) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+#define INODE_BITMAP_SIZE (INODE_COUNT / 8)
+#define INODE_TABLE_OFFSET (BLOCK_BITMAP_SIZE + INODE_BITMAP_SIZE)
+#define INODE_TABLE_END (INODE_TABLE_OFFSET + INODE_COUNT * sizeof(inode_t))
+
+// images always had blocks 1-3 reserved for the inode table, so metadata
+// never starts before block 3
+#define META_BLOCK                                                             \
+  (LAYOUT_BLOCKS(INODE_TABLE_END) > 3 ? LAYOUT_BLOCKS(INODE_TABLE_END) : 3)
+
+// layout of the metadata area, starting at META_BLOCK
+#define META_REFS_OFFSET 0 // share counts, one byte per block
+#define META_CSUM_OFFSET (META_REFS_OFFSET + BLOCK_COUNT) // crc32c per block
+#define META_CSUM_VALID_OFFSET (META_CSUM_OFFSET + 4 * BLOCK_COUNT) // bitmap
+#define META_SUPER_OFFSET (META_CSUM_VALID_OFFSET + BLOCK_BITMAP_SIZE)
+#define META_SIZE (META_SUPER_OFFSET + sizeof(superblock_t))
+#define META_BLOCKS LAYOUT_BLOCKS(META_SIZE)
+
+#define FIRST_DATA_BLOCK (META_BLOCK + META_BLOCKS)
+
+#define IS_META_BLOCK(bnum) ((bnum) >= META_BLOCK && (bnum) < FIRST_DATA_BLOCK)
+
+// The blocks and the inodes (and so both bitmaps) are split into
+// GROUP_COUNT block groups of equal size. A new file's inode goes in its
+// parent directory's group and its blocks in the inode's group, next to the
+// block before them when possible, so a directory, its files and their data
+// end up close together. A group that's full spills over into the next.
+// Group 0 starts with the bitmaps and the metadata.
+#define GROUP_COUNT 4
+#define GROUP_BLOCKS (BLOCK_COUNT / GROUP_COUNT)
+#define GROUP_INODES (INODE_COUNT / GROUP_COUNT)
+#define BLOCK_GROUP(bnum) ((bnum) / GROUP_BLOCKS)
+#define INODE_GROUP(inum) ((inum) / GROUP_INODES)
+
+// returns a pointer to the given offset of the metadata area
+#define META_AREA(offset) ((uint8_t *)blocks_get_block(META_BLOCK) + (offset))
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int hash4(uint32_t v) { return (v * 2654435761U) >> (32 - HASH_BITS); }
+
+// writes a length that didn't fit in its nibble, returns the new position
+static int put_length(uint8_t *dst, int op, int dst_cap, int len) {
+  while (len >= 255) {
+    if (op >= dst_cap) {
+      return -1;
+    }
+    dst[op++] = 255;
+    len -= 255;
+  }
+  if (op >= dst_cap) {
+    return -1;
+  }
+  dst[op++] = len;
+  return op;
+}
+
+// writes one sequence, a match_len of 0 means literals only
+static int put_sequence(uint8_t *dst, int op, int dst_cap, const uint8_t *lit,
+                        int lit_len, int offset, int match_len) {
+  if (op >= dst_cap) {
+    return -1;
+  }
+  int token = op++;
+  int lit_nib = lit_len < 15 ? lit_len : 15;
+  int match_nib = 0;
+  if (match_len > 0) {
+    match_nib = match_len - MIN_MATCH < 15 ? match_len - MIN_MATCH : 15;
+  }
+  dst[token] = (lit_nib << 4) | match_nib;
+
+  if (lit_nib == 15 && (op = put_length(dst, op, dst_cap, lit_len - 15)) < 0) {
+    return -1;
+  }
+  if (op + lit_len > dst_cap) {
+    return -1;
+  }
+  memcpy(dst + op, lit, lit_len);
+  op += lit_len;
+
+  if (match_len == 0) {
+    return op;
+  }
+  if (op + 2 > dst_cap) {
+    return -1;
+  }
+  dst[op++] = offset & 0xff;
+  dst[op++] = offset >> 8;
+  if (match_nib == 15) {
+    op = put_length(dst, op, dst_cap, match_len - MIN_MATCH - 15);
+  }
+  return op;
+}
+
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap) {
+  const uint8_t *in = src;
+  uint8_t *out = dst;
+  // positions are stored + 1 so that 0 means empty
+  int table[1 << HASH_BITS] = {0};
+
+  int ip = 0;
+  int anchor = 0;
+  int op = 0;
+  while (ip + MIN_MATCH <= src_len) {
+    uint32_t seq = read32(in + ip);
+    int h = hash4(seq);
+    int ref = table[h] - 1;
+    table[h] = ip + 1;
+
+    if (ref < 0 || ip - ref > MAX_OFFSET || read32(in + ref) != seq) {
+      ip++;
+      continue;
+    }
+
+    int len = MIN_MATCH;
+    while (ip + len < src_len && in[ref + len] == in[ip + len]) {
+      len++;
+    }
+    op = put_sequence(out, op, dst_cap, in + anchor, ip - anchor, ip - ref,
+                      len);
+    if (op < 0) {
+      return -1;
+    }
+    ip += len;
+    anchor = ip;
+  }
+
+  return put_sequence(out, op, dst_cap, in + anchor, src_len - anchor, 0, 0);
+}
+
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap) {
+  const uint8_t *in = src;
+  uint8_t *out = dst;
+  int ip = 0;
+  int op = 0;
+
+  while (ip < src_len) {
+    int token = in[ip++];
+
+    int lit_len = token >> 4;
+    if (lit_len == 15) {
+      int b;
+      do {
+        if (ip >= src_len) {
+          return -1;
+        }
+        b = in[ip++];
+        lit_len += b;
+      } while (b == 255);
+    }
+    if (ip + lit_len > src_len || op + lit_len > dst_cap) {
+      return -1;
+    }
+    memcpy(out + op, in + ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+
+    // the last sequence has no match
+    if (ip == src_len) {
+      break;
+    }
+
+    if (ip + 2 > src_len) {
+      return -1;
+    }
+    int offset = in[ip] | (in[ip + 1] << 8);
+    ip += 2;
+    int match_len = (token & 0xf) + MIN_MATCH;
+    if ((token & 0xf) == 15) {
+      int b;
+      do {
+        if (ip >= src_len) {
+          return -1;
+        }
+        b = in[ip++];
+        match_len += b;
+      } while (b == 255);
+    }
+    if (offset == 0 || offset > op || op + match_len > dst_cap) {
+      return -1;
+    }
+
+    // byte by byte, the match may overlap what it produces
+    for (int i = 0; i < match_len; i++) {
+      out[op + i] = out[op - offset + i];
+    }
+    op += match_len;
+  }
+
+  return op;
+}
@@ -0,0 +1,18 @@
+// A small LZ77 codec in the style of LZ4.
+//
+// The stream is a series of sequences: a token byte (literal count in the
+// high nibble, match length - 4 in the low nibble, 15 meaning more length
+// bytes follow), the literals, and a 2 byte little endian match offset. The
+// last sequence only has literals.
+
+#ifndef LZ_H
+#define LZ_H
+
+// compresses src into dst, returns the compressed size or -1 if it doesn't
+// fit in dst_cap bytes
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap);
+// decompresses src into dst, returns the decompressed size or -1 if the
+// input is corrupt or doesn't fit in dst_cap bytes
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap);
+
+#endif
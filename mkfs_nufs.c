@@ -0,0 +1,51 @@
+// Formats a nufs image.
+//
+//   mkfs.nufs [-s BLOCKS] [-u UNIT] IMAGE[,IMAGE...]
+//
+// Creates IMAGE if it doesn't exist, with BLOCKS blocks (BLOCK_COUNT by
+// default, it can grow up to that while mounted). Several comma separated
+// files make a striped image, with UNIT blocks per stripe (see
+// blocks_init). Only the bitmaps, the metadata area
+// and the root directory are written, the inode table is initialized as
+// inodes get used, so big images format just as fast as small ones.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "checksum.h"
+#include "inode.h"
+#include "layout.h"
+#include "storage.h"
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "s:u:")) != -1) {
+    if (opt == 's') {
+      blocks_set_new_size(atoi(optarg));
+    } else if (opt == 'u') {
+      blocks_set_stripe_unit(atoi(optarg));
+    } else {
+      optind = argc;
+      break;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr,
+            "usage: mkfs.nufs [-s BLOCKS] [-u UNIT] IMAGE[,IMAGE...]\n");
+    return 2;
+  }
+  const char *image = argv[optind];
+
+  blocks_init(image);
+  storage_format();
+  checksum_seal();
+  blocks_free();
+
+  printf("%s: %d blocks (up to %d) of %d bytes, %d inodes, data starts at "
+         "block %d\n",
+         image, blocks_total(), BLOCK_COUNT, BLOCK_SIZE, INODE_COUNT,
+         (int)FIRST_DATA_BLOCK);
+  return 0;
+}
@@ -4,23 +4,36 @@
 #include <bsd/string.h>
 // #include <dirent.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+// from linux/fs.h, which we can't include because it has its own BLOCK_SIZE
+#define FS_IOC_GETFLAGS _IOR('f', 1, long)
+#define FS_IOC_SETFLAGS _IOW('f', 2, long)
+
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
 #include "inode.h"
+#include "nufs_ioctl.h"
+#include "span.h"
 #include "storage.h"
+#include "trace.h"
 
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask) {
   // real implementation based on ferd's code
+  uint64_t t = trace_begin();
+  storage_lock();
   int rv = storage_access(path);
+  storage_unlock();
+  trace_end(TRACE_ACCESS, t, path, NULL, 0, 0, mask, rv);
 
   // debugging statement from ferd's
   // probably not needed, delete at some point
@@ -28,10 +41,23 @@ int nufs_access(const char *path, int mask) {
   return rv;
 }
 
+// implementation for: man 2 statfs
+// Reports the size of the filesystem and how much of it is free (df).
+int nufs_statfs(const char *path, struct statvfs *st) {
+  uint64_t t = trace_begin();
+  storage_lock();
+  int rv = storage_statfs(st);
+  storage_unlock();
+  trace_end(TRACE_STATFS, t, path, NULL, 0, 0, 0, rv);
+  printf("statfs(%s) -> %d {free blocks: %ld}\n", path, rv, st->f_bfree);
+  return rv;
+}
+
 // Gets an object's attributes (type, permissions, size, etc).
 // Implementation for: man 2 stat
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st) {
+  uint64_t t = trace_begin();
   int rv = 0;
 
   // root directory metadata
@@ -40,17 +66,18 @@ int nufs_getattr(const char *path, struct stat *st) {
     st->st_size = 0;
     st->st_uid = getuid();
   } else {
+    storage_lock();
     rv = storage_stat(path, st);
+    storage_unlock();
     st->st_uid = getuid();
   }
 
   printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
          st->st_size);
 
-  if (rv == -1) {
-    return -ENOENT;
-  }
-  return 0;
+  rv = rv == -1 ? -ENOENT : 0;
+  trace_end(TRACE_GETATTR, t, path, NULL, 0, 0, 0, rv);
+  return rv;
 }
 
 // implementation for: man 2 readdir
@@ -60,18 +87,22 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   struct stat st;
   int rv;
 
+  uint64_t t = trace_begin();
   rv = nufs_getattr(path, &st);
   assert(rv == 0);
 
+  storage_lock();
   slist_t *dirnames = storage_list(path);
+  storage_unlock();
   filler(buf, ".", &st, 0);
   if (dirnames == NULL) {
+    trace_end(TRACE_READDIR, t, path, NULL, 0, 0, 0, 0);
     return 0;
   }
 
   slist_t *currname = dirnames;
   while (currname != NULL) {
-    char currpath[strlen(path) + 50];
+    char currpath[strlen(path) + strlen(currname->data) + 2];
     strncpy(currpath, path, strlen(path));
     if (path[strlen(path) - 1] == '/') {
       currpath[strlen(path)] = 0;
@@ -79,7 +110,7 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
       currpath[strlen(path)] = '/';
       currpath[strlen(path) + 1] = 0;
     }
-    strncat(currpath, currname->data, 48);
+    strcat(currpath, currname->data);
     nufs_getattr(currpath, &st);
     filler(buf, currname->data, &st, 0);
     currname = currname->next;
@@ -87,6 +118,7 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
   printf("readdir(%s) -> %d\n", path, rv);
   slist_free(dirnames);
+  trace_end(TRACE_READDIR, t, path, NULL, 0, 0, 0, 0);
   return 0;
 }
 
@@ -97,7 +129,11 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // ^^^ we decided against that
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
   // simply makes a call to our other method
+  uint64_t t = trace_begin();
+  storage_lock();
   int rv = storage_mknod(path, mode);
+  storage_unlock();
+  trace_end(TRACE_MKNOD, t, path, NULL, 0, 0, mode, rv);
   printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
   return rv;
 }
@@ -111,7 +147,11 @@ int nufs_mkdir(const char *path, mode_t mode) {
 }
 
 int nufs_unlink(const char *path) {
+  uint64_t t = trace_begin();
+  storage_lock();
   int rv = storage_unlink(path);
+  storage_unlock();
+  trace_end(TRACE_UNLINK, t, path, NULL, 0, 0, 0, rv);
   printf("unlink(%s) -> %d\n", path, rv);
   return rv;
 }
@@ -119,38 +159,53 @@ int nufs_unlink(const char *path) {
 int nufs_link(const char *from, const char *to) {
   int rv = -1;
   printf("link(%s => %s) -> %d\n", from, to, rv);
+  uint64_t t = trace_begin();
+  storage_lock();
   rv = storage_link(to, from);
+  storage_unlock();
+  trace_end(TRACE_LINK, t, from, to, 0, 0, 0, rv);
   return rv;
 }
 
 int nufs_rmdir(const char *path) {
   int rv = -1;
+  uint64_t t = trace_begin();
 
   // is directory empty?
+  storage_lock();
   slist_t *contents = storage_list(path);
+  storage_unlock();
   if (contents != NULL && contents->next != NULL) {
     printf("rmdir(%s) -> %d (directory not empty)\n", path, -ENOTEMPTY);
     slist_free(contents);
+    trace_end(TRACE_RMDIR, t, path, NULL, 0, 0, 0, -ENOTEMPTY);
     return -ENOTEMPTY;
   }
 
   // remove via storage layer if needed
+  storage_lock();
   rv = storage_rmdir(path);
+  storage_unlock();
   slist_free(contents);
 
   if (rv == -1) {
     printf("rmdir(%s) -> %d (directory does not exist / error occurred)\n",
            path, -ENOENT);
-    return -ENOENT;
+    rv = -ENOENT;
   }
 
+  trace_end(TRACE_RMDIR, t, path, NULL, 0, 0, 0, rv);
   return rv;
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to) {
+  uint64_t t = trace_begin();
+  storage_lock();
   int rv = storage_rename(from, to);
+  storage_unlock();
+  trace_end(TRACE_RENAME, t, from, to, 0, 0, 0, rv);
   printf("rename(%s => %s) -> %d\n", from, to, rv);
   return rv;
 }
@@ -158,13 +213,18 @@ int nufs_rename(const char *from, const char *to) {
 // dummy implementation
 int nufs_chmod(const char *path, mode_t mode) {
   int rv = -1;
+  trace_end(TRACE_CHMOD, trace_begin(), path, NULL, 0, 0, mode, rv);
   printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
   return rv;
 }
 
 // called to change the size of a file
 int nufs_truncate(const char *path, off_t size) {
+  uint64_t t = trace_begin();
+  storage_lock();
   int rv = storage_truncate(path, size);
+  storage_unlock();
+  trace_end(TRACE_TRUNCATE, t, path, NULL, size, 0, 0, rv);
   printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
   return rv;
 }
@@ -175,6 +235,7 @@ int nufs_truncate(const char *path, off_t size) {
 // You can just check whether the file is accessible.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
   int rv = 0;
+  trace_end(TRACE_OPEN, trace_begin(), path, NULL, 0, 0, fi->flags, rv);
   printf("open(%s) -> %d\n", path, rv);
   return rv;
 }
@@ -183,7 +244,11 @@ int nufs_open(const char *path, struct fuse_file_info *fi) {
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
   int rv = -1;
+  uint64_t t = trace_begin();
+  storage_lock();
   rv = storage_read(path, buf, size, offset);
+  storage_unlock();
+  trace_end(TRACE_READ, t, path, NULL, offset, size, 0, rv);
   printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
@@ -192,29 +257,136 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset,
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
   int rv = -1;
+  uint64_t t = trace_begin();
+  storage_lock();
   rv = storage_write(path, buf, size, offset);
+  storage_unlock();
+  trace_end(TRACE_WRITE, t, path, NULL, offset, size, 0, rv);
   printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
 
+// Update the timestamps on a file or directory.
+int nufs_utimens(const char *path, const struct timespec ts[2]) {
+  uint64_t t = trace_begin();
+  storage_lock();
+  int rv = storage_set_time(path, ts);
+  storage_unlock();
+  // (UTIME_NOW and UTIME_OMIT are in the nanoseconds, which are dropped)
+  trace_end(TRACE_UTIMENS, t, path, NULL, ts[0].tv_sec, ts[1].tv_sec, 0, rv);
+  printf("utimens(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+// implementation for: man 2 fsync
+// timestamps are written lazily (see times.h), this is one of the times
+// they have to be written out
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  uint64_t t = trace_begin();
+  storage_lock();
+  int rv = storage_fsync(path);
+  storage_unlock();
+  trace_end(TRACE_FSYNC, t, path, NULL, 0, 0, 0, rv);
+  printf("fsync(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+// called when the last handle to an open file is closed
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  uint64_t t = trace_begin();
+  storage_lock();
+  int rv = storage_release(path);
+  storage_unlock();
+  trace_end(TRACE_RELEASE, t, path, NULL, 0, 0, 0, rv);
+  printf("release(%s) -> %d\n", path, rv);
+  return rv;
+}
+
 /**
  * Based on office hours, we removed the extended operations, as they are not
  * needed. Now they just return dummy data.
  */
 
-// Update the timestamps on a file or directory.
-int nufs_utimens(const char *path, const struct timespec ts[2]) { return 0; }
-
 // Extended operations
+// FS_IOC_GETFLAGS/FS_IOC_SETFLAGS let lsattr and chattr (e.g. chattr +c to
+// compress a file) work on our files, the NUFS_IOC_* commands are ours (see
+// nufs_ioctl.h and nufsctl)
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-  return 0;
+  int rv = 0;
+  uint64_t t = trace_begin();
+  storage_lock();
+  switch ((unsigned int)cmd) {
+  case FS_IOC_GETFLAGS:
+    rv = storage_get_flags(path, (int *)data);
+    break;
+  case FS_IOC_SETFLAGS:
+    rv = storage_set_flags(path, *(int *)data);
+    break;
+  case NUFS_IOC_CLONE: {
+    nufs_clone_args_t *clone = data;
+    clone->src[NUFS_PATH_MAX - 1] = 0;
+    rv = storage_clone(clone->src, path);
+    break;
+  }
+  case NUFS_IOC_COPY_RANGE: {
+    nufs_copy_range_args_t *range = data;
+    range->src[NUFS_PATH_MAX - 1] = 0;
+    rv = storage_copy_range(range->src, range->src_offset, path,
+                            range->dst_offset, range->length);
+    range->copied = rv < 0 ? 0 : rv;
+    rv = rv < 0 ? rv : 0;
+    break;
+  }
+  case NUFS_IOC_BATCH:
+    // issued on a directory, which is what path is then
+    rv = storage_batch(path, data);
+    break;
+  case NUFS_IOC_DEFRAG:
+    rv = storage_defrag(data);
+    break;
+  case NUFS_IOC_SNAPSHOT:
+    rv = storage_snapshot(data);
+    break;
+  case NUFS_IOC_HEAT:
+    rv = storage_heat(data);
+    break;
+  case NUFS_IOC_GROW: {
+    nufs_grow_args_t *grow = data;
+    rv = storage_grow(grow->blocks);
+    struct statvfs st;
+    storage_statfs(&st);
+    grow->blocks = st.f_blocks;
+    break;
+  }
+  default:
+    rv = -ENOTTY;
+  }
+  storage_unlock();
+  trace_end(TRACE_IOCTL, t, path, NULL, 0, 0, cmd, rv);
+  printf("ioctl(%s, %x) -> %d\n", path, cmd, rv);
+  return rv;
+}
+
+// called once fuse is up and running
+void *nufs_init(struct fuse_conn_info *conn) {
+  storage_start();
+  trace_start();
+  return NULL;
+}
+
+// called on unmount
+void nufs_destroy(void *private_data) {
+  trace_stop();
+  span_close();
+  storage_stop();
 }
 
 void nufs_init_ops(struct fuse_operations *ops) {
   memset(ops, 0, sizeof(struct fuse_operations));
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
+  ops->statfs = nufs_statfs;
   ops->readdir = nufs_readdir;
   ops->mknod = nufs_mknod;
   // ops->create   = nufs_create; // alternative to mknod
@@ -229,15 +401,80 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->read = nufs_read;
   ops->write = nufs_write;
   ops->utimens = nufs_utimens;
+  ops->fsync = nufs_fsync;
+  ops->release = nufs_release;
   ops->ioctl = nufs_ioctl;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
 
+// our own mount options (-o name), everything else is passed on to fuse
+typedef struct nufs_config {
+  storage_opts_t storage;
+  char *trace; // file to record the operations to (see trace.h)
+  char *spans; // file to write sampled spans to (see span.h)
+  int span_rate;
+} nufs_config_t;
+
+#define NUFS_OPT(name, field) {name, offsetof(nufs_config_t, storage.field), 1}
+
+static struct fuse_opt nufs_opts[] = {
+    NUFS_OPT("dedup", dedup),
+    NUFS_OPT("compress", compress),
+    NUFS_OPT("log", log),
+    NUFS_OPT("heat", heat),
+    NUFS_OPT("journal", journal),
+    // (the kernel has to know about ro too)
+    NUFS_OPT("ro", ro),
+    FUSE_OPT_KEY("ro", FUSE_OPT_KEY_KEEP),
+    {"scrub=%d", offsetof(nufs_config_t, storage.scrub), 0},
+    {"lazytime=%d", offsetof(nufs_config_t, storage.lazytime), 0},
+    {"stripe_unit=%d", offsetof(nufs_config_t, storage.stripe_unit), 0},
+    {"punch=%d", offsetof(nufs_config_t, storage.punch), 0},
+    {"defrag=%d", offsetof(nufs_config_t, storage.defrag), 0},
+    {"clean=%d", offsetof(nufs_config_t, storage.clean), 0},
+    {"trace=%s", offsetof(nufs_config_t, trace), 0},
+    {"spans=%s", offsetof(nufs_config_t, spans), 0},
+    {"span_rate=%d", offsetof(nufs_config_t, span_rate), 0},
+    FUSE_OPT_END,
+};
+
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
+  assert(argc > 2);
   // printf("TODO: mount %s as data file\n", argv[--argc]);
-  storage_init(argv[--argc]);
+  // the disk image is always the last argument
+  const char *image = argv[--argc];
+
+  nufs_config_t config = {.storage = {.lazytime = LAZYTIME_DEFAULT,
+                                      .punch = PUNCH_DEFAULT,
+                                      .clean = CLEAN_DEFAULT},
+                          .span_rate = SPAN_RATE_DEFAULT};
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &config, nufs_opts, NULL) == -1) {
+    return 1;
+  }
+
+  // (fuse moves to / when it goes into the background)
+  if (config.trace != NULL) {
+    int rv = trace_open(config.trace);
+    if (rv < 0) {
+      fprintf(stderr, "%s: %s\n", config.trace, strerror(-rv));
+      return 1;
+    }
+  }
+  if (config.spans != NULL) {
+    int rv = span_open(config.spans, config.span_rate);
+    if (rv < 0) {
+      fprintf(stderr, "%s: %s\n", config.spans, strerror(-rv));
+      return 1;
+    }
+  }
+
+  storage_init(image, &config.storage);
   nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  int rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+  fuse_opt_free_args(&args);
+  return rv;
 }
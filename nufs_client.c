@@ -0,0 +1,30 @@
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "nufs_client.h"
+
+void nufs_batch_init(nufs_batch_t *batch) {
+  batch->count = 0;
+  batch->names_used = 0;
+}
+
+int nufs_batch_add(nufs_batch_t *batch, int op, const char *name, int mode) {
+  size_t len = strlen(name) + 1;
+  if (batch->count == NUFS_BATCH_MAX ||
+      batch->names_used + len > NUFS_BATCH_NAMES) {
+    return -1;
+  }
+
+  nufs_batch_op_t *entry = &batch->ops[batch->count];
+  memset(entry, 0, sizeof(*entry));
+  entry->op = op;
+  entry->name = batch->names_used;
+  entry->mode = mode;
+  memcpy(batch->names + batch->names_used, name, len);
+  batch->names_used += len;
+  return batch->count++;
+}
+
+int nufs_batch_run(int dirfd, nufs_batch_t *batch) {
+  return ioctl(dirfd, NUFS_IOC_BATCH, batch);
+}
@@ -0,0 +1,27 @@
+// Client library for the nufs batch ioctl.
+//
+//   nufs_batch_t batch;
+//   nufs_batch_init(&batch);
+//   nufs_batch_add(&batch, NUFS_BATCH_CREATE, "a.txt", 0100644);
+//   nufs_batch_add(&batch, NUFS_BATCH_STAT, "b.txt", 0);
+//   if (nufs_batch_run(dirfd, &batch) == 0) {
+//     ... batch.ops[i].result for each operation ...
+//   }
+//
+// dirfd is an open directory in a mounted nufs, the names are names in it.
+
+#ifndef NUFS_CLIENT_H
+#define NUFS_CLIENT_H
+
+#include "nufs_ioctl.h"
+
+// empties the batch
+void nufs_batch_init(nufs_batch_t *batch);
+// adds an operation (mode is only used by NUFS_BATCH_CREATE), returns its
+// index or -1 if the batch is full
+int nufs_batch_add(nufs_batch_t *batch, int op, const char *name, int mode);
+// runs the batch, returns 0 or -1 and sets errno if it couldn't be run at
+// all (the operations have their own results)
+int nufs_batch_run(int dirfd, nufs_batch_t *batch);
+
+#endif
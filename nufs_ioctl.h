@@ -0,0 +1,131 @@
+// ioctl commands understood by nufs (see nufs_ioctl in nufs.c).
+//
+// Shared between the filesystem and the tools that talk to it. Paths in the
+// arguments are paths inside the filesystem, starting with "/" at the root of
+// the mount.
+
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define NUFS_PATH_MAX 256
+
+// like FICLONE: the file the ioctl is issued on becomes a copy-on-write
+// clone of src
+typedef struct nufs_clone_args {
+  char src[NUFS_PATH_MAX];
+} nufs_clone_args_t;
+
+// like FICLONERANGE/copy_file_range: copies length bytes of src into the
+// file the ioctl is issued on, sharing whole blocks where both offsets are
+// block aligned and copying the rest; copied is set to the bytes copied
+typedef struct nufs_copy_range_args {
+  char src[NUFS_PATH_MAX];
+  int64_t src_offset;
+  int64_t dst_offset;
+  int64_t length;
+  int64_t copied;
+} nufs_copy_range_args_t;
+
+// a batch of operations on names in the directory the ioctl is issued on,
+// run in order under one lookup of the directory (see nufs_client.h)
+#define NUFS_BATCH_MAX 128    // operations per batch
+#define NUFS_BATCH_NAMES 8192 // bytes for all of the names
+
+#define NUFS_BATCH_CREATE 1 // create a file or directory with the given mode
+#define NUFS_BATCH_STAT 2   // fill in mode, size, nlink and the times
+#define NUFS_BATCH_UNLINK 3 // remove a file (not a directory)
+
+typedef struct nufs_batch_op {
+  uint16_t op;    // NUFS_BATCH_*
+  uint16_t name;  // offset of the null terminated name in names
+  uint32_t mode;
+  int32_t result; // set to 0 or a negative errno
+  uint32_t nlink;
+  int64_t size;
+  uint32_t atime;
+  uint32_t mtime;
+  uint32_t ctime;
+  uint32_t _reserved;
+} nufs_batch_op_t;
+
+// (ioctl arguments have to stay under 16KB)
+typedef struct nufs_batch {
+  uint32_t count;
+  uint32_t names_used;
+  nufs_batch_op_t ops[NUFS_BATCH_MAX];
+  char names[NUFS_BATCH_NAMES];
+} nufs_batch_t;
+
+// grows the image to the given number of blocks (up to the most nufs was
+// built for) while it's mounted, blocks is set to the new size, which is
+// also what statfs reports; can be issued on any file or directory
+typedef struct nufs_grow_args {
+  int64_t blocks;
+} nufs_grow_args_t;
+
+// runs a defrag pass over the whole filesystem (or only measures the
+// fragmentation, with NUFS_DEFRAG_REPORT) and fills in what it found;
+// extents are runs of consecutive blocks of a file
+#define NUFS_DEFRAG_REPORT 1
+
+typedef struct nufs_defrag_args {
+  uint32_t flags;
+  uint32_t files;      // files and directories looked at
+  uint32_t fragmented; // how many had more than one extent
+  uint32_t moved;      // how many of those were put into one extent
+  int64_t extents_before;
+  int64_t extents_after;
+  int64_t blocks_moved;
+} nufs_defrag_args_t;
+
+// starts writing a point-in-time copy of the whole image to path, a path
+// on the host (not inside the filesystem) that doesn't exist yet. Writers
+// are only held up while the copy starts, pause_us is set to how long that
+// took and blocks to the size of the copy. The copy is written to
+// path.part in the background and renamed to path once it's complete (or
+// removed if it fails). Can be issued on any file or directory.
+#define NUFS_SNAPSHOT_PATH_MAX 4096
+
+typedef struct nufs_snapshot_args {
+  int64_t pause_us;
+  int64_t blocks;
+  char path[NUFS_SNAPSHOT_PATH_MAX];
+} nufs_snapshot_args_t;
+
+// lists the count (1 to NUFS_HEAT_MAX, more is taken as NUFS_HEAT_MAX and 0
+// is EINVAL) files with the most requests and bytes moved lately, hottest
+// first, with count set to how many there are. The counters halve every
+// half_life seconds. Only with the heat mount option (ENODATA otherwise);
+// can be issued on any file or directory.
+#define NUFS_HEAT_MAX 32
+
+typedef struct nufs_heat_entry {
+  uint32_t inum;
+  uint32_t extents; // runs of consecutive blocks, see NUFS_IOC_DEFRAG
+  uint64_t heat;    // reads + writes + blocks moved
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  int64_t size;
+  char path[NUFS_PATH_MAX]; // "" if it has no name (an open unlinked file)
+} nufs_heat_entry_t;
+
+typedef struct nufs_heat_args {
+  uint32_t count;
+  uint32_t half_life;
+  nufs_heat_entry_t entries[NUFS_HEAT_MAX];
+} nufs_heat_args_t;
+
+#define NUFS_IOC_CLONE _IOW('N', 1, nufs_clone_args_t)
+#define NUFS_IOC_COPY_RANGE _IOWR('N', 2, nufs_copy_range_args_t)
+#define NUFS_IOC_BATCH _IOWR('N', 3, nufs_batch_t)
+#define NUFS_IOC_GROW _IOWR('N', 4, nufs_grow_args_t)
+#define NUFS_IOC_DEFRAG _IOWR('N', 5, nufs_defrag_args_t)
+#define NUFS_IOC_SNAPSHOT _IOWR('N', 6, nufs_snapshot_args_t)
+#define NUFS_IOC_HEAT _IOWR('N', 7, nufs_heat_args_t)
+
+#endif
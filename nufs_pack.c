@@ -0,0 +1,470 @@
+// Builds a nufs image from a directory on the host.
+//
+//   nufs-pack [-j THREADS] [-s BLOCKS] DIR IMAGE
+//
+// Much faster than mounting an image and copying into it: a pool of
+// threads walks DIR first, so the size of everything is known up front.
+// The image is then made just big enough (or BLOCKS blocks, if that's
+// more), and every inode, directory block and bitmap is written in one pass,
+// with inodes numbered and blocks handed out in directory order: the
+// entries of a directory, then the data of its files (each in one run of
+// blocks), then its subdirectories. Last, the threads copy the file data
+// straight into the mapped image.
+//
+// IMAGE is replaced. Only regular files and directories are packed, hard
+// links become separate copies.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "checksum.h"
+#include "directory.h"
+#include "inode.h"
+#include "layout.h"
+#include "storage.h"
+
+#define MAX_THREADS 64
+#define MAX_SLOTS (nptrs + BLOCK_SIZE / (int)sizeof(int))
+
+// a file or directory found by the walk
+typedef struct entry {
+  char *path;       // on the host
+  const char *name; // the last part of path
+  struct stat st;
+  int *children; // entries of a directory, sorted by name
+  int child_count;
+  int inum;  // where it goes in the image
+  int first; // first block of its run
+} entry_t;
+
+static entry_t entries[INODE_COUNT];
+static atomic_int entry_count = 0;
+static atomic_int errors = 0;
+
+// directories waiting to be read, like fsck's walk
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static int queue[INODE_COUNT];
+static int queued = 0;
+static int busy = 0;
+
+// the entries in the order they were laid out, and the next one to copy
+static int order[INODE_COUNT];
+static int placed = 0;
+static atomic_int copy_next = 0;
+
+static void push_dir(int index) {
+  pthread_mutex_lock(&queue_lock);
+  queue[queued++] = index;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// blocks the page slots of an inode with the given size take up, counting
+// the indirect block (one slot more than the size needs, see grow_inode)
+static int inode_blocks(int size) {
+  int slots = size / BLOCK_SIZE + 1;
+  return slots > nptrs ? slots + 1 : slots;
+}
+
+// the size of a directory with the blocks of entries it needs, records
+// don't cross blocks and every slot holds one (even in an empty directory)
+static int dir_size(entry_t *dir) {
+  int blocks = 1;
+  int offset = 0;
+  for (int i = 0; i < dir->child_count; i++) {
+    int used = DIRENT_SIZE(strlen(entries[dir->children[i]].name));
+    if (offset + used > BLOCK_SIZE) {
+      blocks++;
+      offset = 0;
+    }
+    offset += used;
+  }
+  return (blocks - 1) * BLOCK_SIZE;
+}
+
+static int entry_size(entry_t *entry) {
+  return S_ISDIR(entry->st.st_mode) ? dir_size(entry) : entry->st.st_size;
+}
+
+// takes an entry for the given path, or returns -1 if it can't be packed
+static int add_entry(char *path, const char *name, struct stat *st) {
+  if (!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode)) {
+    fprintf(stderr, "%s: not a file or directory, skipped\n", path);
+    free(path);
+    return -1;
+  }
+  if (strlen(name) > DIR_NAME_LENGTH) {
+    fprintf(stderr, "%s: name too long\n", path);
+    errors++;
+  } else if (S_ISREG(st->st_mode) &&
+             st->st_size / BLOCK_SIZE + 1 > MAX_SLOTS) {
+    fprintf(stderr, "%s: too big, files can have up to %d bytes\n", path,
+            (MAX_SLOTS - 1) * BLOCK_SIZE);
+    errors++;
+  }
+
+  int index = atomic_fetch_add(&entry_count, 1);
+  if (index >= INODE_COUNT) {
+    if (index == INODE_COUNT) {
+      fprintf(stderr, "more than %d files and directories\n", INODE_COUNT);
+    }
+    errors++;
+    free(path);
+    return -1;
+  }
+  entry_t *entry = &entries[index];
+  entry->path = path;
+  entry->name = name;
+  entry->st = *st;
+  if (S_ISDIR(st->st_mode)) {
+    push_dir(index);
+  }
+  return index;
+}
+
+static void read_dir(int index) {
+  entry_t *dir = &entries[index];
+  DIR *host = opendir(dir->path);
+  if (host == NULL) {
+    perror(dir->path);
+    errors++;
+    return;
+  }
+
+  int count = 0;
+  int cap = 16;
+  char **names = malloc(cap * sizeof(char *));
+  struct dirent *de;
+  while ((de = readdir(host)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    if (count == cap) {
+      cap *= 2;
+      names = realloc(names, cap * sizeof(char *));
+    }
+    names[count++] = strdup(de->d_name);
+  }
+  closedir(host);
+  qsort(names, count, sizeof(char *), compare_names);
+
+  dir->children = malloc(count * sizeof(int));
+  dir->child_count = 0;
+  int dir_len = strlen(dir->path);
+  for (int i = 0; i < count; i++) {
+    char *path = malloc(dir_len + strlen(names[i]) + 2);
+    sprintf(path, "%s/%s", dir->path, names[i]);
+    free(names[i]);
+
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+      perror(path);
+      errors++;
+      free(path);
+      continue;
+    }
+    int child = add_entry(path, path + dir_len + 1, &st);
+    if (child >= 0) {
+      dir->children[dir->child_count++] = child;
+    }
+  }
+  free(names);
+}
+
+static void *walker(void *arg) {
+  pthread_mutex_lock(&queue_lock);
+  for (;;) {
+    while (queued == 0 && busy > 0) {
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    }
+    if (queued == 0) {
+      break;
+    }
+    int index = queue[--queued];
+    busy++;
+    pthread_mutex_unlock(&queue_lock);
+
+    read_dir(index);
+
+    pthread_mutex_lock(&queue_lock);
+    busy--;
+    if (queued == 0 && busy == 0) {
+      pthread_cond_broadcast(&queue_cond);
+    }
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return NULL;
+}
+
+// fills in the inode of an entry, with its slots in a run of blocks from
+// first on, in the order grow_inode would put them (the direct blocks, the
+// indirect block, then the rest)
+static void place(entry_t *entry, int first) {
+  inode_t *node = get_inode(entry->inum);
+  int size = entry_size(entry);
+  int slots = size / BLOCK_SIZE + 1;
+
+  memset(node, 0, sizeof(inode_t));
+  node->refs = 1;
+  node->mode = entry->st.st_mode;
+  node->size = size;
+  node->atime = entry->st.st_atime;
+  node->mtime = entry->st.st_mtime;
+  node->ctime = time(NULL);
+  for (int i = 0; i < slots && i < nptrs; i++) {
+    node->ptrs[i] = first + i;
+  }
+  if (slots > nptrs) {
+    node->iptr = first + nptrs;
+    int *iptrs = blocks_get_block(node->iptr);
+    for (int i = nptrs; i < slots; i++) {
+      iptrs[i - nptrs] = first + i + 1;
+    }
+  }
+  entry->first = first;
+  order[placed++] = entry - entries;
+}
+
+// writes the records of a directory's entries into its blocks
+static void fill_dir(entry_t *dir) {
+  inode_t *node = get_inode(dir->inum);
+  dirent_t *last = NULL;
+  int block = 0;
+  int offset = 0;
+  for (int i = 0; i < dir->child_count; i++) {
+    entry_t *child = &entries[dir->children[i]];
+    int name_len = strlen(child->name);
+    int used = DIRENT_SIZE(name_len);
+    if (offset + used > BLOCK_SIZE) {
+      // the last record in a block takes up the rest of it
+      last->rec_len += BLOCK_SIZE - offset;
+      block++;
+      offset = 0;
+    }
+    char *data = blocks_get_block(inode_get_bnum(node, block * BLOCK_SIZE));
+    last = (dirent_t *)(data + offset);
+    last->inum = child->inum;
+    last->rec_len = used;
+    last->name_len = name_len;
+    last->_reserved = 0;
+    memcpy(last->name, child->name, name_len);
+    offset += used;
+  }
+  if (last != NULL) {
+    last->rec_len += BLOCK_SIZE - offset;
+  } else {
+    // an empty directory's block is a single free record
+    dirent_t *free_rec = blocks_get_block(inode_get_bnum(node, 0));
+    free_rec->inum = -1;
+    free_rec->rec_len = BLOCK_SIZE;
+    free_rec->name_len = 0;
+    free_rec->_reserved = 0;
+  }
+}
+
+// numbers the entries of a directory and gives them their blocks from
+// *next on, then does the same for its subdirectories
+static void layout_dir(entry_t *dir, int *next_inum, int *next) {
+  for (int i = 0; i < dir->child_count; i++) {
+    entry_t *child = &entries[dir->children[i]];
+    child->inum = (*next_inum)++;
+    place(child, *next);
+    *next += inode_blocks(entry_size(child));
+  }
+  fill_dir(dir);
+  for (int i = 0; i < dir->child_count; i++) {
+    entry_t *child = &entries[dir->children[i]];
+    if (S_ISDIR(child->st.st_mode)) {
+      layout_dir(child, next_inum, next);
+    }
+  }
+}
+
+// reads count bytes of fd into the image at data, returns 0 if it got them
+static int read_all(int fd, char *data, size_t count) {
+  while (count > 0) {
+    ssize_t got = read(fd, data, count);
+    if (got <= 0) {
+      return -1;
+    }
+    data += got;
+    count -= got;
+  }
+  return 0;
+}
+
+// copies files into the image until there are none left, the slots of a
+// file are consecutive except for the indirect block in between
+static void *copier(void *arg) {
+  for (;;) {
+    int i = atomic_fetch_add(&copy_next, 1);
+    if (i >= placed) {
+      break;
+    }
+    entry_t *entry = &entries[order[i]];
+    if (!S_ISREG(entry->st.st_mode) || entry->st.st_size == 0) {
+      continue;
+    }
+
+    int fd = open(entry->path, O_RDONLY);
+    if (fd < 0) {
+      perror(entry->path);
+      errors++;
+      continue;
+    }
+    size_t size = entry->st.st_size;
+    size_t direct = nptrs * BLOCK_SIZE;
+    char *data = blocks_get_block(entry->first);
+    if (read_all(fd, data, size < direct ? size : direct) < 0 ||
+        (size > direct &&
+         read_all(fd, data + direct + BLOCK_SIZE, size - direct) < 0)) {
+      fprintf(stderr, "%s: changed while being packed\n", entry->path);
+      errors++;
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: nufs-pack [-j THREADS] [-s BLOCKS] DIR IMAGE\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int min_blocks = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:s:")) != -1) {
+    if (opt == 'j') {
+      threads = atoi(optarg);
+    } else if (opt == 's') {
+      min_blocks = atoi(optarg);
+    } else {
+      usage();
+    }
+  }
+  if (optind != argc - 2) {
+    usage();
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads > MAX_THREADS) {
+    threads = MAX_THREADS;
+  }
+  const char *root_path = argv[optind];
+  const char *image = argv[optind + 1];
+  if (strchr(image, ',') != NULL) {
+    fprintf(stderr, "%s: can't pack a striped image\n", image);
+    return 1;
+  }
+
+  struct timespec start, walked, done;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct stat st;
+  if (stat(root_path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "%s: not a directory\n", root_path);
+    return 1;
+  }
+  add_entry(strdup(root_path), "", &st);
+
+  pthread_t pool[MAX_THREADS];
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&pool[i], NULL, walker, NULL);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(pool[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &walked);
+  if (errors > 0) {
+    return 1;
+  }
+
+  // everything has to fit before the image is touched
+  int count = entry_count;
+  int needed = FIRST_DATA_BLOCK;
+  for (int i = 0; i < count; i++) {
+    needed += inode_blocks(entry_size(&entries[i]));
+  }
+  if (needed > BLOCK_COUNT) {
+    fprintf(stderr,
+            "%s: needs %d blocks, this nufs was built for up to %d (see "
+            "BLOCK_COUNT in the Makefile)\n",
+            root_path, needed, BLOCK_COUNT);
+    return 1;
+  }
+
+  // a new image, just big enough
+  if (truncate(image, 0) < 0 && access(image, F_OK) == 0) {
+    perror(image);
+    return 1;
+  }
+  blocks_set_new_size(needed > min_blocks ? needed : min_blocks);
+  blocks_init(image);
+  storage_format();
+
+  // the root directory was made by the format, its first block is the
+  // first data block and everything else comes right after it
+  entry_t *root = &entries[0];
+  root->inum = 0;
+  int next_inum = 1;
+  int next = get_inode(0)->ptrs[0];
+  place(root, next);
+  next += inode_blocks(entry_size(root));
+  layout_dir(root, &next_inum, &next);
+
+  void *bbm = get_blocks_bitmap();
+  for (int bnum = FIRST_DATA_BLOCK; bnum < next; bnum++) {
+    bitmap_put(bbm, bnum, 1);
+  }
+  uint8_t *ibm = get_inode_bitmap();
+  for (int inum = 0; inum < next_inum; inum++) {
+    bitmap_put(ibm, inum, 1);
+  }
+  superblock_t *sb = get_superblock();
+  sb->free_blocks = blocks_total() - next;
+  sb->free_inodes = INODE_COUNT - next_inum;
+  sb->itable_used = next_inum;
+
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&pool[i], NULL, copier, NULL);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(pool[i], NULL);
+  }
+
+  for (int bnum = 0; bnum < next; bnum++) {
+    checksum_dirty(bnum);
+  }
+  checksum_seal();
+  blocks_sync();
+  blocks_free();
+  clock_gettime(CLOCK_MONOTONIC, &done);
+
+  double walk_ms = (walked.tv_sec - start.tv_sec) * 1e3 +
+                   (walked.tv_nsec - start.tv_nsec) / 1e6;
+  double total_ms = (done.tv_sec - start.tv_sec) * 1e3 +
+                    (done.tv_nsec - start.tv_nsec) / 1e6;
+  printf("%s: %d inodes, %d/%d blocks used, walked in %.1fms, packed in "
+         "%.1fms\n",
+         image, next_inum, next, blocks_total(), walk_ms, total_ms);
+  return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,205 @@
+// Replays a trace recorded with -o trace=FILE against an unmounted image.
+//
+//   nufs-replay [-t] [-d] [-c] TRACE IMAGE
+//
+// The operations are run straight against the storage layer, as fast as
+// they go, or with -t at the times they were recorded, and the mean time
+// each kind of operation took is printed next to the recorded one (which
+// includes FUSE's overhead). -d and -c replay with dedup and compress on.
+// Replaying onto a copy of the image the trace was recorded on gives the
+// same results every time; results that differ from the recorded ones are
+// counted. ioctls are only counted, their arguments aren't in the trace,
+// and writes write zeros.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "trace.h"
+
+#define PATH_BUF (UINT16_MAX + 1)
+
+typedef struct op_stats {
+  long count;
+  uint64_t total; // ns
+  uint64_t max;
+  uint64_t traced; // ns the recorded operations took
+} op_stats_t;
+
+static op_stats_t stats[TRACE_OP_COUNT];
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *get_buffer(size_t size) {
+  static char *buf = NULL;
+  static size_t buf_size = 0;
+  if (size > buf_size) {
+    free(buf);
+    buf = calloc(1, size);
+    buf_size = size;
+  }
+  return buf;
+}
+
+// does what the callback in nufs.c does, returns what it would have
+static int replay(const trace_record_t *rec, const char *path,
+                  const char *path2) {
+  struct stat st;
+  struct statvfs vfs;
+  int rv = 0;
+  switch (rec->op) {
+  case TRACE_ACCESS:
+    return storage_access(path);
+  case TRACE_STATFS:
+    return storage_statfs(&vfs);
+  case TRACE_GETATTR:
+    if (strcmp(path, "/") == 0) {
+      return 0;
+    }
+    return storage_stat(path, &st) == -1 ? -ENOENT : 0;
+  case TRACE_READDIR:
+    slist_free(storage_list(path));
+    return 0;
+  case TRACE_MKNOD:
+    return storage_mknod(path, rec->mode);
+  case TRACE_UNLINK:
+    return storage_unlink(path);
+  case TRACE_LINK:
+    return storage_link(path2, path);
+  case TRACE_RMDIR:
+    rv = storage_rmdir(path);
+    return rv == -1 ? -ENOENT : rv;
+  case TRACE_RENAME:
+    return storage_rename(path, path2);
+  case TRACE_CHMOD:
+    return -1;
+  case TRACE_TRUNCATE:
+    return storage_truncate(path, rec->offset);
+  case TRACE_OPEN:
+    return 0;
+  case TRACE_READ:
+    return storage_read(path, get_buffer(rec->size), rec->size, rec->offset);
+  case TRACE_WRITE:
+    return storage_write(path, get_buffer(rec->size), rec->size, rec->offset);
+  case TRACE_UTIMENS: {
+    struct timespec ts[2] = {{rec->offset, 0}, {rec->size, 0}};
+    return storage_set_time(path, ts);
+  }
+  case TRACE_FSYNC:
+    return storage_fsync(path);
+  case TRACE_RELEASE:
+    return storage_release(path);
+  default:
+    return rec->result;
+  }
+}
+
+static void usage() {
+  fprintf(stderr, "usage: nufs-replay [-t] [-d] [-c] TRACE IMAGE\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  int timed = 0;
+  storage_opts_t opts = {.lazytime = LAZYTIME_DEFAULT,
+                         .punch = PUNCH_DEFAULT,
+                         .clean = CLEAN_DEFAULT};
+  int opt;
+  while ((opt = getopt(argc, argv, "tdc")) != -1) {
+    if (opt == 't') {
+      timed = 1;
+    } else if (opt == 'd') {
+      opts.dedup = 1;
+    } else if (opt == 'c') {
+      opts.compress = 1;
+    } else {
+      usage();
+    }
+  }
+  if (optind != argc - 2) {
+    usage();
+  }
+
+  FILE *trace = fopen(argv[optind], "r");
+  if (trace == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  char magic[8];
+  if (fread(magic, 1, 8, trace) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s: not a nufs trace\n", argv[optind]);
+    return 1;
+  }
+
+  storage_init(argv[optind + 1], &opts);
+
+  char *path = malloc(PATH_BUF);
+  char *path2 = malloc(PATH_BUF);
+  trace_record_t rec;
+  long ops = 0;
+  long differ = 0;
+  long skipped = 0;
+  uint64_t start = now_ns();
+  while (trace_read(trace, &rec, path, path2)) {
+    if (timed) {
+      uint64_t now = now_ns() - start;
+      if (rec.start > now) {
+        uint64_t wait = rec.start - now;
+        struct timespec ts = {wait / 1000000000, wait % 1000000000};
+        nanosleep(&ts, NULL);
+      }
+    }
+    if (rec.op == TRACE_IOCTL || rec.op <= 0 || rec.op >= TRACE_OP_COUNT) {
+      skipped++;
+      continue;
+    }
+
+    uint64_t t = now_ns();
+    storage_lock();
+    int rv = replay(&rec, path, path2);
+    storage_unlock();
+    t = now_ns() - t;
+
+    op_stats_t *s = &stats[rec.op];
+    s->count++;
+    s->total += t;
+    s->traced += rec.duration;
+    if (t > s->max) {
+      s->max = t;
+    }
+    if (rv != rec.result) {
+      differ++;
+    }
+    ops++;
+  }
+  uint64_t elapsed = now_ns() - start;
+  storage_stop();
+  fclose(trace);
+  free(path);
+  free(path2);
+
+  printf("%-10s %8s %10s %10s %10s\n", "op", "count", "mean us", "max us",
+         "traced us");
+  for (int op = 1; op < TRACE_OP_COUNT; op++) {
+    op_stats_t *s = &stats[op];
+    if (s->count > 0) {
+      printf("%-10s %8ld %10.1f %10.1f %10.1f\n", trace_op_name(op), s->count,
+             s->total / 1000.0 / s->count, s->max / 1000.0,
+             s->traced / 1000.0 / s->count);
+    }
+  }
+  printf("%ld operations in %.3f s (%.0f/s), %ld skipped, %ld results differ "
+         "from the trace\n",
+         ops, elapsed / 1e9, elapsed > 0 ? ops * 1e9 / elapsed : 0.0, skipped,
+         differ);
+  return differ > 0 ? 1 : 0;
+}
@@ -0,0 +1,291 @@
+// Command line tool for the nufs specific ioctls.
+//
+//   nufsctl clone SRC DST                      - DST becomes a clone of SRC
+//   nufsctl copy SRC DST [SRC_OFF DST_OFF LEN] - copies (part of) SRC to DST
+//   nufsctl grow MOUNT BLOCKS                  - grows the image to BLOCKS
+//   nufsctl defrag MOUNT                       - defragments the files
+//   nufsctl frag MOUNT                         - reports fragmentation
+//   nufsctl snapshot MOUNT FILE                - copies the image to FILE
+//   nufsctl heat MOUNT [COUNT]                 - lists the hottest files
+//
+// SRC and DST are ordinary paths to files inside a mounted nufs, FILE is
+// outside of it.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+static void usage() {
+  fprintf(stderr, "usage: nufsctl clone SRC DST\n"
+                  "       nufsctl copy SRC DST [SRC_OFF DST_OFF LEN]\n"
+                  "       nufsctl grow MOUNT BLOCKS\n"
+                  "       nufsctl defrag MOUNT\n"
+                  "       nufsctl frag MOUNT\n"
+                  "       nufsctl snapshot MOUNT FILE\n"
+                  "       nufsctl heat MOUNT [COUNT]\n");
+  exit(2);
+}
+
+// turns a path to a file in the mount into a path inside the filesystem,
+// the mount root is the topmost directory on the same device
+static void fs_path(const char *path, char *out) {
+  char full[PATH_MAX];
+  if (realpath(path, full) == NULL) {
+    perror(path);
+    exit(1);
+  }
+
+  struct stat st;
+  stat(full, &st);
+  dev_t dev = st.st_dev;
+
+  char *root_end = full + strlen(full);
+  for (;;) {
+    char *slash = root_end;
+    while (slash > full && *--slash != '/') {
+    }
+    if (slash == full) {
+      // the whole thing is mounted on /
+      root_end = full;
+      break;
+    }
+    char saved = *slash;
+    *slash = 0;
+    int same = stat(full, &st) == 0 && st.st_dev == dev;
+    *slash = saved;
+    if (!same) {
+      break;
+    }
+    root_end = slash;
+  }
+
+  if (*root_end == 0) {
+    strcpy(out, "/");
+  } else {
+    snprintf(out, NUFS_PATH_MAX, "%s", root_end);
+  }
+}
+
+// grows the image mounted at (or containing) path
+static int grow(const char *path, const char *blocks) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  nufs_grow_args_t args = {atoll(blocks)};
+  if (ioctl(fd, NUFS_IOC_GROW, &args) < 0) {
+    fprintf(stderr, "nufsctl grow: %s\n", strerror(errno));
+    close(fd);
+    return 1;
+  }
+  printf("the image has %lld blocks\n", (long long)args.blocks);
+  close(fd);
+  return 0;
+}
+
+// defragments (or only measures) the filesystem mounted at path
+static int defrag(const char *path, int report) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  nufs_defrag_args_t args = {0};
+  args.flags = report ? NUFS_DEFRAG_REPORT : 0;
+  if (ioctl(fd, NUFS_IOC_DEFRAG, &args) < 0) {
+    fprintf(stderr, "nufsctl defrag: %s\n", strerror(errno));
+    close(fd);
+    return 1;
+  }
+  printf("%u files, %u in more than one extent, %lld extents in all\n",
+         args.files, args.fragmented, (long long)args.extents_before);
+  if (!report) {
+    printf("moved %u files (%lld blocks), %lld extents left\n", args.moved,
+           (long long)args.blocks_moved, (long long)args.extents_after);
+  }
+  close(fd);
+  return 0;
+}
+
+// snapshots the image mounted at path to file, and waits for the copy to
+// be renamed into place
+static int snapshot(const char *path, const char *file) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+
+  // nufs doesn't run in our directory, it needs the full path
+  nufs_snapshot_args_t args = {0};
+  char dir[PATH_MAX];
+  if (snprintf(dir, sizeof(dir), "%s", file) >= (int)sizeof(dir)) {
+    fprintf(stderr, "nufsctl snapshot: %s\n", strerror(ENAMETOOLONG));
+    close(fd);
+    return 1;
+  }
+  char *slash = strrchr(dir, '/');
+  const char *name = slash == NULL ? file : slash + 1;
+  if (slash == dir) {
+    strcpy(dir, "/");
+  } else if (slash == NULL) {
+    strcpy(dir, ".");
+  } else {
+    *slash = 0;
+  }
+  char full[PATH_MAX];
+  if (realpath(dir, full) == NULL) {
+    perror(dir);
+    close(fd);
+    return 1;
+  }
+  // (cut short, it would name some other file)
+  if (snprintf(args.path, sizeof(args.path), "%s/%s",
+               strcmp(full, "/") == 0 ? "" : full,
+               name) >= (int)sizeof(args.path)) {
+    fprintf(stderr, "nufsctl snapshot: %s\n", strerror(ENAMETOOLONG));
+    close(fd);
+    return 1;
+  }
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (ioctl(fd, NUFS_IOC_SNAPSHOT, &args) < 0) {
+    fprintf(stderr, "nufsctl snapshot: %s\n", strerror(errno));
+    close(fd);
+    return 1;
+  }
+  close(fd);
+
+  // the copy is renamed into place once it's complete, or removed if it
+  // couldn't be
+  char part[sizeof(args.path) + 8];
+  snprintf(part, sizeof(part), "%s.part", args.path);
+  while (access(args.path, F_OK) < 0) {
+    if (access(part, F_OK) < 0 && access(args.path, F_OK) < 0) {
+      fprintf(stderr, "nufsctl snapshot: the copy failed\n");
+      return 1;
+    }
+    usleep(10000);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  printf("%lld blocks, writers paused for %.3fms, copied in %ldms\n",
+         (long long)args.blocks, args.pause_us / 1000.0,
+         (now.tv_sec - start.tv_sec) * 1000 +
+             (now.tv_nsec - start.tv_nsec) / 1000000);
+  return 0;
+}
+
+// lists the count hottest files of the filesystem mounted at path
+static int heat(const char *path, int count) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  static nufs_heat_args_t args;
+  args.count = count;
+  if (ioctl(fd, NUFS_IOC_HEAT, &args) < 0) {
+    fprintf(stderr, "nufsctl heat: %s%s\n", strerror(errno),
+            errno == ENODATA ? " (mount with -o heat)" : "");
+    close(fd);
+    return 1;
+  }
+  close(fd);
+
+  printf("%8s %8s %8s %10s %10s %7s  %s (halving every %us)\n", "heat",
+         "reads", "writes", "KB read", "KB written", "extents", "file",
+         args.half_life);
+  for (uint32_t i = 0; i < args.count; i++) {
+    nufs_heat_entry_t *e = &args.entries[i];
+    printf("%8llu %8llu %8llu %10llu %10llu %7u  %s\n",
+           (unsigned long long)e->heat, (unsigned long long)e->reads,
+           (unsigned long long)e->writes,
+           (unsigned long long)e->bytes_read / 1024,
+           (unsigned long long)e->bytes_written / 1024, e->extents,
+           e->path[0] ? e->path : "(unlinked)");
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 3 && (strcmp(argv[1], "defrag") == 0 ||
+                    strcmp(argv[1], "frag") == 0)) {
+    return defrag(argv[2], strcmp(argv[1], "frag") == 0);
+  }
+  if ((argc == 3 || argc == 4) && strcmp(argv[1], "heat") == 0) {
+    return heat(argv[2], argc == 4 ? atoi(argv[3]) : 10);
+  }
+  if (argc < 4) {
+    usage();
+  }
+  if (strcmp(argv[1], "grow") == 0) {
+    if (argc != 4) {
+      usage();
+    }
+    return grow(argv[2], argv[3]);
+  }
+  if (strcmp(argv[1], "snapshot") == 0) {
+    if (argc != 4) {
+      usage();
+    }
+    return snapshot(argv[2], argv[3]);
+  }
+  const char *cmd = argv[1];
+  const char *src = argv[2];
+  const char *dst = argv[3];
+  int clone = strcmp(cmd, "clone") == 0 && argc == 4;
+  if (!clone && !(strcmp(cmd, "copy") == 0 && (argc == 4 || argc == 7))) {
+    usage();
+  }
+  // (before dst is opened, this exits if src isn't there)
+  char src_path[NUFS_PATH_MAX];
+  fs_path(src, src_path);
+
+  int fd = open(dst, O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    perror(dst);
+    return 1;
+  }
+
+  int rv;
+  if (clone) {
+    nufs_clone_args_t args;
+    memcpy(args.src, src_path, sizeof(args.src));
+    rv = ioctl(fd, NUFS_IOC_CLONE, &args);
+  } else {
+    nufs_copy_range_args_t args = {0};
+    memcpy(args.src, src_path, sizeof(args.src));
+    if (argc == 7) {
+      args.src_offset = atoll(argv[4]);
+      args.dst_offset = atoll(argv[5]);
+      args.length = atoll(argv[6]);
+    } else {
+      struct stat st;
+      stat(src, &st);
+      args.length = st.st_size;
+    }
+    rv = ioctl(fd, NUFS_IOC_COPY_RANGE, &args);
+    if (rv == 0) {
+      printf("copied %lld bytes\n", (long long)args.copied);
+    }
+  }
+
+  if (rv < 0) {
+    fprintf(stderr, "nufsctl %s: %s\n", cmd, strerror(errno));
+    close(fd);
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "checksum.h"
+#include "inode.h"
+#include "journal.h"
+#include "layout.h"
+#include "orphan.h"
+#include "reserve.h"
+
+// the orphans in the order they came, a ring
+static int queue[INODE_COUNT];
+static int queue_head = 0;
+static int queue_count = 0;
+
+static void push(int inum) {
+  queue[(queue_head + queue_count) % INODE_COUNT] = inum;
+  queue_count++;
+}
+
+// marks the inode as an orphan waiting to be freed
+static void adopt(int inum) {
+  inode_t *node = get_inode(inum);
+  inode_dirty(node);
+  node->flags |= INODE_ORPHAN;
+  node->refs = 0;
+  get_superblock()->orphans++;
+  reserve_release(inum);
+  push(inum);
+}
+
+void orphan_init() {
+  superblock_t *sb = get_superblock();
+  queue_head = queue_count = 0;
+  if (sb->orphans == 0) {
+    return;
+  }
+
+  uint8_t *ibm = get_inode_bitmap();
+  for (int inum = 1; inum < sb->itable_used; inum++) {
+    if (bitmap_get(ibm, inum) && (get_inode(inum)->flags & INODE_ORPHAN)) {
+      push(inum);
+    }
+  }
+  printf("orphans: %d left from last time, freeing them\n", queue_count);
+  sb->orphans = queue_count;
+}
+
+int orphan_file(int inum) {
+  inode_t *node = get_inode(inum);
+  if (!S_ISREG(node->mode) || node->size / 4096 + 1 < ORPHAN_MIN_BLOCKS) {
+    return 0;
+  }
+  adopt(inum);
+  return 1;
+}
+
+int orphan_truncate(inode_t *node, int size) {
+  int last = node->size / 4096;
+  int keep = size / 4096;
+  if (!S_ISREG(node->mode) || last - keep < ORPHAN_MIN_BLOCKS) {
+    return 0;
+  }
+
+  // (alloc_inode hands out a first block, which the orphan doesn't need)
+  int inum = alloc_inode(INODE_GROUP(inode_num(node)));
+  if (inum < 0) {
+    return 0;
+  }
+  inode_t *orphan = get_inode(inum);
+  free_block(orphan->ptrs[0]);
+  orphan->ptrs[0] = 0;
+
+  // the file keeps its indirect block if it still needs it, then the
+  // pointers past the cut are copied into one for the orphan
+  if (last >= nptrs && keep >= nptrs) {
+    orphan->iptr = alloc_block_near(node->iptr);
+    if (orphan->iptr < 0) {
+      orphan->iptr = 0;
+      free_inode(inum);
+      return 0;
+    }
+    int *from = blocks_get_block(node->iptr);
+    int *to = blocks_get_block(orphan->iptr);
+    memset(to, 0, 4096);
+    for (int i = keep + 1; i <= last; i++) {
+      to[i - nptrs] = from[i - nptrs];
+      from[i - nptrs] = 0;
+    }
+    checksum_dirty(node->iptr);
+    journal_dirty(node->iptr);
+    checksum_dirty(orphan->iptr);
+    journal_dirty(orphan->iptr);
+  } else if (last >= nptrs) {
+    orphan->iptr = node->iptr;
+    node->iptr = 0;
+  }
+  for (int i = keep + 1; i <= last && i < nptrs; i++) {
+    orphan->ptrs[i] = node->ptrs[i];
+    node->ptrs[i] = 0;
+  }
+
+  orphan->mode = node->mode;
+  orphan->size = node->size;
+  inode_dirty(node);
+  node->size = size;
+  adopt(inum);
+  return 1;
+}
+
+// frees an orphan that has no blocks left past its first slot
+static void forget(int inum) {
+  get_inode(inum)->flags &= ~INODE_ORPHAN;
+  get_superblock()->orphans--;
+  free_inode(inum);
+}
+
+int orphan_reclaim(int count) {
+  int freed = 0;
+  while (queue_count > 0 && (count < 0 || freed < count)) {
+    int inum = queue[queue_head];
+    inode_t *node = get_inode(inum);
+    int slots = node->size / 4096;
+    if (count < 0 || slots < count - freed) {
+      forget(inum);
+      queue_head = (queue_head + 1) % INODE_COUNT;
+      queue_count--;
+      freed += slots + 1;
+    } else {
+      // the last pages first, so the orphan stays a valid (shorter) file
+      shrink_inode(node, (slots - (count - freed)) * 4096);
+      freed = count;
+    }
+  }
+  return freed;
+}
+
+int orphan_pending() { return queue_count; }
@@ -0,0 +1,34 @@
+// Deferred freeing of big files.
+//
+// Freeing a big file's blocks one at a time in the middle of an unlink or a
+// truncate holds up the caller, and everyone else waiting for the storage
+// lock. So when a file with ORPHAN_MIN_BLOCKS blocks or more goes away, or a
+// truncate cuts off that many, the blocks are handed to an orphan: an inode
+// with INODE_ORPHAN set and no links. orphan_reclaim frees them later, a
+// batch at a time, from a background thread (see storage_start). Orphans
+// are marked in their inodes and counted in the superblock, so the next
+// mount finds the ones a crash left behind and finishes them.
+
+#ifndef ORPHAN_H
+#define ORPHAN_H
+
+#include "inode.h"
+
+#define ORPHAN_MIN_BLOCKS 16
+#define ORPHAN_BATCH 64 // blocks freed at a time in the background
+
+// finds the orphans left in the image, if the superblock says there are any
+void orphan_init();
+// makes the unlinked file an orphan, returns 0 if it's too small to bother
+// (then the caller frees it)
+int orphan_file(int inum);
+// hands the blocks of the file past the given size to a new orphan and
+// shrinks it, returns 0 if that isn't worth it (or possible)
+int orphan_truncate(inode_t *node, int size);
+// frees up to count blocks of orphans (all of them for count < 0), returns
+// how many it freed
+int orphan_reclaim(int count);
+// the number of orphans waiting
+int orphan_pending();
+
+#endif
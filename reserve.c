@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "reserve.h"
+
+// a file's window is the blocks [next, end), a slot is unused when its
+// window is empty
+typedef struct window {
+  int inum;
+  int next;
+  int end;
+  uint32_t last_used;
+  time_t used_at;
+} window_t;
+
+static window_t windows[RESERVE_FILES];
+static uint32_t window_clock = 0;
+
+static window_t *find_window(int inum) {
+  for (int i = 0; i < RESERVE_FILES; i++) {
+    if (windows[i].next < windows[i].end && windows[i].inum == inum) {
+      return &windows[i];
+    }
+  }
+  return NULL;
+}
+
+static int drop_window(window_t *w) {
+  int count = w->end - w->next;
+  blocks_unreserve(w->next, count);
+  w->next = w->end = 0;
+  return count;
+}
+
+// how big a new window can be with the free blocks there are
+static int window_size() {
+  int spare = get_superblock()->free_blocks - blocks_reserved();
+  int count = spare / RESERVE_SHARE;
+  return count < RESERVE_WINDOW ? count : RESERVE_WINDOW;
+}
+
+// an unused slot, or else the one whose file was written the longest ago
+static window_t *free_window() {
+  window_t *oldest = &windows[0];
+  for (int i = 0; i < RESERVE_FILES; i++) {
+    if (windows[i].next == windows[i].end) {
+      return &windows[i];
+    }
+    if (windows[i].last_used < oldest->last_used) {
+      oldest = &windows[i];
+    }
+  }
+  drop_window(oldest);
+  return oldest;
+}
+
+int reserve_alloc(int inum, int goal) {
+  window_t *w = find_window(inum);
+  if (w != NULL && w->next != goal) {
+    // the file isn't being written in order (anymore)
+    drop_window(w);
+    w = NULL;
+  }
+
+  if (w == NULL) {
+    int count = window_size();
+    if (count < 2) {
+      // (the image is nearly full)
+      return alloc_block_near(goal);
+    }
+    w = free_window();
+    int first = blocks_reserve(goal, &count);
+    if (first < 0) {
+      // only other files' windows are left, alloc_block_near takes them back
+      return alloc_block_near(goal);
+    }
+    w->inum = inum;
+    w->next = first;
+    w->end = first + count;
+  }
+
+  w->last_used = ++window_clock;
+  w->used_at = time(NULL);
+  return alloc_reserved_block(w->next++);
+}
+
+void reserve_release(int inum) {
+  window_t *w = find_window(inum);
+  if (w != NULL) {
+    drop_window(w);
+  }
+}
+
+void reserve_release_all() {
+  for (int i = 0; i < RESERVE_FILES; i++) {
+    if (windows[i].next < windows[i].end) {
+      drop_window(&windows[i]);
+    }
+  }
+}
+
+int reserve_release_idle(int seconds) {
+  time_t now = time(NULL);
+  int count = 0;
+  for (int i = 0; i < RESERVE_FILES; i++) {
+    if (windows[i].next < windows[i].end &&
+        now - windows[i].used_at >= seconds) {
+      count += drop_window(&windows[i]);
+    }
+  }
+  return count;
+}
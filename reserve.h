@@ -0,0 +1,35 @@
+// Block reservations for files being written.
+//
+// When a file needs a block, a window of up to RESERVE_WINDOW free blocks
+// from the one it wants on is set aside for it (see blocks_reserve), and
+// the blocks it needs after that come out of the window without searching
+// the bitmap. Files written at the same time each fill their own window
+// instead of taking turns at the next free block, so each one's blocks stay
+// in order. A window is given back when its file is closed or deleted, or
+// wants a block somewhere else, or hasn't needed a block for RESERVE_IDLE
+// seconds, and all of them when the image runs out of other free blocks.
+//
+// As the image fills up the windows get smaller, so they never hold more
+// than a few of the free blocks: a new window gets at most 1/RESERVE_SHARE
+// of the blocks no other window has, and there are none once that's less
+// than two.
+
+#ifndef RESERVE_H
+#define RESERVE_H
+
+#define RESERVE_WINDOW 16 // blocks set aside at a time
+#define RESERVE_FILES 32  // files with a window at once
+#define RESERVE_SHARE 8   // of the unreserved free blocks, for a new window
+#define RESERVE_IDLE 5    // seconds until an unused window is given back
+
+// allocates a block for the file, from its window if goal is next in it
+int reserve_alloc(int inum, int goal);
+// gives back the rest of the file's window
+void reserve_release(int inum);
+// gives back every window
+void reserve_release_all();
+// gives back the windows whose files haven't needed a block for the given
+// number of seconds, returns how many blocks that was
+int reserve_release_idle(int seconds);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "checksum.h"
+#include "inode.h"
+#include "layout.h"
+#include "segment.h"
+
+#define SEGMENT_COUNT (BLOCK_COUNT / SEGMENT_BLOCKS)
+
+// the unused blocks of the open segment are [head, end)
+static int head = 0;
+static int end = 0;
+static int last_segment = -1;
+
+// the segments the current cleaning pass empties out
+static uint8_t victims[(SEGMENT_COUNT + 7) / 8];
+
+static int live_blocks(int seg) {
+  // (segments start on a byte boundary)
+  uint8_t *bbm = get_blocks_bitmap();
+  return bitmap_count(bbm + seg * SEGMENT_BLOCKS / 8, SEGMENT_BLOCKS);
+}
+
+// opens the next free segment after the last one, so the log keeps moving
+// forward through the image
+static int open_segment() {
+  int segments = blocks_total() / SEGMENT_BLOCKS;
+  for (int i = 1; i <= segments; i++) {
+    int seg = (last_segment + i) % segments;
+    int start = seg * SEGMENT_BLOCKS;
+    if (start < FIRST_DATA_BLOCK || live_blocks(seg) > 0) {
+      continue;
+    }
+    // (part of it could be reserved for some file)
+    int count = SEGMENT_BLOCKS;
+    int first = blocks_reserve(start, &count);
+    if (first == start && count == SEGMENT_BLOCKS) {
+      head = start;
+      end = start + SEGMENT_BLOCKS;
+      last_segment = seg;
+      return 0;
+    }
+    if (first >= 0) {
+      blocks_unreserve(first, count);
+    }
+  }
+  return -1;
+}
+
+int segment_alloc(int goal) {
+  if (head == end && open_segment() < 0) {
+    // no free segment left, the log goes wherever there's room
+    return alloc_block_near(goal);
+  }
+  int bnum = alloc_reserved_block(head++);
+  if (bnum < 0) {
+    // the segment was taken back (the image is full)
+    head = end;
+    return alloc_block_near(goal);
+  }
+  return bnum;
+}
+
+void segment_release() {
+  blocks_unreserve(head, end - head);
+  head = end = 0;
+}
+
+// whether the block is in a segment being cleaned and can be moved
+static int should_move(int bnum) {
+  int seg = bnum / SEGMENT_BLOCKS;
+  return bnum > 0 && bitmap_get(victims, seg) && !block_is_shared(bnum) &&
+         checksum_verify(bnum) >= 0;
+}
+
+// moves the file's blocks out of the victim segments, returns how many
+static int clean_inode(inode_t *node) {
+  int moved = 0;
+  for (int i = 0; i <= node->size / 4096; i++) {
+    int bnum = inode_get_bnum(node, i * 4096);
+    if (!should_move(bnum)) {
+      continue;
+    }
+    int copy = segment_alloc(bnum);
+    if (copy < 0) {
+      break;
+    }
+    memcpy(blocks_get_block(copy), blocks_get_block(bnum), 4096);
+    checksum_dirty(copy);
+    inode_set_bnum(node, i * 4096, copy);
+    free_block(bnum);
+    moved++;
+  }
+  return moved;
+}
+
+// picks the segments with only a few blocks still in use
+static void pick_victims(segment_stats_t *stats) {
+  memset(victims, 0, sizeof(victims));
+  int segments = blocks_total() / SEGMENT_BLOCKS;
+  for (int seg = 0; seg < segments; seg++) {
+    int live = live_blocks(seg);
+    if (seg * SEGMENT_BLOCKS >= FIRST_DATA_BLOCK && seg != last_segment &&
+        live > 0 && live <= SEGMENT_CLEAN_LIVE) {
+      bitmap_put(victims, seg, 1);
+      stats->segments++;
+    }
+  }
+}
+
+int segment_clean(int *cursor, int count, segment_stats_t *stats) {
+  if (*cursor == 0) {
+    pick_victims(stats);
+  }
+  uint8_t *ibm = get_inode_bitmap();
+  int used = get_superblock()->itable_used;
+
+  for (int i = 0; i < count; i++) {
+    int inum = *cursor;
+    if (inum >= used) {
+      break;
+    }
+    *cursor = inum + 1;
+    inode_t *node = get_inode(inum);
+    if (bitmap_get(ibm, inum) && (node->flags & INODE_LOG) &&
+        !(node->flags & INODE_ORPHAN)) {
+      stats->moved += clean_inode(node);
+    }
+  }
+  if (*cursor < used) {
+    return 0;
+  }
+
+  // the pass is done
+  for (int seg = 0; seg < SEGMENT_COUNT; seg++) {
+    if (bitmap_get(victims, seg) && live_blocks(seg) == 0) {
+      stats->cleaned++;
+    }
+  }
+  *cursor = 0;
+  return 1;
+}
@@ -0,0 +1,40 @@
+// Log-structured writes.
+//
+// Files in log mode (INODE_LOG, set with chattr +j or for every new file by
+// the log mount option) never overwrite a block in place: a changed block
+// is written to the next free block of the log, the open segment, and the
+// file's pointer is switched over to it, so random writes turn into
+// sequential ones. Segments are SEGMENT_BLOCKS-aligned runs of blocks, and
+// the log only opens segments that are completely free (their blocks are
+// reserved in memory while open, see blocks_reserve).
+//
+// Overwritten blocks are freed right away, which leaves holes in older
+// segments. The cleaner finds segments that are mostly holes and moves the
+// blocks of log files that are still in them to the log, so they become
+// free segments again.
+
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include "inode.h"
+
+#define SEGMENT_BLOCKS 16
+#define SEGMENT_CLEAN_LIVE 4 // most blocks still in use to clean a segment
+
+typedef struct segment_stats {
+  int segments; // segments the cleaner picked
+  int cleaned;  // how many of them ended up free
+  long moved;   // blocks moved to the log
+} segment_stats_t;
+
+// allocates the next block of the log (anywhere near goal if there's no
+// free segment left)
+int segment_alloc(int goal);
+// closes the open segment, giving back the blocks it didn't use
+void segment_release();
+// moves the blocks of count inodes starting at *cursor out of mostly empty
+// segments and adds what it did to stats; returns 1 once the cursor wraps
+// around to the start
+int segment_clean(int *cursor, int count, segment_stats_t *stats);
+
+#endif
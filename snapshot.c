@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "snapshot.h"
+
+#define NOT_COPIED 0
+#define COPYING 1
+#define COPIED 2
+
+// the copy being made: the blocks the image had and which of them were in
+// use when it started, and how far along each block is
+static atomic_int active = 0;
+static int copy_fd = -1;
+static int copy_blocks = 0;
+static uint8_t in_use[BLOCK_BITMAP_SIZE];
+static _Atomic uint8_t state[BLOCK_COUNT];
+static atomic_long saved_early = 0; // blocks copied by the fault handler
+static atomic_int copy_error = 0;   // errno of the first write that failed
+
+static char copy_path[4096];
+static char temp_path[4096 + 8];
+static pthread_t copier;
+static int copying = 0;
+static struct timespec started;
+
+static struct sigaction old_action;
+static int handler_installed = 0;
+
+// copies a block to the snapshot unless that's done already, waiting for
+// whoever is in the middle of it (this runs in the fault handler too, so
+// nothing here can take a lock)
+static void save_block(int bnum) {
+  uint8_t expected = NOT_COPIED;
+  if (atomic_compare_exchange_strong(&state[bnum], &expected, COPYING)) {
+    if (bitmap_get(in_use, bnum)) {
+      ssize_t done = pwrite(copy_fd, blocks_get_block(bnum), BLOCK_SIZE,
+                            (off_t)bnum * BLOCK_SIZE);
+      if (done != BLOCK_SIZE) {
+        // (a short write means the host ran out of space)
+        int none = 0;
+        atomic_compare_exchange_strong(&copy_error, &none,
+                                       done < 0 ? errno : ENOSPC);
+      }
+    }
+    atomic_store(&state[bnum], COPIED);
+    return;
+  }
+  while (atomic_load(&state[bnum]) != COPIED) {
+  }
+}
+
+// copies the chunk holding bnum and lets writes to it through again
+static void save_chunk(int bnum) {
+  int first = bnum - bnum % SNAPSHOT_CHUNK;
+  int end = first + SNAPSHOT_CHUNK;
+  if (end > copy_blocks) {
+    end = copy_blocks;
+  }
+  for (int b = first; b < end; b++) {
+    save_block(b);
+  }
+  mprotect(blocks_get_block(first), (size_t)(end - first) * BLOCK_SIZE,
+           PROT_READ | PROT_WRITE);
+}
+
+// a write to a block that's still protected, anything else is a real crash
+static void on_fault(int sig, siginfo_t *info, void *context) {
+  // (the code that faulted may be about to look at errno)
+  int saved_errno = errno;
+  uint8_t *addr = info->si_addr;
+  uint8_t *base = blocks_get_block(0);
+  if (atomic_load(&active) && addr >= base &&
+      addr < base + (size_t)copy_blocks * BLOCK_SIZE) {
+    int bnum = (addr - base) / BLOCK_SIZE;
+    if (atomic_load(&state[bnum]) != COPIED) {
+      atomic_fetch_add(&saved_early, 1);
+    }
+    save_chunk(bnum);
+    errno = saved_errno;
+    return;
+  }
+  // (the faulting instruction runs again, and crashes the usual way)
+  sigaction(SIGSEGV, &old_action, NULL);
+}
+
+static void *copy_thread(void *arg) {
+  for (int first = 0; first < copy_blocks; first += SNAPSHOT_CHUNK) {
+    save_chunk(first);
+  }
+  // (everything is writable again before the handler stops expecting it)
+  atomic_store(&active, 0);
+
+  int rv = fsync(copy_fd);
+  close(copy_fd);
+  if (atomic_load(&copy_error)) {
+    // a copy with blocks missing is no snapshot
+    errno = atomic_load(&copy_error);
+    rv = -1;
+  }
+  if (rv == 0) {
+    rv = rename(temp_path, copy_path);
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (rv < 0) {
+    perror(copy_path);
+    unlink(temp_path);
+  } else {
+    printf("snapshot: copied %d blocks to %s in %ldms, %ld before they "
+           "were written\n",
+           copy_blocks, copy_path,
+           (now.tv_sec - started.tv_sec) * 1000 +
+               (now.tv_nsec - started.tv_nsec) / 1000000,
+           (long)saved_early);
+  }
+  return NULL;
+}
+
+int snapshot_start(const char *path) {
+  if (copying) {
+    if (atomic_load(&active)) {
+      return -EBUSY;
+    }
+    pthread_join(copier, NULL);
+    copying = 0;
+  }
+  if (strlen(path) >= sizeof(copy_path)) {
+    return -ENAMETOOLONG;
+  }
+  if (access(path, F_OK) == 0) {
+    return -EEXIST;
+  }
+  strcpy(copy_path, path);
+  snprintf(temp_path, sizeof(temp_path), "%s.part", path);
+
+  copy_blocks = blocks_total();
+  copy_fd = open(temp_path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+  if (copy_fd < 0) {
+    return -errno;
+  }
+  if (ftruncate(copy_fd, (off_t)copy_blocks * BLOCK_SIZE) < 0) {
+    int rv = -errno;
+    close(copy_fd);
+    unlink(temp_path);
+    return rv;
+  }
+
+  if (!handler_installed) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_fault;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &old_action);
+    handler_installed = 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  memcpy(in_use, get_blocks_bitmap(), BLOCK_BITMAP_SIZE);
+  for (int bnum = 0; bnum < copy_blocks; bnum++) {
+    atomic_store(&state[bnum], NOT_COPIED);
+  }
+  saved_early = 0;
+  atomic_store(&copy_error, 0);
+  atomic_store(&active, 1);
+  if (mprotect(blocks_get_block(0), (size_t)copy_blocks * BLOCK_SIZE,
+               PROT_READ) < 0) {
+    int rv = -errno;
+    atomic_store(&active, 0);
+    close(copy_fd);
+    unlink(temp_path);
+    return rv;
+  }
+
+  copying = pthread_create(&copier, NULL, copy_thread, NULL) == 0;
+  if (!copying) {
+    // copy it right here then
+    copy_thread(NULL);
+  }
+  return 0;
+}
+
+void snapshot_save(int first, int count) {
+  if (!atomic_load(&active)) {
+    return;
+  }
+  for (int bnum = first; bnum < first + count && bnum < copy_blocks; bnum++) {
+    save_block(bnum);
+  }
+}
+
+void snapshot_wait() {
+  if (copying) {
+    pthread_join(copier, NULL);
+    copying = 0;
+  }
+}
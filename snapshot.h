@@ -0,0 +1,31 @@
+// Point-in-time copies of the mounted image (NUFS_IOC_SNAPSHOT).
+//
+// Starting a snapshot only write-protects the mapped image and starts a
+// thread, so the filesystem pauses for about as long as an mprotect takes,
+// however big the image is. The thread then copies the blocks that were in
+// use to a new file a chunk at a time, while the filesystem keeps going:
+// the first write to a block it hasn't gotten to yet faults, and the fault
+// handler copies the chunk's old contents before letting the write through
+// (copy-on-write of the MAP_SHARED blocks). Free blocks stay holes in the
+// copy. The copy is written next to its final name and renamed into place
+// once it's complete, or removed if any of it couldn't be written, so it
+// never shows up half done.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#define SNAPSHOT_CHUNK 16 // blocks copied and unprotected together
+
+// starts copying the image, as it is right now, to the file at path (which
+// can't exist yet); the caller holds the storage lock, so nothing is in the
+// middle of changing it. Returns 0 or -errno, -EBUSY while a copy is
+// still going.
+int snapshot_start(const char *path);
+// copies the old contents of the blocks in the range if the copy still
+// needs them, before they're changed by something other than a write to
+// the mapping (like punching them out of the image file)
+void snapshot_save(int first, int count);
+// waits for the copy being made to be done
+void snapshot_wait();
+
+#endif
@@ -0,0 +1,131 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "span.h"
+
+#define SPAN_DEPTH 32   // deepest nesting that's recorded
+#define SPAN_EVENTS 256 // spans per request, the rest are dropped
+
+__thread int span_sampled = 0;
+int span_enabled = 0;
+
+typedef struct span_event {
+  const char *name;
+  uint64_t start; // ns since the file was opened
+  uint64_t duration;
+} span_event_t;
+
+// the spans of the request a thread is running, written out at its end
+static __thread struct {
+  span_event_t events[SPAN_EVENTS];
+  int count;
+  int open[SPAN_DEPTH]; // the events that haven't ended, innermost last
+  int depth;
+} request;
+
+static FILE *span_file = NULL;
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t epoch;
+static int rate = SPAN_RATE_DEFAULT;
+static atomic_uint requests = 0;
+static int first_event = 1;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int span_open(const char *path, int sample_rate) {
+  span_file = fopen(path, "w");
+  if (span_file == NULL) {
+    return -errno;
+  }
+  // the JSON array format, which doesn't need the closing ] if we crash
+  fputs("[\n", span_file);
+  epoch = now_ns();
+  rate = sample_rate > 0 ? sample_rate : 1;
+  span_enabled = 1;
+  return 0;
+}
+
+void span_close() {
+  if (span_file == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&file_lock);
+  span_enabled = 0;
+  fputs("\n]\n", span_file);
+  fclose(span_file);
+  span_file = NULL;
+  pthread_mutex_unlock(&file_lock);
+}
+
+void span_push(const char *name) {
+  // deeper spans (and their ends) are ignored
+  if (request.depth++ >= SPAN_DEPTH) {
+    return;
+  }
+  int index = -1;
+  if (request.count < SPAN_EVENTS) {
+    index = request.count++;
+    request.events[index].name = name;
+    request.events[index].start = now_ns() - epoch;
+  }
+  request.open[request.depth - 1] = index;
+}
+
+void span_pop() {
+  if (request.depth == 0 || request.depth-- > SPAN_DEPTH) {
+    return;
+  }
+  int index = request.open[request.depth];
+  if (index >= 0) {
+    span_event_t *event = &request.events[index];
+    event->duration = now_ns() - epoch - event->start;
+  }
+}
+
+void span_request_begin() {
+  if (!span_enabled || atomic_fetch_add(&requests, 1) % rate != 0) {
+    return;
+  }
+  request.count = 0;
+  request.depth = 0;
+  span_sampled = 1;
+  span_push("request");
+}
+
+void span_request_end(const char *name) {
+  if (!span_sampled) {
+    return;
+  }
+  // spans left open by an early return end with the request
+  while (request.depth > 1) {
+    span_pop();
+  }
+  span_pop();
+  span_sampled = 0;
+  request.events[0].name = name;
+
+  int tid = syscall(SYS_gettid);
+  pthread_mutex_lock(&file_lock);
+  if (span_file != NULL) {
+    for (int i = 0; i < request.count; i++) {
+      span_event_t *event = &request.events[i];
+      fprintf(span_file,
+              "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+              "\"ts\":%.3f,\"dur\":%.3f}",
+              first_event ? "" : ",\n", event->name, tid,
+              event->start / 1000.0, event->duration / 1000.0);
+      first_event = 0;
+    }
+  }
+  pthread_mutex_unlock(&file_lock);
+}
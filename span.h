@@ -0,0 +1,44 @@
+// Sampled tracing of what happens inside a request (the spans=FILE mount
+// option).
+//
+// One request in every span_rate=N (100 by default) is sampled. While it
+// runs, span_begin()/span_end() pairs record nested spans (tree_lookup,
+// alloc_block, ...), which are written to FILE as Chrome trace events when
+// the request ends, to be opened with chrome://tracing or Perfetto. For the
+// other requests, and when the option is off, a span is just a branch.
+
+#ifndef SPAN_H
+#define SPAN_H
+
+#define SPAN_RATE_DEFAULT 100
+
+// set while the current request is being sampled
+extern __thread int span_sampled;
+// set if there is a file to write spans to
+extern int span_enabled;
+
+void span_push(const char *name);
+void span_pop();
+
+static inline void span_begin(const char *name) {
+  if (span_sampled) {
+    span_push(name);
+  }
+}
+
+static inline void span_end() {
+  if (span_sampled) {
+    span_pop();
+  }
+}
+
+// opens the span file, before fuse changes directory, returns 0 or -errno
+int span_open(const char *path, int rate);
+void span_close();
+
+// called at the start and end of every request (see trace_begin); the whole
+// request becomes a span with the given name
+void span_request_begin();
+void span_request_end(const char *name);
+
+#endif
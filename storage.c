@@ -1,40 +1,583 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "checksum.h"
+#include "compress.h"
+#include "dedup.h"
+#include "defrag.h"
 #include "directory.h"
+#include "heat.h"
 #include "inode.h"
+#include "journal.h"
+#include "layout.h"
+#include "nufs_ioctl.h"
+#include "orphan.h"
+#include "reserve.h"
+#include "segment.h"
 #include "slist.h"
+#include "snapshot.h"
+#include "span.h"
+#include "storage.h"
+#include "times.h"
 
 // macro to get the minimum of two values because we're lazy
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// the scrubber checks this many blocks at a time before letting requests in
+#define SCRUB_BATCH 16
+// and the defragmenter this many inodes
+#define DEFRAG_BATCH 4
+// writes of at least a block and at most this many copy their data in
+// without the lock (see write_unlocked)
+#define UNLOCKED_BLOCKS 64
+
 // helpers
+static void storage_init_read_only(const char *path);
 static void get_parent_child(const char *path, char *parent, char *child);
+static int create_entry(inode_t *dir, const char *name, int mode,
+                        dir_batch_t *batch, int *where);
+static int unshare_block(inode_t *node, int offset, int bnum, int keep);
+static int truncate_inode(inode_t *node, off_t size);
+static int write_inode(inode_t *node, const char *buf, size_t size,
+                       off_t offset);
+static int write_unlocked(int inum, const char *buf, size_t size,
+                          off_t offset);
+static int read_inode(inode_t *node, char *buf, size_t size, off_t offset);
+static int share_page(inode_t *node, int offset, int bnum);
 
-// initializes our file structure
-void storage_init(const char *path) {
+static void *scrub_thread(void *arg);
+static void *flush_thread(void *arg);
+static void *punch_thread(void *arg);
+static void *defrag_thread(void *arg);
+static void *reclaim_thread(void *arg);
+static void *clean_thread(void *arg);
+
+static storage_opts_t opts = {.lazytime = LAZYTIME_DEFAULT,
+                              .punch = PUNCH_DEFAULT,
+                              .clean = CLEAN_DEFAULT};
+
+// one lock for the whole filesystem, taken by every fuse callback and by our
+// own background threads (recursive, since some callbacks call each other)
+static pthread_mutex_t lock;
+static int lock_depth = 0;
+
+// background threads and how to stop them
+static pthread_t scrubber;
+static int scrubbing = 0;
+static pthread_t flusher;
+static int flushing = 0;
+static pthread_t puncher;
+static int punching = 0;
+static pthread_t defragger;
+static int defragging = 0;
+static pthread_t reclaimer;
+static int reclaiming = 0;
+static pthread_t cleaner;
+static int cleaning = 0;
+static int stopping = 0;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+
+// files with a write copying its data in without the lock, which nothing
+// else may touch the blocks of until it's done (see wait_for_write)
+static uint8_t writing[INODE_COUNT];
+static int writes_in_flight = 0;
+static pthread_cond_t write_cond = PTHREAD_COND_INITIALIZER;
+
+// refuses a formatted image made for another on-disk format (see
+// NUFS_VERSION), its inodes and directories would be misread
+static void check_format(const char *path) {
+  superblock_t *sb = get_superblock();
+  if (sb->magic != NUFS_MAGIC || sb->version != NUFS_VERSION) {
+    fprintf(stderr,
+            "%s: made by an older nufs (format version %d, this one reads "
+            "version %d), make it again with mkfs.nufs\n",
+            path, sb->magic == NUFS_MAGIC ? sb->version : 0, NUFS_VERSION);
+    exit(1);
+  }
+}
+
+// opens an existing image that nothing is going to write to, maybe from
+// several processes at once: there's no formatting or fixing up, and no
+// in-memory state that reads change (so they don't need the lock)
+static void storage_init_read_only(const char *path) {
+  blocks_set_read_only(1);
   blocks_init(path);
-  // allocate for the inode list
   if (!bitmap_get(get_blocks_bitmap(), 1)) {
-    for (int i = 0; i < 3; i++) {
-      int newblock = alloc_block();
-      // to later me: THROW A PRINT STATEMENT SOMEWHERE HERE
-      // newblock var isn't used, consider deletion
+    fprintf(stderr, "%s: not a formatted image, can't mount it read-only\n",
+            path);
+    exit(1);
+  }
+  check_format(path);
+  checksum_init_read_only();
+  times_init(0);
+  if (journal_pending() > 0) {
+    fprintf(stderr, "%s: the journal wasn't replayed, mount it read-write "
+                    "once to see the latest changes\n",
+            path);
+  }
+  // (the counters would need the lock that readers don't take)
+  opts.heat = 0;
+}
+
+// initializes our file structure
+void storage_init(const char *path, const storage_opts_t *mount_opts) {
+  if (mount_opts != NULL) {
+    opts = *mount_opts;
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  if (opts.stripe_unit > 0) {
+    blocks_set_stripe_unit(opts.stripe_unit);
+  }
+  if (opts.ro) {
+    storage_init_read_only(path);
+    return;
+  }
+  blocks_init(path);
+  int blank = !bitmap_get(get_blocks_bitmap(), 1);
+  if (!blank) {
+    check_format(path);
+  }
+  checksum_init();
+  times_init(opts.lazytime > 0);
+
+  if (blank) {
+    // a blank image, format it right away (mkfs.nufs does the same thing)
+    printf("formatting %s\n", path);
+    storage_format();
+  }
+  // (the superblock counts and orphans come back with it)
+  journal_replay();
+  blocks_count_free();
+  orphan_init();
+  if (opts.journal && journal_init() < 0) {
+    fprintf(stderr, "%s: no room for a journal, mounting without one\n",
+            path);
+  }
+
+  if (opts.dedup) {
+    dedup_init();
+  }
+  checksum_seal();
+}
+
+// Formats the image: empty bitmaps and metadata, then the root directory.
+// The inode table isn't touched, inodes get initialized the first time
+// they're handed out (see alloc_inode), so this is quick for any size.
+void storage_format() {
+  void *bbm = get_blocks_bitmap();
+  memset(bbm, 0, BLOCK_BITMAP_SIZE);
+  memset(get_inode_bitmap(), 0, INODE_BITMAP_SIZE);
+  memset(META_AREA(0), 0, META_SIZE);
+  // nothing has a checksum anymore
+  checksum_init();
+  // and whatever was in the data blocks doesn't need to take up space
+  blocks_punch(FIRST_DATA_BLOCK, blocks_total() - FIRST_DATA_BLOCK);
+
+  // the bitmaps, inode table and metadata area
+  for (int bnum = 0; bnum < FIRST_DATA_BLOCK; bnum++) {
+    bitmap_put(bbm, bnum, 1);
+  }
+  checksum_dirty(0);
+
+  superblock_t *sb = get_superblock();
+  sb->magic = NUFS_MAGIC;
+  sb->version = NUFS_VERSION;
+  sb->free_blocks = blocks_total() - FIRST_DATA_BLOCK;
+  sb->free_inodes = INODE_COUNT;
+  sb->itable_used = 0;
+
+  directory_init();
+}
+
+// starts the background threads, this has to happen after fuse is done
+// daemonizing (threads don't survive the fork)
+void storage_start() {
+  // (nothing to scrub, flush, free or clean on a read-only image)
+  if (opts.ro) {
+    return;
+  }
+  if (opts.scrub > 0) {
+    scrubbing = pthread_create(&scrubber, NULL, scrub_thread, NULL) == 0;
+  }
+  if (opts.lazytime > 0) {
+    flushing = pthread_create(&flusher, NULL, flush_thread, NULL) == 0;
+  }
+  if (opts.punch > 0) {
+    punching = pthread_create(&puncher, NULL, punch_thread, NULL) == 0;
+  }
+  if (opts.defrag > 0) {
+    defragging = pthread_create(&defragger, NULL, defrag_thread, NULL) == 0;
+  }
+  reclaiming = pthread_create(&reclaimer, NULL, reclaim_thread, NULL) == 0;
+  if (opts.clean > 0) {
+    cleaning = pthread_create(&cleaner, NULL, clean_thread, NULL) == 0;
+  }
+  journal_start();
+}
+
+// stops the background threads
+void storage_stop() {
+  if (opts.ro) {
+    return;
+  }
+  storage_lock();
+  stopping = 1;
+  pthread_cond_broadcast(&stop_cond);
+  storage_unlock();
+
+  if (scrubbing) {
+    pthread_join(scrubber, NULL);
+    scrubbing = 0;
+  }
+  if (flushing) {
+    pthread_join(flusher, NULL);
+    flushing = 0;
+  }
+  if (punching) {
+    pthread_join(puncher, NULL);
+    punching = 0;
+  }
+  if (defragging) {
+    pthread_join(defragger, NULL);
+    defragging = 0;
+  }
+  if (reclaiming) {
+    pthread_join(reclaimer, NULL);
+    reclaiming = 0;
+  }
+  if (cleaning) {
+    pthread_join(cleaner, NULL);
+    cleaning = 0;
+  }
+  snapshot_wait();
+
+  // whatever timestamps, orphans and freed blocks are left
+  storage_lock();
+  times_flush_all();
+  orphan_reclaim(-1);
+  if (opts.punch > 0) {
+    blocks_punch_freed();
+  }
+  storage_unlock();
+  journal_stop();
+}
+
+// (a read-only image has nothing for the lock to protect, readers run in
+// parallel)
+void storage_lock() {
+  if (opts.ro) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  lock_depth++;
+}
+
+// leaving the outermost lock ends the operation, which is when the
+// checksums of everything it modified get updated, and its metadata goes in
+// the journal
+void storage_unlock() {
+  if (opts.ro) {
+    return;
+  }
+  uint32_t seq = 0;
+  if (--lock_depth == 0) {
+    checksum_seal();
+    seq = journal_commit();
+  }
+  pthread_mutex_unlock(&lock);
+  // (the next operation can go ahead while this one waits, which is how
+  // they end up sharing a flush)
+  if (seq > 0) {
+    journal_wait(seq);
+  }
+}
+
+// sleeps for the given number of seconds with the lock held, returns
+// early (and nonzero) if we're shutting down
+static int wait_or_stop(int seconds) {
+  struct timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += seconds;
+  // the condition wait has to give up the lock completely
+  int depth = lock_depth;
+  lock_depth = 0;
+  while (!stopping &&
+         pthread_cond_timedwait(&stop_cond, &lock, &until) == 0) {
+  }
+  lock_depth = depth;
+  return stopping;
+}
+
+// gives up the lock completely (however deep) for a wait on the condition
+static void wait_unlocked(pthread_cond_t *cond) {
+  int depth = lock_depth;
+  for (int i = 1; i < depth; i++) {
+    pthread_mutex_unlock(&lock);
+  }
+  lock_depth = 0;
+  pthread_cond_wait(cond, &lock);
+  lock_depth = depth;
+  for (int i = 1; i < depth; i++) {
+    pthread_mutex_lock(&lock);
+  }
+}
+
+// waits until the file has no write copying its data in, returns nonzero
+// if it had to (anything looked up before may have changed since)
+static int wait_for_write(int inum) {
+  if (inum < 0 || !writing[inum]) {
+    return 0;
+  }
+  while (writing[inum]) {
+    wait_unlocked(&write_cond);
+  }
+  return 1;
+}
+
+// waits until no file has a write copying its data in
+static void wait_for_writes() {
+  while (writes_in_flight > 0) {
+    wait_unlocked(&write_cond);
+  }
+}
+
+// verifies every block against its checksum every opts.scrub seconds
+static void *scrub_thread(void *arg) {
+  int cursor = 0;
+  storage_lock();
+  while (!wait_or_stop(opts.scrub)) {
+    int bad = 0;
+    for (int done = 0; done < BLOCK_COUNT && !stopping; done += SCRUB_BATCH) {
+      bad += checksum_scrub(&cursor, SCRUB_BATCH);
+      // let requests through between batches
+      storage_unlock();
+      storage_lock();
+    }
+    printf("scrub: checked %d blocks, %d bad\n", BLOCK_COUNT, bad);
+  }
+  storage_unlock();
+  return NULL;
+}
+
+// writes the timestamps recorded since the last time every opts.lazytime
+// seconds
+static void *flush_thread(void *arg) {
+  storage_lock();
+  while (!wait_or_stop(opts.lazytime)) {
+    times_flush_all();
+  }
+  storage_unlock();
+  return NULL;
+}
+
+// gives the blocks freed since the last time back to the host every
+// opts.punch seconds, so deleting a lot of files costs one fallocate per run
+// of blocks instead of one per block
+static void *punch_thread(void *arg) {
+  storage_lock();
+  while (!wait_or_stop(opts.punch)) {
+    int punched = blocks_punch_freed();
+    if (punched > 0) {
+      printf("punch: gave back %d blocks\n", punched);
+    }
+  }
+  storage_unlock();
+  return NULL;
+}
+
+static void print_defrag(const defrag_stats_t *stats) {
+  printf("defrag: %d files, %d fragmented, %d moved (%ld blocks), "
+         "%ld extents before, %ld after\n",
+         stats->files, stats->fragmented, stats->moved, stats->blocks_moved,
+         stats->extents_before, stats->extents_after);
+}
+
+// frees the blocks of orphaned files a batch at a time, checking for new
+// ones every second (and for reserved windows nobody uses anymore)
+static void *reclaim_thread(void *arg) {
+  storage_lock();
+  while (!wait_or_stop(1)) {
+    int freed = 0;
+    while (!stopping && orphan_pending() > 0) {
+      freed += orphan_reclaim(ORPHAN_BATCH);
+      // let requests through between batches
+      storage_unlock();
+      storage_lock();
+    }
+    if (freed > 0) {
+      printf("reclaim: freed %d blocks of deleted files\n", freed);
+    }
+    // and the windows of files that stopped growing but are still open
+    reserve_release_idle(RESERVE_IDLE);
+  }
+  storage_unlock();
+  return NULL;
+}
+
+// moves the blocks of log files out of mostly empty segments every
+// opts.clean seconds, a few files at a time
+static void *clean_thread(void *arg) {
+  storage_lock();
+  while (!wait_or_stop(opts.clean)) {
+    segment_stats_t stats = {0};
+    int cursor = 0;
+    wait_for_writes();
+    while (!stopping && !segment_clean(&cursor, DEFRAG_BATCH, &stats)) {
+      storage_unlock();
+      storage_lock();
+      wait_for_writes();
+    }
+    if (stats.moved > 0) {
+      printf("clean: moved %ld blocks, %d of %d segments freed\n",
+             stats.moved, stats.cleaned, stats.segments);
+    }
+  }
+  storage_unlock();
+  return NULL;
+}
+
+// defragments every opts.defrag seconds, a few inodes at a time
+static void *defrag_thread(void *arg) {
+  storage_lock();
+  while (!wait_or_stop(opts.defrag)) {
+    defrag_stats_t stats = {0};
+    int cursor = 0;
+    // (moving blocks that are being written would lose the write)
+    wait_for_writes();
+    while (!stopping && !defrag_pass(&cursor, DEFRAG_BATCH, 1, &stats)) {
+      // let requests through between batches
+      storage_unlock();
+      storage_lock();
+      wait_for_writes();
     }
+    print_defrag(&stats);
+  }
+  storage_unlock();
+  return NULL;
+}
+
+// runs a whole defrag pass right away (see NUFS_IOC_DEFRAG)
+int storage_defrag(nufs_defrag_args_t *args) {
+  defrag_stats_t stats = {0};
+  int cursor = 0;
+  int move = !(args->flags & NUFS_DEFRAG_REPORT);
+  if (move && opts.ro) {
+    return -EROFS;
+  }
+  if (move) {
+    wait_for_writes();
+  }
+  while (!defrag_pass(&cursor, INODE_COUNT, move, &stats)) {
+  }
+  print_defrag(&stats);
+  args->files = stats.files;
+  args->fragmented = stats.fragmented;
+  args->moved = stats.moved;
+  args->extents_before = stats.extents_before;
+  args->extents_after = stats.extents_after;
+  args->blocks_moved = stats.blocks_moved;
+  return 0;
+}
+
+// starts a snapshot of the image (see NUFS_IOC_SNAPSHOT), with everything
+// that's only in memory so far written out first
+int storage_snapshot(nufs_snapshot_args_t *args) {
+  if (opts.ro) {
+    // (the image file can simply be copied)
+    return -EROFS;
   }
-  // the remaining blocks will be alloced when we put data in them
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  // a write copying its data without the lock would be caught half done,
+  // under a checksum that doesn't match it yet
+  wait_for_writes();
+  times_flush_all();
+  checksum_seal();
+  args->path[NUFS_SNAPSHOT_PATH_MAX - 1] = 0;
+  int rv = snapshot_start(args->path);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  args->pause_us = (end.tv_sec - start.tv_sec) * 1000000 +
+                   (end.tv_nsec - start.tv_nsec) / 1000;
+  args->blocks = blocks_total();
+  return rv;
+}
+
+// lists the hottest files (see NUFS_IOC_HEAT)
+int storage_heat(nufs_heat_args_t *args) {
+  if (!opts.heat) {
+    return -ENODATA;
+  }
+  if (args->count == 0) {
+    return -EINVAL;
+  }
+  int count = args->count < NUFS_HEAT_MAX ? args->count : NUFS_HEAT_MAX;
+  int inums[NUFS_HEAT_MAX];
+  heat_stats_t stats[NUFS_HEAT_MAX];
+  count = heat_top(count, inums, stats);
+
+  char *paths[NUFS_HEAT_MAX];
+  for (int i = 0; i < count; i++) {
+    nufs_heat_entry_t *entry = &args->entries[i];
+    inode_t *node = get_inode(inums[i]);
+    entry->inum = inums[i];
+    entry->heat = heat_score(&stats[i]);
+    entry->reads = stats[i].reads;
+    entry->writes = stats[i].writes;
+    entry->bytes_read = stats[i].bytes_read;
+    entry->bytes_written = stats[i].bytes_written;
+    entry->size = node->size;
+    entry->extents = defrag_extents(node);
+    paths[i] = entry->path;
+  }
+  directory_find_paths(inums, paths, count, NUFS_PATH_MAX);
+  args->count = count;
+  args->half_life = HEAT_HALF_LIFE;
+  return 0;
+}
+
+// fills in the filesystem statistics, straight from the superblock counters
+int storage_statfs(struct statvfs *st) {
+  superblock_t *sb = get_superblock();
+  memset(st, 0, sizeof(*st));
+  st->f_bsize = BLOCK_SIZE;
+  st->f_frsize = BLOCK_SIZE;
+  st->f_blocks = blocks_total();
+  st->f_bfree = sb->free_blocks;
+  st->f_bavail = sb->free_blocks;
+  st->f_files = INODE_COUNT;
+  st->f_ffree = sb->free_inodes;
+  st->f_favail = sb->free_inodes;
+  st->f_namemax = DIR_NAME_LENGTH;
+  return 0;
+}
 
-  // then we initialize the root directory if it isn't allocated
-  if (!bitmap_get(get_blocks_bitmap(), 4)) {
-    printf("yay! we made the root directory!!!!");
-    directory_init();
+// grows the image to the given number of blocks while it's mounted
+int storage_grow(int64_t blocks) {
+  if (opts.ro) {
+    return -EROFS;
+  }
+  if (blocks > BLOCK_COUNT) {
+    return -EFBIG;
+  }
+  int rv = blocks_grow(blocks);
+  if (rv == 0) {
+    printf("grew the image to %d blocks\n", blocks_total());
   }
+  return rv;
 }
 
 // check to see if the file is available, if not returns -ENOENT
@@ -55,6 +598,7 @@ int storage_stat(const char *path, struct stat *st) {
     st->st_mode = node->mode;
     st->st_size = node->size;
     st->st_nlink = node->refs;
+    times_stat(node, st);
     return 0;
   }
   return -1;
@@ -62,12 +606,35 @@ int storage_stat(const char *path, struct stat *st) {
 
 // truncates the file to the specified size
 int storage_truncate(const char *path, off_t size) {
-  int inum = tree_lookup(path);
-  inode_t *node = get_inode(inum);
+  if (opts.ro) {
+    return -EROFS;
+  }
+  int inum;
+  while (wait_for_write(inum = tree_lookup(path))) {
+  }
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  return truncate_inode(get_inode(inum), size);
+}
+
+static int truncate_inode(inode_t *node, off_t size) {
+  times_touch(node, TIME_MTIME | TIME_CTIME);
   if (node->size < size) {
-    grow_inode(node, size);
+    if (grow_inode(node, size) < 0) {
+      return -ENOSPC;
+    }
   } else {
-    shrink_inode(node, size);
+    // a compressed cluster can't lose only some of its pages
+    int cluster = size / CLUSTER_SIZE;
+    if (cluster_is_compressed(node, cluster) &&
+        compress_expand(node, cluster) < 0) {
+      return -ENOSPC;
+    }
+    // (a big cut is freed in the background)
+    if (!orphan_truncate(node, size)) {
+      shrink_inode(node, size);
+    }
   }
   return 0;
 }
@@ -75,47 +642,253 @@ int storage_truncate(const char *path, off_t size) {
 // writes data to the file at the specified path
 int storage_write(const char *path, const char *buf, size_t size,
                   off_t offset) {
-  // get the start point with the path
-  inode_t *write_node = get_inode(tree_lookup(path));
-  if (write_node->size < size + offset) {
-    storage_truncate(path, size + offset);
+  if (opts.ro) {
+    return -EROFS;
+  }
+  // get the start point with the path (one write to a file at a time)
+  int inum;
+  while (wait_for_write(inum = tree_lookup(path))) {
+  }
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  inode_t *node = get_inode(inum);
+  // whole blocks of a plain file don't need the lock to be copied in (but
+  // compressed, deduplicated and log files do more to them than that)
+  int rv;
+  if (lock_depth == 1 && !opts.dedup &&
+      !(node->flags & (INODE_COMPRESS | INODE_LOG)) && size >= BLOCK_SIZE &&
+      (off_t)size <= UNLOCKED_BLOCKS * BLOCK_SIZE - offset % BLOCK_SIZE) {
+    rv = write_unlocked(inum, buf, size, offset);
+  } else {
+    rv = write_inode(node, buf, size, offset);
+  }
+  if (opts.heat) {
+    heat_write(inum, rv);
   }
+  return rv;
+}
+
+static int write_inode(inode_t *write_node, const char *buf, size_t size,
+                       off_t offset) {
+  times_touch(write_node, TIME_MTIME | TIME_CTIME);
+  // (pages past the old end got new blocks just now)
+  int old_size = write_node->size;
+  int logging = write_node->flags & INODE_LOG;
+  if (write_node->size < size + offset &&
+      truncate_inode(write_node, size + offset) < 0) {
+    return -ENOSPC;
+  }
+
+  // compressed clusters are rewritten as a whole, so unpack the ones we
+  // touch and pack them up again afterwards
+  int compressing = write_node->flags & INODE_COMPRESS;
+  int first_cluster = offset / CLUSTER_SIZE;
+  int last_cluster = (offset + size - 1) / CLUSTER_SIZE;
+  for (int c = first_cluster; size > 0 && c <= last_cluster; c++) {
+    if (cluster_is_compressed(write_node, c) &&
+        compress_expand(write_node, c) < 0) {
+      return -ENOSPC;
+    }
+  }
+
   int bindex = 0;
   int nindex = offset;
   int rem = size;
+  span_begin("write_copy");
   while (rem > 0) {
-    char *dest = blocks_get_block(inode_get_bnum(write_node, nindex));
-    dest += nindex % 4096;
+    int bnum = inode_get_bnum(write_node, nindex);
     int cpyamnt = min(rem, 4096 - (nindex % 4096));
+
+    // shared blocks are copy-on-write, this file gets its own copy first
+    // (no need to copy the old contents if we overwrite all of them), and
+    // a file in log mode writes every changed block to the log that way
+    if (block_is_shared(bnum) ||
+        (logging && nindex - nindex % 4096 < old_size)) {
+      bnum = unshare_block(write_node, nindex, bnum, cpyamnt < 4096);
+      if (bnum < 0) {
+        span_end();
+        return bindex > 0 ? bindex : -ENOSPC;
+      }
+    }
+
+    char *dest = blocks_get_block(bnum);
+    dest += nindex % 4096;
     memcpy(dest, buf + bindex, cpyamnt);
+    checksum_dirty(bnum);
+
+    // a whole new block might be one we already have
+    if (opts.dedup && !compressing && cpyamnt == 4096) {
+      int same = dedup_block(bnum);
+      if (same != bnum) {
+        inode_set_bnum(write_node, nindex, same);
+        free_block(bnum);
+      }
+    }
+
     bindex += cpyamnt;
     nindex += cpyamnt;
     rem -= cpyamnt;
   }
+  span_end();
+
+  // clusters that aren't full yet stay as they are until they fill up
+  for (int c = first_cluster; compressing && size > 0 && c <= last_cluster;
+       c++) {
+    compress_cluster(write_node, c);
+  }
+  return size;
+}
+
+// Writes to a plain file with the data copied in after the lock is given
+// up, so writers of different files copy at the same time. The blocks are
+// allocated (from the file's window, see reserve.h) and unshared first,
+// and held (see checksum_hold) so nothing checks them halfway through.
+// Everything else that would touch them waits (see wait_for_write).
+static int write_unlocked(int inum, const char *buf, size_t size,
+                          off_t offset) {
+  inode_t *node = get_inode(inum);
+  times_touch(node, TIME_MTIME | TIME_CTIME);
+  if (node->size < size + offset && truncate_inode(node, size + offset) < 0) {
+    return -ENOSPC;
+  }
+  // (clusters packed before the file stopped being compressed)
+  for (int c = offset / CLUSTER_SIZE; c <= (offset + size - 1) / CLUSTER_SIZE;
+       c++) {
+    if (cluster_is_compressed(node, c) && compress_expand(node, c) < 0) {
+      return -ENOSPC;
+    }
+  }
+
+  int first = offset / BLOCK_SIZE;
+  int count = (offset + size - 1) / BLOCK_SIZE - first + 1;
+  int bnums[UNLOCKED_BLOCKS];
+  for (int i = 0; i < count; i++) {
+    off_t start = (off_t)(first + i) * BLOCK_SIZE;
+    bnums[i] = inode_get_bnum(node, start);
+    if (block_is_shared(bnums[i])) {
+      int partial =
+          offset > start || offset + (off_t)size < start + BLOCK_SIZE;
+      bnums[i] = unshare_block(node, start, bnums[i], partial);
+      if (bnums[i] < 0) {
+        return -ENOSPC;
+      }
+    }
+  }
+  // everything changed so far gets its checksum now, the held blocks only
+  // once they're written
+  checksum_seal();
+  for (int i = 0; i < count; i++) {
+    checksum_hold(bnums[i]);
+  }
+  writing[inum] = 1;
+  writes_in_flight++;
+
+  storage_unlock();
+  span_begin("write_copy");
+  int bindex = 0;
+  for (int i = 0; i < count; i++) {
+    int skip = i == 0 ? offset % BLOCK_SIZE : 0;
+    int cpyamnt = min((int)size - bindex, BLOCK_SIZE - skip);
+    memcpy((char *)blocks_get_block(bnums[i]) + skip, buf + bindex, cpyamnt);
+    bindex += cpyamnt;
+  }
+  span_end();
+  storage_lock();
+
+  for (int i = 0; i < count; i++) {
+    checksum_release(bnums[i]);
+  }
+  writing[inum] = 0;
+  writes_in_flight--;
+  pthread_cond_broadcast(&write_cond);
   return size;
 }
 
 // reads data from the file at the specified path
 int storage_read(const char *path, char *buf, size_t size, off_t offset) {
   printf("storage_read called, buffer is\n%s\n", buf);
-  inode_t *node = get_inode(tree_lookup(path));
+  int inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  int rv = read_inode(get_inode(inum), buf, size, offset);
+  if (opts.heat) {
+    heat_read(inum, rv);
+  }
+  return rv;
+}
+
+static int read_inode(inode_t *node, char *buf, size_t size, off_t offset) {
+  if (!opts.ro) {
+    times_touch(node, TIME_ATIME);
+  }
+  // there are no pages past the end of the file to read from
+  if (offset >= node->size) {
+    return 0;
+  }
+  size = min(size, node->size - offset);
+
+  // with a striped image, get every file reading at once
+  if (size > BLOCK_SIZE) {
+    for (int i = offset / BLOCK_SIZE; i <= (offset + size - 1) / BLOCK_SIZE;
+         i++) {
+      if (!cluster_is_compressed(node, i * BLOCK_SIZE / CLUSTER_SIZE)) {
+        blocks_readahead(inode_get_bnum(node, i * BLOCK_SIZE));
+      }
+    }
+  }
+
+  char copy[CLUSTER_SIZE];
+  int copied = -1;
   int bindex = 0;
   int nindex = offset;
   int rem = size;
+  span_begin("read_copy");
   while (rem > 0) {
-    char *src = blocks_get_block(inode_get_bnum(node, nindex));
-    src += nindex % 4096;
+    char *src;
+    int cluster = nindex / CLUSTER_SIZE;
+    if (cluster_is_compressed(node, cluster)) {
+      if (!opts.ro) {
+        src = (char *)compress_read_cluster(node, cluster);
+      } else if (cluster == copied ||
+                 compress_copy_cluster(node, cluster, copy) == 0) {
+        // the cache is shared, readers that don't hold the lock unpack
+        // their own copy
+        copied = cluster;
+        src = copy;
+      } else {
+        src = NULL;
+      }
+      if (src == NULL) {
+        span_end();
+        return bindex > 0 ? bindex : -EIO;
+      }
+      src += nindex % CLUSTER_SIZE;
+    } else {
+      int bnum = inode_get_bnum(node, nindex);
+      if (checksum_verify(bnum) < 0) {
+        span_end();
+        return bindex > 0 ? bindex : -EIO;
+      }
+      src = blocks_get_block(bnum);
+      src += nindex % 4096;
+    }
     int cpyamnt = min(rem, 4096 - (nindex % 4096));
     memcpy(buf + bindex, src, cpyamnt);
     bindex += cpyamnt;
     nindex += cpyamnt;
     rem -= cpyamnt;
   }
+  span_end();
   return size;
 }
 
 // creates a new file node at the specified path
 int storage_mknod(const char *path, int mode) {
+  if (opts.ro) {
+    return -EROFS;
+  }
   // should add a dirent of the correct mode to the
   // directory at the path
 
@@ -124,7 +897,7 @@ int storage_mknod(const char *path, int mode) {
     return -EEXIST;
   }
 
-  char *item = malloc(50);
+  char *item = malloc(strlen(path) + 1);
   char *parent = malloc(strlen(path));
   get_parent_child(path, parent, item);
 
@@ -135,27 +908,61 @@ int storage_mknod(const char *path, int mode) {
     return -ENOENT;
   }
 
-  int new_inode = alloc_inode();
+  int rv = create_entry(get_inode(bnodenum), item, mode, NULL, NULL);
+  free(item);
+  free(parent);
+  return rv < 0 ? rv : 0;
+}
+
+// makes a new inode with the given mode and puts it in the directory under
+// the given name, returns its number. In a batch, the entry goes in through
+// it and *where is set to its position.
+static int create_entry(inode_t *dir, const char *name, int mode,
+                        dir_batch_t *batch, int *where) {
+  int new_inode = alloc_inode(inode_pick_group(inode_num(dir), mode));
+  if (new_inode < 0) {
+    return -ENOSPC;
+  }
   inode_t *node = get_inode(new_inode);
+  inode_dirty(node);
   node->mode = mode;
   node->size = 0;
   node->refs = 1;
-  inode_t *parent_dir = get_inode(bnodenum);
+  if (opts.compress && S_ISREG(mode)) {
+    node->flags |= INODE_COMPRESS;
+  }
+  if (opts.log && S_ISREG(mode)) {
+    node->flags |= INODE_LOG;
+  }
+  if (S_ISDIR(mode)) {
+    directory_new(node);
+  }
 
-  directory_put(parent_dir, item, new_inode);
-  free(item);
-  free(parent);
-  return 0;
+  int rv = batch != NULL ? directory_batch_put(batch, name, new_inode, where)
+                         : directory_put(dir, name, new_inode);
+  if (rv < 0) {
+    decrease_refs(new_inode);
+    return rv;
+  }
+  times_touch(dir, TIME_MTIME | TIME_CTIME);
+  return new_inode;
 }
 
 // removes a link to a file, and deletes the inode if no more references exist
 int storage_unlink(const char *path) {
-  char *nodename = malloc(50);
+  if (opts.ro) {
+    return -EROFS;
+  }
+  // (its blocks may be freed right away)
+  while (wait_for_write(tree_lookup(path))) {
+  }
+  char *nodename = malloc(strlen(path) + 1);
   char *parentpath = malloc(strlen(path));
   get_parent_child(path, parentpath, nodename);
 
   inode_t *parent = get_inode(tree_lookup(parentpath));
   int rv = directory_delete(parent, nodename);
+  times_touch(parent, TIME_MTIME | TIME_CTIME);
 
   free(parentpath);
   free(nodename);
@@ -165,34 +972,495 @@ int storage_unlink(const char *path) {
 
 // creates a hard link from one file to another
 int storage_link(const char *from, const char *to) {
+  if (opts.ro) {
+    return -EROFS;
+  }
   int tnum = tree_lookup(to);
   if (tnum < 0) {
     return tnum;
   }
 
-  char *fname = malloc(50);
+  char *fname = malloc(strlen(from) + 1);
   char *fparent = malloc(strlen(from));
   get_parent_child(from, fparent, fname);
 
   inode_t *bnode = get_inode(tree_lookup(fparent));
-  directory_put(bnode, fname, tnum);
+  int rv = directory_put(bnode, fname, tnum);
+  free(fname);
+  free(fparent);
+  if (rv < 0) {
+    return rv;
+  }
+  times_touch(bnode, TIME_MTIME | TIME_CTIME);
   get_inode(tnum)->refs++;
+  inode_dirty(get_inode(tnum));
+  times_touch(get_inode(tnum), TIME_CTIME);
+  return 0;
+}
+
+// moves the entry fname in fparent to tname in tparent
+static int rename_entry(const char *fparent, const char *fname,
+                        const char *tparent, const char *tname) {
+  int fpnum = tree_lookup(fparent);
+  int tpnum = tree_lookup(tparent);
+  if (fpnum < 0 || tpnum < 0) {
+    return -ENOENT;
+  }
+  inode_t *fdir = get_inode(fpnum);
+  inode_t *tdir = get_inode(tpnum);
+  int snum = directory_lookup(fdir, fname);
+  if (snum < 0) {
+    return -ENOENT;
+  }
+  inode_t *node = get_inode(snum);
+
+  int dnum = directory_lookup(tdir, tname);
+  if (wait_for_write(dnum)) {
+    // (the target's blocks may be freed right away)
+    return rename_entry(fparent, fname, tparent, tname);
+  }
+  if (dnum == snum) {
+    // both names are links to the same file, nothing to do
+    return 0;
+  }
+  if (dnum >= 0) {
+    // the target gets replaced, if it is of the same kind
+    inode_t *target = get_inode(dnum);
+    if (S_ISDIR(node->mode) && !S_ISDIR(target->mode)) {
+      return -ENOTDIR;
+    }
+    if (!S_ISDIR(node->mode) && S_ISDIR(target->mode)) {
+      return -EISDIR;
+    }
+    if (S_ISDIR(target->mode) && !directory_is_empty(target)) {
+      return -ENOTEMPTY;
+    }
+    directory_replace(tdir, tname, snum);
+    directory_remove(fdir, fname);
+    decrease_refs(dnum);
+  } else {
+    // the new entry first, so a failure leaves the old one in place
+    int rv = directory_put(tdir, tname, snum);
+    if (rv < 0) {
+      return rv;
+    }
+    directory_remove(fdir, fname);
+  }
+
+  times_touch(fdir, TIME_MTIME | TIME_CTIME);
+  times_touch(tdir, TIME_MTIME | TIME_CTIME);
+  times_touch(node, TIME_CTIME);
+  return 0;
+}
+
+// renames a file or directory from one path to another, replacing what is
+// at the new path. Only the two directory entries change (there's nothing
+// inside a directory that points back at its parent), and the storage lock
+// means nobody can see the filesystem halfway through.
+int storage_rename(const char *from, const char *to) {
+  if (opts.ro) {
+    return -EROFS;
+  }
+  // a directory can't be moved inside itself
+  size_t from_len = strlen(from);
+  if (strncmp(from, to, from_len) == 0 && to[from_len] == '/') {
+    return -EINVAL;
+  }
+
+  char *fname = malloc(strlen(from) + 1);
+  char *fparent = malloc(strlen(from));
+  char *tname = malloc(strlen(to) + 1);
+  char *tparent = malloc(strlen(to));
+  get_parent_child(from, fparent, fname);
+  get_parent_child(to, tparent, tname);
+
+  int rv = rename_entry(fparent, fname, tparent, tname);
 
   free(fname);
   free(fparent);
+  free(tname);
+  free(tparent);
+  return rv;
+}
+
+// gets the INODE_* flags of the file at the path
+int storage_get_flags(const char *path, int *flags) {
+  int inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  *flags = get_inode(inum)->flags;
   return 0;
 }
 
-// renames a file from one path to another
-int storage_rename(const char *from, const char *to) {
-  storage_link(to, from);
-  storage_unlink(from);
+// sets the INODE_* flags of the file at the path, data that is already
+// stored keeps its form until it's written again
+int storage_set_flags(const char *path, int flags) {
+  if (opts.ro) {
+    return -EROFS;
+  }
+  int inum;
+  while (wait_for_write(inum = tree_lookup(path))) {
+  }
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  if (flags & ~(INODE_COMPRESS | INODE_LOG)) {
+    return -EOPNOTSUPP;
+  }
+  get_inode(inum)->flags = flags;
+  inode_dirty(get_inode(inum));
+  times_touch(get_inode(inum), TIME_CTIME);
+  return 0;
+}
+
+// makes the file at dst a copy of the file at src that shares all of its
+// blocks, so only the pointers get copied (the blocks are copy-on-write)
+int storage_clone(const char *src, const char *dst) {
+  if (opts.ro) {
+    return -EROFS;
+  }
+  int snum, dnum;
+  do {
+    snum = tree_lookup(src);
+    dnum = tree_lookup(dst);
+  } while (wait_for_write(snum) || wait_for_write(dnum));
+  if (snum < 0 || dnum < 0) {
+    return -ENOENT;
+  }
+  if (snum == dnum) {
+    return 0;
+  }
+  inode_t *snode = get_inode(snum);
+  inode_t *dnode = get_inode(dnum);
+  if (!S_ISREG(snode->mode) || !S_ISREG(dnode->mode)) {
+    return -EINVAL;
+  }
+
+  // start out empty, with only the first page slot in use
+  inode_dirty(dnode);
+  int rv = truncate_inode(dnode, 0);
+  if (rv < 0) {
+    return rv;
+  }
+
+  int last = snode->size / 4096;
+  if (last >= nptrs && dnode->iptr == 0) {
+    dnode->iptr = inode_alloc_block(dnode, nptrs);
+    if (dnode->iptr < 0) {
+      dnode->iptr = 0;
+      return -ENOSPC;
+    }
+    // so that share_page doesn't take the old contents for blocks
+    memset(blocks_get_block(dnode->iptr), 0, 4096);
+    checksum_dirty(dnode->iptr);
+    journal_dirty(dnode->iptr);
+  }
+
+  // compressed cluster slots are copied as they are, which shares the
+  // compressed stream as well
+  for (int i = 0; i <= last; i++) {
+    if (share_page(dnode, i * 4096, inode_get_bnum(snode, i * 4096)) < 0) {
+      // give back the pages we already took
+      dnode->size = i > 0 ? (i - 1) * 4096 : 0;
+      truncate_inode(dnode, 0);
+      return -ENOSPC;
+    }
+  }
+  dnode->size = snode->size;
+  times_touch(dnode, TIME_MTIME | TIME_CTIME);
+  return 0;
+}
+
+// copies len bytes from src at src_off to dst at dst_off, returns the number
+// of bytes copied
+int storage_copy_range(const char *src, off_t src_off, const char *dst,
+                       off_t dst_off, size_t len) {
+  if (opts.ro) {
+    return -EROFS;
+  }
+  int snum, dnum;
+  do {
+    snum = tree_lookup(src);
+    dnum = tree_lookup(dst);
+  } while (wait_for_write(snum) || wait_for_write(dnum));
+  if (snum < 0 || dnum < 0) {
+    return -ENOENT;
+  }
+  inode_t *snode = get_inode(snum);
+  inode_t *dnode = get_inode(dnum);
+  if (!S_ISREG(snode->mode) || !S_ISREG(dnode->mode)) {
+    return -EINVAL;
+  }
+
+  if (src_off >= snode->size) {
+    return 0;
+  }
+  len = min(len, snode->size - src_off);
+  if (snum == dnum && src_off < dst_off + len && dst_off < src_off + len) {
+    return -EINVAL;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  if (dnode->size < dst_off + len) {
+    int rv = truncate_inode(dnode, dst_off + len);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+
+  // when both sides line up with pages, whole pages can just be shared
+  // (unless they need to be packed into compressed clusters)
+  size_t done = 0;
+  if (src_off % 4096 == 0 && dst_off % 4096 == 0 &&
+      !(dnode->flags & INODE_COMPRESS)) {
+    while (len - done >= 4096) {
+      off_t soff = src_off + done;
+      off_t doff = dst_off + done;
+      if (cluster_is_compressed(snode, soff / CLUSTER_SIZE) ||
+          cluster_is_compressed(dnode, doff / CLUSTER_SIZE) ||
+          share_page(dnode, doff, inode_get_bnum(snode, soff)) < 0) {
+        break;
+      }
+      done += 4096;
+    }
+  }
+
+  // everything else goes through a bounce buffer a page at a time
+  char page[4096];
+  while (done < len) {
+    int n = read_inode(snode, page, min(len - done, 4096), src_off + done);
+    if (n <= 0) {
+      break;
+    }
+    int rv = write_inode(dnode, page, n, dst_off + done);
+    if (rv < 0) {
+      return done > 0 ? done : rv;
+    }
+    done += n;
+  }
+  return done;
+}
+
+// sets the access and modification times of the file at the path (either
+// can be UTIME_NOW or UTIME_OMIT)
+int storage_set_time(const char *path, const struct timespec ts[2]) {
+  if (opts.ro) {
+    return -EROFS;
+  }
+  int inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  inode_t *node = get_inode(inum);
+
+  // anything recorded earlier would overwrite the new times later
+  times_flush(node);
+  inode_dirty(node);
+  uint32_t now = time(NULL);
+  uint32_t *fields[2] = {&node->atime, &node->mtime};
+  for (int i = 0; i < 2; i++) {
+    if (ts[i].tv_nsec == UTIME_NOW) {
+      *fields[i] = now;
+    } else if (ts[i].tv_nsec != UTIME_OMIT) {
+      *fields[i] = ts[i].tv_sec;
+    }
+  }
+  node->ctime = now;
+  return 0;
+}
+
+// writes out the timestamps of the file at the path and flushes the image
+// to disk
+int storage_fsync(const char *path) {
+  if (opts.ro) {
+    return 0;
+  }
+  int inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  times_flush(get_inode(inum));
+  checksum_seal();
+  return blocks_sync();
+}
+
+// called when the file at the path is closed, its timestamps get written
+// out like lazytime does when an inode leaves the cache
+int storage_release(const char *path) {
+  if (opts.ro) {
+    return 0;
+  }
+  int inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  times_flush(get_inode(inum));
+  // the file is done growing for now
+  reserve_release(inum);
+  return 0;
+}
+
+// runs a batch of creates, stats and unlinks on names in the directory at
+// the path. The directory is looked up once and all of the names in a
+// single pass over it, then the operations run in order, unlinks going
+// straight to the entries that pass found and creates picking up the search
+// for free space where the last one left off (see dir_batch_t).
+int storage_batch(const char *path, nufs_batch_t *batch) {
+  int dnum = tree_lookup(path);
+  if (dnum < 0) {
+    return -ENOENT;
+  }
+  inode_t *dir = get_inode(dnum);
+  if (!S_ISDIR(dir->mode)) {
+    return -ENOTDIR;
+  }
+  if (batch->count > NUFS_BATCH_MAX) {
+    return -EINVAL;
+  }
+  if (batch->count == 0) {
+    return 0;
+  }
+
+  int count = batch->count;
+  const char *names[NUFS_BATCH_MAX];
+  int inums[NUFS_BATCH_MAX];
+  int where[NUFS_BATCH_MAX];
+  batch->names[NUFS_BATCH_NAMES - 1] = 0;
+  for (int i = 0; i < count; i++) {
+    nufs_batch_op_t *op = &batch->ops[i];
+    names[i] = op->name < NUFS_BATCH_NAMES ? batch->names + op->name : NULL;
+    if (names[i] != NULL && (names[i][0] == 0 || strchr(names[i], '/'))) {
+      names[i] = NULL;
+    }
+  }
+  directory_lookup_many(dir, names, count, inums, where);
+  for (int i = 0; i < count; i++) {
+    if (wait_for_write(inums[i])) {
+      // (the directory may have changed in the meantime)
+      directory_lookup_many(dir, names, count, inums, where);
+      i = -1;
+    }
+  }
+
+  dir_batch_t changes;
+  directory_batch_begin(&changes, dir);
+  for (int i = 0; i < count; i++) {
+    nufs_batch_op_t *op = &batch->ops[i];
+    int inum = inums[i];
+    int pos = where[i];
+    if (names[i] == NULL) {
+      op->result = -EINVAL;
+      continue;
+    }
+
+    if (opts.ro && op->op != NUFS_BATCH_STAT) {
+      op->result = -EROFS;
+      continue;
+    }
+    switch (op->op) {
+    case NUFS_BATCH_CREATE:
+      op->result = inum >= 0 ? -EEXIST
+                             : create_entry(dir, names[i], op->mode, &changes,
+                                            &pos);
+      inum = op->result;
+      break;
+    case NUFS_BATCH_STAT:
+      if (inum < 0) {
+        op->result = -ENOENT;
+      } else {
+        inode_t *node = get_inode(inum);
+        struct stat st;
+        times_stat(node, &st);
+        op->mode = node->mode;
+        op->size = node->size;
+        op->nlink = node->refs;
+        op->atime = st.st_atime;
+        op->mtime = st.st_mtime;
+        op->ctime = st.st_ctime;
+        op->result = 0;
+      }
+      break;
+    case NUFS_BATCH_UNLINK:
+      if (inum < 0) {
+        op->result = -ENOENT;
+      } else if (S_ISDIR(get_inode(inum)->mode)) {
+        op->result = -EISDIR;
+      } else {
+        directory_batch_remove(&changes, names[i], pos);
+        decrease_refs(inum);
+        times_touch(dir, TIME_MTIME | TIME_CTIME);
+        op->result = 0;
+        inum = -1;
+        pos = -1;
+      }
+      break;
+    default:
+      op->result = -EINVAL;
+      continue;
+    }
+
+    // later operations on the same name see what this one did
+    if (op->result >= 0 && op->op != NUFS_BATCH_STAT) {
+      for (int j = i + 1; j < count; j++) {
+        if (names[j] != NULL && strcmp(names[j], names[i]) == 0) {
+          inums[j] = inum;
+          where[j] = pos;
+        }
+      }
+    }
+    if (op->result > 0) {
+      op->result = 0;
+    }
+  }
+  directory_batch_end(&changes);
   return 0;
 }
 
 // lists the contents of a directory
 slist_t *storage_list(const char *path) { return directory_list(path); }
 
+// gives the file its own copy of a shared block, returns the new block
+// (keep says whether the old contents are still needed)
+static int unshare_block(inode_t *node, int offset, int bnum, int keep) {
+  int copy = inode_alloc_block(node, offset / 4096);
+  if (copy < 0) {
+    return -1;
+  }
+  if (keep) {
+    memcpy(blocks_get_block(copy), blocks_get_block(bnum), 4096);
+    checksum_dirty(copy);
+  }
+  inode_set_bnum(node, offset, copy);
+  // only drops our reference, the other owners still have it
+  free_block(bnum);
+  return copy;
+}
+
+// points a page of the file at a block another file owns too, replacing
+// whatever block it had (compressed cluster slots, which aren't blocks, are
+// just copied)
+static int share_page(inode_t *node, int offset, int bnum) {
+  if (bnum > 0 && share_block(bnum) < 0) {
+    // the block has as many owners as it can count, so copy it instead
+    int copy = alloc_block();
+    if (copy < 0) {
+      return -1;
+    }
+    memcpy(blocks_get_block(copy), blocks_get_block(bnum), 4096);
+    checksum_dirty(copy);
+    bnum = copy;
+  }
+
+  int old = inode_get_bnum(node, offset);
+  inode_set_bnum(node, offset, bnum);
+  if (old > 0) {
+    free_block(old);
+  }
+  return 0;
+}
+
 // helper function to get the parent directory and child name from a path
 static void get_parent_child(const char *path, char *parent, char *child) {
   slist_t *flist = slist_explode(path, '/');
@@ -201,7 +1469,7 @@ static void get_parent_child(const char *path, char *parent, char *child) {
   while (fdir->next != NULL) {
     // 2 for null terminator
     strncat(parent, "/", 2);
-    strncat(parent, fdir->data, 48);
+    strncat(parent, fdir->data, DIR_NAME_LENGTH);
     fdir = fdir->next;
   }
   memcpy(child, fdir->data, strlen(fdir->data));
@@ -211,17 +1479,21 @@ static void get_parent_child(const char *path, char *parent, char *child) {
 
 // removes a directory if it is empty
 int storage_rmdir(const char *path) {
+  if (opts.ro) {
+    return -EROFS;
+  }
   slist_t *contents = storage_list(path);
   if (contents != NULL && contents->next != NULL) {
     slist_free(contents);
     return -ENOTEMPTY;
   }
-  char *nodename = malloc(50);
+  char *nodename = malloc(strlen(path) + 1);
   char *parentpath = malloc(strlen(path));
   get_parent_child(path, parentpath, nodename);
 
   inode_t *parent = get_inode(tree_lookup(parentpath));
   int rv = directory_delete(parent, nodename);
+  times_touch(parent, TIME_MTIME | TIME_CTIME);
 
   free(parentpath);
   free(nodename);
@@ -8,13 +8,44 @@
 #define NUFS_STORAGE_H
 
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "nufs_ioctl.h"
 #include "slist.h"
 
-void storage_init(const char *path);
+// mount-time options for the storage layer
+typedef struct storage_opts {
+  int dedup;    // share identical full blocks between files
+  int compress; // compress new regular files
+  int scrub;    // seconds between background checksum scrubs, 0 for none
+  int lazytime; // seconds between timestamp writebacks, 0 writes right away
+  int stripe_unit; // blocks per stripe for a new striped image, 0 for default
+  int punch;    // seconds between giving freed blocks back, 0 for never
+  int defrag;   // seconds between background defrag passes, 0 for none
+  int log;      // new regular files write to the log (see segment.h)
+  int clean;    // seconds between segment cleaning passes, 0 for none
+  int ro;       // the image is only read, maybe by several mounts at once
+  int heat;     // keep per-file access counters (see heat.h)
+  int journal;  // metadata changes go through the journal (see journal.h)
+} storage_opts_t;
+
+#define LAZYTIME_DEFAULT 30
+#define PUNCH_DEFAULT 5
+#define CLEAN_DEFAULT 10
+
+void storage_init(const char *path, const storage_opts_t *opts);
+void storage_format();
+void storage_start();
+void storage_stop();
+// every operation on the filesystem has to hold the storage lock (which
+// does nothing for a read-only image)
+void storage_lock();
+void storage_unlock();
+int storage_statfs(struct statvfs *st);
+int storage_grow(int64_t blocks);
 int storage_access(const char *path); // new
 int storage_stat(const char *path, struct stat *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
@@ -25,7 +56,19 @@ int storage_unlink(const char *path);
 int storage_link(const char *from, const char *to);
 int storage_rename(const char *from, const char *to);
 int storage_set_time(const char *path, const struct timespec ts[2]);
+int storage_fsync(const char *path);
+int storage_release(const char *path);
 int storage_rmdir(const char *path); // new
+int storage_get_flags(const char *path, int *flags);
+int storage_set_flags(const char *path, int flags);
+int storage_clone(const char *src, const char *dst);
+int storage_copy_range(const char *src, off_t src_off, const char *dst,
+                       off_t dst_off, size_t len);
+
+int storage_batch(const char *path, nufs_batch_t *batch);
+int storage_defrag(nufs_defrag_args_t *args);
+int storage_snapshot(nufs_snapshot_args_t *args);
+int storage_heat(nufs_heat_args_t *args);
 
 slist_t *storage_list(const char *path);
 
@@ -2,11 +2,14 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 75;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts, $image) = @_;
+    $opts = $opts ? "MOUNT_OPTS='-o $opts'" : "";
+    $opts .= " IMAGE=$image" if $image;
+    system("(make mount $opts 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -31,6 +34,62 @@ sub read_text {
     return $data;
 }
 
+# flips a bit of the first byte of the image that starts with the pattern
+# (the image has to be unmounted), returns where that was or -1
+sub corrupt_image {
+    my ($pattern) = @_;
+    open my $fh, "+<", "data.nufs" or return -1;
+    binmode $fh;
+    local $/ = undef;
+    my $image = <$fh>;
+    my $at = index($image, $pattern);
+    if ($at >= 0) {
+        seek $fh, $at, 0;
+        print $fh chr(ord(substr($image, $at, 1)) ^ 1);
+    }
+    close $fh;
+    return $at;
+}
+
+sub read_raw {
+    my ($name) = @_;
+    open my $fh, "<", "mnt/$name" or return "";
+    local $/ = undef;
+    my $data = <$fh> // "";
+    close $fh;
+    return $data;
+}
+
+sub write_raw {
+    my ($name, $data) = @_;
+    open my $fh, ">", "mnt/$name" or return;
+    syswrite($fh, $data);
+    close $fh;
+}
+
+# the inode number and blocks of a file in the unmounted image, found by
+# its name (which has to be in no other directory entry), for the default
+# geometry: the inode table starts after the 32 byte block and inode
+# bitmaps, with 40 byte inodes
+sub image_file_blocks {
+    my ($name) = @_;
+    open my $fh, "<", "data.nufs" or return;
+    binmode $fh;
+    local $/ = undef;
+    my $image = <$fh>;
+    close $fh;
+    my $at = index($image, $name);
+    return if $at < 8 || ord(substr($image, $at - 2, 1)) != length($name);
+    my $inum = unpack("l<", substr($image, $at - 8, 4));
+    my ($size, @ptrs) = unpack("l<4", substr($image, 64 + 40 * $inum + 8, 16));
+    my $iptr = pop @ptrs;
+    my $slots = int($size / 4096) + 1;
+    for my $i (2 .. $slots - 1) {
+        push @ptrs, unpack("l<", substr($image, $iptr * 4096 + 4 * ($i - 2), 4));
+    }
+    return ($inum, @ptrs[0 .. $slots - 1]);
+}
+
 sub read_text_slice {
     my ($name, $count, $offset) = @_;
     open my $fh, "<", "mnt/$name" or return "";
@@ -171,5 +230,396 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
 
+say "# Deduplication";
+
+unmount();
+mount("dedup");
+my $blocks = join("", map { chr(97 + $_) x 4096 } 0 .. 7);
+write_text("dup_a.txt", $blocks);
+my $free_one = `stat -f -c %f mnt`;
+write_text("dup_b.txt", $blocks);
+my $free_two = `stat -f -c %f mnt`;
+say "# free blocks: $free_one -> $free_two";
+ok($free_one - $free_two <= 2, "Identical blocks of two files are shared");
+open my $dup, "+<", "mnt/dup_b.txt";
+seek $dup, 3 * 4096, 0;
+syswrite($dup, "changed");
+close $dup;
+my $changed = $blocks;
+substr($changed, 3 * 4096, 7) = "changed";
+ok(read_text("dup_b.txt") eq $changed && read_text("dup_a.txt") eq $blocks,
+   "Writing to a shared block copies it and leaves the other file alone");
+unmount();
+
+say "# Compression";
+
+mount("compress");
+my $packed = substr("compress me " x 6000, 0, 16 * 4096);
+my $free_unpacked = `stat -f -c %f mnt`;
+write_raw("packed.txt", $packed);
+my $free_packed = `stat -f -c %f mnt`;
+say "# free blocks: $free_unpacked -> $free_packed";
+my $noise = join("", map { chr(int(rand(256))) } 1 .. 8 * 4096);
+write_raw("noise.txt", $noise);
+my $overwritten = $packed;
+write_raw("partial.txt", $packed);
+open my $part, "+<", "mnt/partial.txt";
+seek $part, 5 * 4096 + 100, 0;
+syswrite($part, "overwritten");
+close $part;
+substr($overwritten, 5 * 4096 + 100, 11) = "overwritten";
+# (after a remount the clusters have to be unpacked, not read from the cache)
+unmount();
+mount("compress");
+ok($free_unpacked - $free_packed < 16 && read_raw("packed.txt") eq $packed,
+   "Compressible data takes fewer blocks and reads back");
+ok(read_raw("noise.txt") eq $noise, "Incompressible data reads back");
+ok(read_raw("partial.txt") eq $overwritten,
+   "Overwriting part of a compressed cluster keeps the rest of it");
+unmount();
+mount();
+
+say "# Clones";
+
+my $orig = "clone me please " x 1024;
+write_text("orig.txt", $orig);
+system("./nufsctl clone mnt/orig.txt mnt/clone.txt");
+ok(read_text("clone.txt") eq $orig, "Clone has the same contents");
+write_text("clone.txt", "changed");
+ok(read_text("orig.txt") eq $orig, "Writing to a clone leaves the original alone");
+
+say "# statfs";
+
+my $free0 = `stat -f -c %f mnt`;
+write_text("filler.txt", "x" x 20000);
+my $free1 = `stat -f -c %f mnt`;
+say "# free blocks: $free0 -> $free1";
+ok($free1 < $free0, "Writing a file uses up free blocks");
+
+unmount();
+
+say "# mkfs and fsck";
+
+system("./fsck.nufs data.nufs >> test.log");
+ok($? == 0, "fsck finds nothing wrong after using the filesystem");
+system("rm -f data.nufs && ./mkfs.nufs data.nufs >> test.log");
+mount();
+write_text("fresh.txt", "made by mkfs");
+ok(read_text("fresh.txt") eq "made by mkfs", "An image from mkfs.nufs mounts");
+
+say "# Timestamps";
+
+system("touch -m -d \@1000000000 mnt/fresh.txt");
+ok(`stat -c %Y mnt/fresh.txt` == 1000000000, "touch sets the modification time");
+write_text("fresh.txt", "changed");
+ok(`stat -c %Y mnt/fresh.txt` > 1000000000, "Writing updates the modification time");
+
+say "# Long names";
+
+my $long = ("long_name_" x 20) . ".txt";
+write_text($long, "still here");
+ok(read_text($long) eq "still here", "A 204 character name isn't cut short");
+
+# (inside a directory of its own, so the parent has room for the entry)
+mkdir("mnt/blocks");
+my $free_dir0 = `stat -f -c %f mnt`;
+mkdir("mnt/blocks/sub");
+my $free_dir1 = `stat -f -c %f mnt`;
+write_text("blocks/sub/first.txt", "");
+my $free_dir2 = `stat -f -c %f mnt`;
+say "# free blocks: $free_dir0 -> $free_dir1 -> $free_dir2";
+ok($free_dir0 - $free_dir1 == 1, "A new directory takes one block");
+ok($free_dir1 - $free_dir2 == 1,
+   "The first entry goes in a new directory's block");
+
+say "# Rename";
+
+write_text("new.tmp", "new contents");
+rename("mnt/new.tmp", "mnt/fresh.txt");
+ok(read_text("fresh.txt") eq "new contents" && !-e "mnt/new.tmp",
+   "Renaming over a file replaces it");
+mkdir("mnt/from");
+write_text("from/inside.txt", "moved along");
+mkdir("mnt/to");
+rename("mnt/from", "mnt/to/moved");
+ok(read_text("to/moved/inside.txt") eq "moved along" && !-e "mnt/from",
+   "Renaming a directory moves what's in it");
+
+say "# Batches";
+
+system("./bench_batch mnt 20 >> test.log");
+ok($? == 0 && !-e "mnt/bench0", "Batched creates, stats and unlinks work");
+unmount();
+
+say "# Trace, replay and spans";
+
+system("cp data.nufs replay.nufs");
+mount("trace=test.trace,spans=test.json,span_rate=1");
+write_text("traced.txt", "recorded");
+read_text("traced.txt");
+mkdir("mnt/traced");
+rename("mnt/traced.txt", "mnt/traced/moved.txt");
+unlink("mnt/traced/moved.txt");
+rmdir("mnt/traced");
+unmount();
+ok(-s "test.trace" > 8, "Operations are recorded to the trace");
+system("./nufs-replay test.trace replay.nufs >> test.log");
+ok($? == 0, "Replaying the trace gives the same results");
+my $spans = `cat test.json`;
+ok($spans =~ /"name":"write".*"name":"write_copy"/s && $spans =~ /\]\s*$/,
+   "Spans are written as a Chrome trace");
+system("rm -f test.trace test.json replay.nufs");
+
+say "# Striping";
+
+system("./mkfs.nufs -u 4 s0.nufs,s1.nufs,s2.nufs >> test.log");
+mount("", "s0.nufs,s1.nufs,s2.nufs");
+my $striped = "0123456789abcdef" x 16384;
+write_text("striped.txt", $striped);
+unmount();
+mount("", "s0.nufs,s1.nufs,s2.nufs");
+ok(read_text("striped.txt") eq $striped, "Read back a file striped over 3 images");
+unmount();
+system("./fsck.nufs s0.nufs,s1.nufs,s2.nufs >> test.log");
+ok($? == 0 && -s "s1.nufs" == -s "s2.nufs", "fsck checks a striped image");
+system("rm -f s0.nufs s1.nufs s2.nufs");
+
+say "# Deleting big files";
+
+mount();
+my $free_before = `stat -f -c %f mnt`;
+write_text("doomed.txt", "d" x (400 * 1024));
+system("rm -f mnt/doomed.txt");
+sleep 2;
+ok(`stat -f -c %f mnt` == $free_before,
+   "The blocks of a deleted file are freed in the background");
+
+say "# Log mode";
+
+unmount();
+mount("log");
+my $table = join("", map { chr(97 + $_ % 26) x 4096 } 0 .. 31);
+write_text("table.db", $table);
+open my $db, "+<", "mnt/table.db";
+for my $page (7, 3, 29, 12) {
+    seek $db, $page * 4096 + 100, 0;
+    syswrite($db, "row $page");
+    substr($table, $page * 4096 + 100, length("row $page")) = "row $page";
+}
+close $db;
+ok(read_text("table.db") eq $table, "Overwrites in log mode read back right");
+unmount();
+
+say "# Read-only";
+
+mount("ro");
+write_text("nope.txt", "not here");
+ok(read_text("table.db") eq $table && !-e "mnt/nope.txt",
+   "A read-only mount reads but doesn't write");
+unmount();
+mount();
+
+say "# Punching holes";
+
+write_text("huge.txt", "x" x (512 * 1024));
+my ($before) = split /\s+/, `du -k data.nufs`;
+system("rm -f mnt/huge.txt");
+unmount();
+my ($after) = split /\s+/, `du -k data.nufs`;
+ok($after < $before - 256, "Deleted data doesn't take up space in the image");
+
+say "# Checksums";
+
+system("rm -f data.nufs");
+mount();
+write_text("csum.txt", "corrupt me " x 400);
+write_text("csum_probe.txt", "in a corrupt directory");
+unmount();
+my $data_at = corrupt_image("corrupt me corrupt me");
+my $dir_at = corrupt_image("csum_probe.txt");
+my $log_start = -s "test.log";
+mount("scrub=1");
+open my $cf, "<", "mnt/csum.txt";
+my $got = sysread($cf, my $cbuf, 4096);
+my $eio = !defined($got) && $!{EIO};
+close $cf;
+ok($data_at >= 0 && $eio, "Reading a corrupted block fails with EIO");
+# (looking the name up reads the directory block)
+-e "mnt/csum_probe.txt";
+sleep 2;
+unmount();
+open my $lf, "<", "test.log";
+seek $lf, $log_start, 0;
+my $log = do { local $/ = undef; <$lf> };
+close $lf;
+my %scrubbed = map { $_ => 1 } $log =~ /scrub: block (\d+) is corrupt/g;
+ok($dir_at >= 0 && $log =~ /directory block \d+ failed its checksum/ &&
+   keys %scrubbed == 2,
+   "Scrub reports the corrupted data and directory blocks");
+
+say "# Growing";
+
+system("rm -f data.nufs && ./mkfs.nufs -s 64 data.nufs >> test.log");
+mount();
+system("./nufsctl grow mnt 256 >> test.log");
+ok($? == 0 && `stat -f -c %b mnt` == 256, "Grow the image while mounted");
+my $grown = "y" x (600 * 1024);
+write_text("grown.txt", $grown);
+ok(read_text("grown.txt") eq $grown, "The new blocks can be used");
+unmount();
+
+say "# Block groups";
+
+# (64 blocks and 64 inodes to a group)
+system("rm -f data.nufs");
+mount();
+mkdir "mnt/grp";
+write_text("grp/home.txt", "h" x (3 * 4096));
+my $spilled = "s" x (100 * 4096);
+write_text("grp/spill.txt", $spilled);
+my $spill_read = read_text("grp/spill.txt");
+unmount();
+my ($home_inum, @home) = image_file_blocks("home.txt");
+ok(defined $home_inum && !grep({ int($_ / 64) != int($home_inum / 64) } @home),
+   "A new file's blocks are in its inode's group");
+my ($spill_inum, @spill) = image_file_blocks("spill.txt");
+my %spill_groups = map { int($_ / 64) => 1 } @spill;
+ok($spill_read eq $spilled && defined $spill_inum &&
+   int($spill[0] / 64) == int($spill_inum / 64) && keys %spill_groups > 1,
+   "A file that fills its group spills over into the others");
+
+say "# Writing side by side";
+
+system("rm -f data.nufs");
+mount();
+open my $fs, ">", "mnt/side_solo.txt";
+syswrite($fs, "s" x 4096) for 0 .. 11;
+close $fs;
+my ($solo) = `./nufsctl frag mnt` =~ /(\d+) extents in all/;
+# two files written in turns each fill their own reserved window
+open my $sa, ">", "mnt/side_a.txt";
+open my $sb, ">", "mnt/side_b.txt";
+for my $i (0 .. 11) {
+    syswrite($sa, "a" x 4096);
+    syswrite($sb, "b" x 4096);
+}
+close $sa;
+close $sb;
+my ($side) = `./nufsctl frag mnt` =~ /(\d+) extents in all/;
+ok($solo && $side == 3 * $solo,
+   "Files written in turns have as few extents as one written alone");
+unmount();
+
+# without -s, writes to different files copy their data at the same time
+system("rm -f data.nufs");
+system("(./nufs -f mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+my @writers;
+for my $w (0 .. 3) {
+    my $pid = fork();
+    if ($pid == 0) {
+        open my $fh, ">", "mnt/par_$w.txt";
+        syswrite($fh, chr(97 + $w) x 16384) for 0 .. 3;
+        close $fh;
+        exit 0;
+    }
+    push @writers, $pid;
+}
+waitpid($_, 0) for @writers;
+ok(!grep({ read_text("par_$_.txt") ne chr(97 + $_) x 65536 } 0 .. 3),
+   "Parallel writers' data reads back");
+unmount();
+
+say "# Defragmenting";
+
+system("rm -f data.nufs");
+mount();
+# two files growing at the same time get their blocks mixed up (once they
+# outgrow their reserved windows)
+open my $fa, ">", "mnt/frag_a.txt";
+open my $fb, ">", "mnt/frag_b.txt";
+for my $i (0 .. 39) {
+    syswrite($fa, chr(97 + $i % 26) x 4096);
+    syswrite($fb, chr(65 + $i % 26) x 4096);
+}
+close $fa;
+close $fb;
+my $report = `./nufsctl frag mnt`;
+system("./nufsctl defrag mnt >> test.log");
+my $after_defrag = `./nufsctl frag mnt`;
+ok($report =~ /([1-9]\d*) in more than one extent/ &&
+   $after_defrag =~ / 0 in more than one extent/,
+   "Defragmenting puts files into one extent");
+ok(read_text("frag_a.txt") eq join("", map { chr(97 + $_ % 26) x 4096 } 0 .. 39),
+   "Defragmented files keep their data");
+unmount();
+
+say "# Snapshots";
+
+system("rm -f data.nufs snap.nufs");
+mount();
+write_text("before.txt", "in the snapshot");
+system("./nufsctl snapshot mnt snap.nufs >> test.log");
+ok($? == 0 && -e "snap.nufs", "Snapshot a mounted image");
+write_text("before.txt", "changed afterwards");
+write_text("after.txt", "not in the snapshot");
+unmount();
+system("./fsck.nufs snap.nufs >> test.log");
+my $snap_clean = $? == 0;
+mount("", "snap.nufs");
+ok($snap_clean && read_text("before.txt") eq "in the snapshot" &&
+   !-e "mnt/after.txt", "A snapshot has the image as it was");
+unmount();
+system("rm -f snap.nufs");
+
+say "# Heat";
+
+mount("heat");
+write_text("cold.txt", "cold");
+write_text("hot.txt", "hot" x 1000);
+read_text("hot.txt") for 1 .. 5;
+my ($hottest) = grep { /\// } split /\n/, `./nufsctl heat mnt 1`;
+ok($hottest =~ m{ /hot\.txt$}, "The most read file is the hottest");
+system("./nufsctl heat mnt 0 >> test.log 2>&1");
+ok($? != 0 && read_text("hot.txt") eq "hot" x 1000,
+   "Asking for the 0 hottest files is an error");
+unmount();
+
+say "# Journal";
+
+mount("journal");
+mkdir "mnt/journaled";
+write_text("journaled/a.txt", "a" x 5000);
+system("mv mnt/journaled/a.txt mnt/journaled/b.txt");
+unmount();
+system("./fsck.nufs data.nufs >> test.log");
+my $journal_clean = $? == 0;
+mount();
+ok($journal_clean && read_text("journaled/b.txt") eq "a" x 5000 &&
+   !-e "mnt/journaled/a.txt", "Metadata changes go through the journal");
+unmount();
+
+say "# Packing";
+
+system("rm -rf pack.src && mkdir -p pack.src/docs/old pack.src/empty");
+my %packed = ("top.txt" => "on top", "docs/a.txt" => "a" x 10000,
+              "docs/old/b.txt" => "b" x 30000);
+for my $name (keys %packed) {
+    open my $fh, ">", "pack.src/$name";
+    print $fh $packed{$name};
+    close $fh;
+}
+system("./nufs-pack -s 128 pack.src packed.nufs >> test.log");
+system("./fsck.nufs packed.nufs >> test.log");
+ok($? == 0 && -s "packed.nufs" == 128 * 4096, "nufs-pack makes a clean image");
+mount("", "packed.nufs");
+ok(!(grep { read_text($_) ne $packed{$_} } keys %packed) && -d "mnt/empty",
+   "A packed image has the files of the directory");
+unmount();
+system("rm -rf pack.src packed.nufs");
@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <time.h>
+
+#include "inode.h"
+#include "times.h"
+
+// times not written to the inode table yet, TIME_* bits in changed[] say
+// which ones, the inodes with any are in order in the list
+#define TIME_LISTED 0x80
+static uint32_t pending[INODE_COUNT][3];
+static uint8_t changed[INODE_COUNT];
+static int list[INODE_COUNT];
+static int list_count = 0;
+static int lazy = 1;
+
+// relatime: a day before the access time gets updated anyway
+#define ATIME_MAX_AGE (24 * 60 * 60)
+
+static int inum_of(inode_t *node) { return node - get_inode(0); }
+
+// the time as it will be once everything is written
+static uint32_t current(inode_t *node, int inum, int field) {
+  if (changed[inum] & (1 << field)) {
+    return pending[inum][field];
+  }
+  uint32_t *stored[3] = {&node->atime, &node->mtime, &node->ctime};
+  return *stored[field];
+}
+
+void times_init(int lazy_writes) {
+  lazy = lazy_writes;
+  for (int i = 0; i < INODE_COUNT; i++) {
+    changed[i] = 0;
+  }
+  list_count = 0;
+}
+
+void times_touch(inode_t *node, int which) {
+  int inum = inum_of(node);
+  uint32_t now = time(NULL);
+
+  if (which == TIME_ATIME) {
+    uint32_t atime = current(node, inum, 0);
+    if (atime > current(node, inum, 1) && atime > current(node, inum, 2) &&
+        now < atime + ATIME_MAX_AGE) {
+      return;
+    }
+  }
+
+  for (int field = 0; field < 3; field++) {
+    if (which & (1 << field)) {
+      pending[inum][field] = now;
+    }
+  }
+  if (!(changed[inum] & TIME_LISTED)) {
+    list[list_count++] = inum;
+  }
+  changed[inum] |= which | TIME_LISTED;
+
+  if (!lazy) {
+    times_flush(node);
+  }
+}
+
+void times_flush(inode_t *node) {
+  int inum = inum_of(node);
+  if (!(changed[inum] & (TIME_ATIME | TIME_MTIME | TIME_CTIME))) {
+    return;
+  }
+  inode_dirty(node);
+  node->atime = current(node, inum, 0);
+  node->mtime = current(node, inum, 1);
+  node->ctime = current(node, inum, 2);
+  // stays in the list until the next times_flush_all
+  changed[inum] &= TIME_LISTED;
+}
+
+void times_flush_all() {
+  for (int i = 0; i < list_count; i++) {
+    times_flush(get_inode(list[i]));
+    changed[list[i]] = 0;
+  }
+  list_count = 0;
+}
+
+void times_forget(int inum) { changed[inum] &= TIME_LISTED; }
+
+void times_stat(inode_t *node, struct stat *st) {
+  int inum = inum_of(node);
+  st->st_atime = current(node, inum, 0);
+  st->st_mtime = current(node, inum, 1);
+  st->st_ctime = current(node, inum, 2);
+}
@@ -0,0 +1,34 @@
+// Lazily written file timestamps.
+//
+// Reads and writes only record the new times in memory, the inode table is
+// updated in batches by times_flush_all() (every few seconds, see the
+// lazytime mount option), or for a single file by times_flush() on fsync
+// and when it's closed. Access times follow relatime: they only change when
+// they're older than the last modification or a day old, so reading a file
+// over and over costs nothing.
+
+#ifndef TIMES_H
+#define TIMES_H
+
+#include <sys/stat.h>
+
+#include "inode.h"
+
+#define TIME_ATIME 0x1
+#define TIME_MTIME 0x2
+#define TIME_CTIME 0x4
+
+// lazy = 0 writes every change to the inode right away
+void times_init(int lazy);
+// records that the file was accessed (TIME_ATIME) or changed now
+void times_touch(inode_t *node, int which);
+// writes the file's recorded times to its inode
+void times_flush(inode_t *node);
+// writes all recorded times to the inode table
+void times_flush_all();
+// drops the recorded times of a freed inode
+void times_forget(int inum);
+// fills in the times of a stat, including those not written yet
+void times_stat(inode_t *node, struct stat *st);
+
+#endif
@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "span.h"
+#include "trace.h"
+
+#define TRACE_RING_SIZE (1 << 20)
+// how often the writer wakes up when the buffer isn't filling up fast
+#define TRACE_FLUSH_NS 100000000
+
+static int trace_fd = -1;
+static uint64_t trace_epoch;
+// callbacks that call other callbacks (like readdir calling getattr) are
+// only recorded once
+static __thread int depth = 0;
+
+// records go in at head and are written out from tail, both count bytes
+// since the start and only wrap when indexing
+static char ring[TRACE_RING_SIZE];
+static uint64_t head = 0;
+static uint64_t tail = 0;
+static uint64_t dropped = 0;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static int writing = 0;
+static int stopping = 0;
+
+static const char *op_names[TRACE_OP_COUNT] = {
+    [TRACE_ACCESS] = "access",   [TRACE_STATFS] = "statfs",
+    [TRACE_GETATTR] = "getattr", [TRACE_READDIR] = "readdir",
+    [TRACE_MKNOD] = "mknod",     [TRACE_UNLINK] = "unlink",
+    [TRACE_LINK] = "link",       [TRACE_RMDIR] = "rmdir",
+    [TRACE_RENAME] = "rename",   [TRACE_CHMOD] = "chmod",
+    [TRACE_TRUNCATE] = "truncate", [TRACE_OPEN] = "open",
+    [TRACE_READ] = "read",       [TRACE_WRITE] = "write",
+    [TRACE_UTIMENS] = "utimens", [TRACE_FSYNC] = "fsync",
+    [TRACE_RELEASE] = "release", [TRACE_IOCTL] = "ioctl",
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int trace_open(const char *path) {
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (trace_fd < 0) {
+    return -errno;
+  }
+  if (write(trace_fd, TRACE_MAGIC, 8) != 8) {
+    close(trace_fd);
+    trace_fd = -1;
+    return -EIO;
+  }
+  trace_epoch = now_ns();
+  return 0;
+}
+
+// writes out ring[from, to) (with to - from <= TRACE_RING_SIZE)
+static void write_out(uint64_t from, uint64_t to) {
+  while (from < to) {
+    size_t at = from % TRACE_RING_SIZE;
+    size_t len = to - from;
+    if (at + len > TRACE_RING_SIZE) {
+      len = TRACE_RING_SIZE - at;
+    }
+    ssize_t n = write(trace_fd, ring + at, len);
+    if (n <= 0) {
+      perror("trace");
+      return;
+    }
+    from += n;
+  }
+}
+
+static void *writer_thread(void *arg) {
+  pthread_mutex_lock(&ring_lock);
+  for (;;) {
+    if (head == tail && !stopping) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += TRACE_FLUSH_NS;
+      if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&ring_cond, &ring_lock, &until);
+    }
+    uint64_t from = tail;
+    uint64_t to = head;
+    if (from == to && stopping) {
+      break;
+    }
+    // the records between tail and head are ours until tail moves, new ones
+    // only go after head
+    pthread_mutex_unlock(&ring_lock);
+    write_out(from, to);
+    pthread_mutex_lock(&ring_lock);
+    tail = to;
+  }
+  pthread_mutex_unlock(&ring_lock);
+  return NULL;
+}
+
+void trace_start() {
+  if (trace_fd >= 0) {
+    writing = pthread_create(&writer, NULL, writer_thread, NULL) == 0;
+  }
+}
+
+void trace_stop() {
+  if (trace_fd < 0) {
+    return;
+  }
+  pthread_mutex_lock(&ring_lock);
+  stopping = 1;
+  pthread_cond_signal(&ring_cond);
+  pthread_mutex_unlock(&ring_lock);
+  if (writing) {
+    pthread_join(writer, NULL);
+  } else {
+    write_out(tail, head);
+  }
+  if (dropped > 0) {
+    printf("trace: dropped %lu records, the ring buffer was full\n",
+           (unsigned long)dropped);
+  }
+  close(trace_fd);
+  trace_fd = -1;
+}
+
+// (requests are also where sampled spans start and end, see span.h)
+uint64_t trace_begin() {
+  if (trace_fd < 0 && !span_enabled) {
+    return 0;
+  }
+  if (depth++ > 0) {
+    return 0;
+  }
+  span_request_begin();
+  return now_ns();
+}
+
+void trace_end(int op, uint64_t start, const char *path, const char *path2,
+               int64_t offset, uint64_t size, uint32_t mode, int result) {
+  if (trace_fd < 0 && !span_enabled) {
+    return;
+  }
+  depth--;
+  if (start == 0) {
+    return;
+  }
+  span_request_end(trace_op_name(op));
+  if (trace_fd < 0) {
+    return;
+  }
+
+  trace_record_t rec = {0};
+  rec.start = start - trace_epoch;
+  rec.duration = now_ns() - start;
+  rec.result = result;
+  rec.offset = offset;
+  rec.size = size;
+  rec.mode = mode;
+  rec.op = op;
+  rec.path_len = path ? strnlen(path, UINT16_MAX) : 0;
+  rec.path2_len = path2 ? strnlen(path2, UINT16_MAX) : 0;
+
+  const void *parts[3] = {&rec, path, path2};
+  size_t lens[3] = {sizeof(rec), rec.path_len, rec.path2_len};
+  size_t total = lens[0] + lens[1] + lens[2];
+
+  pthread_mutex_lock(&ring_lock);
+  if (head - tail + total > TRACE_RING_SIZE) {
+    dropped++;
+  } else {
+    for (int i = 0; i < 3; i++) {
+      for (size_t done = 0; done < lens[i];) {
+        size_t at = head % TRACE_RING_SIZE;
+        size_t len = lens[i] - done;
+        if (at + len > TRACE_RING_SIZE) {
+          len = TRACE_RING_SIZE - at;
+        }
+        memcpy(ring + at, (const char *)parts[i] + done, len);
+        done += len;
+        head += len;
+      }
+    }
+    // don't wait for the timer when the buffer is getting full
+    if (head - tail > TRACE_RING_SIZE / 2) {
+      pthread_cond_signal(&ring_cond);
+    }
+  }
+  pthread_mutex_unlock(&ring_lock);
+}
+
+int trace_read(FILE *trace, trace_record_t *rec, char *path, char *path2) {
+  if (fread(rec, sizeof(*rec), 1, trace) != 1 ||
+      fread(path, 1, rec->path_len, trace) != rec->path_len ||
+      fread(path2, 1, rec->path2_len, trace) != rec->path2_len) {
+    return 0;
+  }
+  path[rec->path_len] = 0;
+  path2[rec->path2_len] = 0;
+  return 1;
+}
+
+const char *trace_op_name(int op) {
+  if (op <= 0 || op >= TRACE_OP_COUNT) {
+    return "unknown";
+  }
+  return op_names[op];
+}
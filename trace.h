@@ -0,0 +1,73 @@
+// Recording of FUSE operations (the trace=FILE mount option).
+//
+// Every callback in nufs.c is wrapped in trace_begin()/trace_end(), which
+// appends a trace_record_t to an in-memory ring buffer. A background thread
+// writes the buffer out to the trace file, so recording never waits for the
+// disk; if the buffer fills up faster than it can be written, records are
+// dropped (and counted) instead. nufs-replay runs a trace against an image.
+//
+// The file starts with TRACE_MAGIC, followed by the records, each one
+// followed by its path(s).
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// (NUFSTRC1 traces had a 32-bit duration, which wrapped after 4.3s)
+#define TRACE_MAGIC "NUFSTRC2"
+
+enum {
+  TRACE_ACCESS = 1,
+  TRACE_STATFS,
+  TRACE_GETATTR,
+  TRACE_READDIR,
+  TRACE_MKNOD,
+  TRACE_UNLINK,
+  TRACE_LINK,
+  TRACE_RMDIR,
+  TRACE_RENAME,
+  TRACE_CHMOD,
+  TRACE_TRUNCATE,
+  TRACE_OPEN,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_UTIMENS,
+  TRACE_FSYNC,
+  TRACE_RELEASE,
+  TRACE_IOCTL,
+  TRACE_OP_COUNT
+};
+
+typedef struct trace_record {
+  uint64_t start;     // ns since the trace started
+  uint64_t duration;  // ns
+  int64_t offset;     // read/write/truncate offset or size, utimens atime
+  uint64_t size;      // read/write size, utimens mtime
+  int32_t result;     // what the callback returned
+  uint32_t mode;      // mknod mode, ioctl command
+  uint8_t op;         // TRACE_*
+  uint8_t _reserved;
+  uint16_t path_len;  // bytes of path after the record
+  uint16_t path2_len; // bytes of the second path (link and rename)
+  uint16_t _reserved2;
+} trace_record_t;
+
+// opens the trace file, has to happen before fuse changes directory
+int trace_open(const char *path);
+// starts and stops the writer thread (and closes the file)
+void trace_start();
+void trace_stop();
+
+// returns the start time of an operation, 0 if it isn't recorded
+uint64_t trace_begin();
+void trace_end(int op, uint64_t start, const char *path, const char *path2,
+               int64_t offset, uint64_t size, uint32_t mode, int result);
+
+// reads the next record from a trace, with its paths (null terminated, each
+// buffer has to hold 64KB), returns 0 at the end
+int trace_read(FILE *trace, trace_record_t *rec, char *path, char *path2);
+const char *trace_op_name(int op);
+
+#endif